@@ -31,6 +31,7 @@
 #define FLETCHER_STATUS_ERROR 1
 #define FLETCHER_STATUS_NO_PLATFORM 2
 #define FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY 3
+#define FLETCHER_STATUS_TIMEOUT 4
 
 /// Status for function return values
 typedef uint64_t fstatus_t;
@@ -50,6 +51,51 @@ typedef union {
   da_t full;
 } dau_t;
 
+/// A single host-to-device copy of a vectored transfer.
+typedef struct {
+  /// Source address in host memory.
+  const uint8_t *host_source;
+  /// Destination address in device memory.
+  da_t device_destination;
+  /// Number of bytes to copy.
+  int64_t size;
+} fcopy_t;
+
+/// A single MMIO register write of a batch.
+typedef struct {
+  /// Register offset to write to.
+  uint64_t offset;
+  /// Value to write.
+  uint32_t value;
+} fmmio_t;
+
+/// The device can access host memory at host virtual addresses, such that host buffers can be used in place.
+#define FLETCHER_CAP_SHARED_VIRTUAL_MEMORY  (1u << 0u)
+/// The device supports 64-bit MMIO accesses.
+#define FLETCHER_CAP_MMIO64                 (1u << 1u)
+
+/**
+ * Capabilities of a platform, reported through the optional platformGetCapabilities function.
+ *
+ * The caller sets size to the size of the structure it was compiled against. Platforms only fill fields that lie within
+ * that size, and set size to the number of bytes they filled, such that fields can be appended in the future without
+ * breaking older platform libraries or run-time libraries. Fields that are zero are unknown or not applicable.
+ */
+typedef struct {
+  /// Size of this structure in bytes.
+  uint64_t size;
+  /// Capability flags, see FLETCHER_CAP_*.
+  uint64_t flags;
+  /// Required alignment of device addresses and sizes of DMA transfers in bytes.
+  uint64_t dma_alignment;
+  /// Maximum number of bytes of a single DMA transfer.
+  uint64_t max_transfer_size;
+  /// Number of bytes of on-board device memory.
+  uint64_t device_memory;
+  /// Bit mask of the NUMA nodes the device is attached to.
+  uint64_t numa_node_mask;
+} fcaps_t;
+
 /// Device nullptr
 #define D_NULLPTR (da_t) 0x0
 
@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <memory>
 #include <string>
@@ -44,7 +45,11 @@ class RecordBatchAnalyzer : public arrow::ArrayVisitor {
     std::shared_ptr<arrow::Buffer> buf = array.values();
     auto desc = buf_name;
     desc.emplace_back("values");
-    out_->fields.back().buffers.emplace_back(buf->data(), buf->size(), desc, level);
+    // Skip whole elements up to the first row of a slice, and leave out elements beyond its last row.
+    auto width = std::static_pointer_cast<arrow::FixedWidthType>(array.type())->bit_width() / 8;
+    auto skip = (array.offset() - base) * width;
+    auto size = std::min(buf->size() - skip, (base + array.length()) * width);
+    out_->fields.back().buffers.emplace_back(buf->data() + skip, size, desc, level);
     return arrow::Status::OK();
   }
 
@@ -85,6 +90,8 @@ class RecordBatchAnalyzer : public arrow::ArrayVisitor {
 
   std::vector<std::string> buf_name;
   int level = 0;
+  /// The index at which the kernel sees the first element of arrays at the current nesting level.
+  int64_t base = 0;
   RecordBatchDescription *out_{};
   std::shared_ptr<arrow::Field> field;
 };
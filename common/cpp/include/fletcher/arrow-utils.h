@@ -39,6 +39,10 @@ struct BufferMetadata {
   /// non-nullable fields).
   bool implicit_ = false;
 
+  /// The buffer holding the data, if it was created during analysis rather than taken from the RecordBatch (e.g. a
+  /// realigned validity bitmap of a sliced array).
+  std::shared_ptr<arrow::Buffer> owner_;
+
   BufferMetadata(const uint8_t *raw_buffer,
                  int64_t size,
                  std::vector<std::string> desc,
@@ -60,6 +64,9 @@ struct FieldMetadata {
 struct RecordBatchDescription {
   std::string name;
   int64_t rows;
+  /// The index of the first row as seen by the kernel. Non-zero for sliced RecordBatches, of which the buffers start
+  /// up to seven rows before the first row such that validity bitmaps remain byte-aligned.
+  int64_t first_index = 0;
   std::vector<FieldMetadata> fields;
   Mode mode = Mode::READ;
   // Virtual means that the RecordBatch might exist logically but is not defined physically. This is useful when
@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
 
@@ -30,15 +32,70 @@ std::string RecordBatchDescription::ToString() const {
   return str.str();
 }
 
+/**
+ * @brief Copy \p length bits from \p src at bit \p src_offset to \p dst at bit \p dst_offset.
+ *
+ * After aligning the destination to a byte, bits are moved 64 at a time by funnel-shifting two source words. Assumes
+ * a little-endian host, like the Arrow bitmap layout.
+ */
+static void CopyBits(const uint8_t *src, int64_t src_offset, uint8_t *dst, int64_t dst_offset, int64_t length) {
+  auto copy_bit = [&]() {
+    auto bit = (src[src_offset / 8] >> (src_offset % 8)) & 1u;
+    auto mask = 1u << (dst_offset % 8);
+    dst[dst_offset / 8] = static_cast<uint8_t>((dst[dst_offset / 8] & ~mask) | (bit << (dst_offset % 8)));
+    src_offset++;
+    dst_offset++;
+    length--;
+  };
+  while ((length > 0) && (dst_offset % 8 != 0)) {
+    copy_bit();
+  }
+  auto shift = static_cast<unsigned>(src_offset % 8);
+  while (length >= 64) {
+    const uint8_t *s = src + src_offset / 8;
+    uint64_t word = 0;
+    std::memcpy(&word, s, sizeof(word));
+    if (shift != 0) {
+      word = (word >> shift) | (static_cast<uint64_t>(s[8]) << (64u - shift));
+    }
+    std::memcpy(dst + dst_offset / 8, &word, sizeof(word));
+    src_offset += 64;
+    dst_offset += 64;
+    length -= 64;
+  }
+  while (length > 0) {
+    copy_bit();
+  }
+}
+
 arrow::Status RecordBatchAnalyzer::VisitArray(const arrow::Array &arr) {
-  // buf_name += ":" + arr.type()->ToString();
-  // buf_name.push_back(arr.type()->ToString());
+  auto delta = arr.offset() - base;
+  if (delta < 0) {
+    return arrow::Status::NotImplemented("Array offset lies before the first row of the RecordBatch.");
+  }
   // Check if the field is nullable. If so, add the (implicit) validity bitmap buffer
   if (field->nullable()) {
     auto desc = buf_name;
     desc.emplace_back("validity");
-    if (arr.null_count() > 0) {
-      out_->fields.back().buffers.emplace_back(arr.null_bitmap()->data(), arr.null_bitmap()->size(), desc, level);
+    if ((arr.null_count() > 0) && (delta % 8 == 0)) {
+      // Skip whole bytes up to the first row of a slice, and leave out bytes beyond its last row.
+      out_->fields.back().buffers.emplace_back(arr.null_bitmap()->data() + delta / 8,
+                                               std::min(arr.null_bitmap()->size() - delta / 8,
+                                                        (base + arr.length() + 7) / 8),
+                                               desc,
+                                               level);
+    } else if (arr.null_count() > 0) {
+      // The bits of this slice do not line up with the first index, realign them into a new bitmap.
+      auto size = (base + arr.length() + 7) / 8;
+      auto result = arrow::AllocateBuffer(size);
+      if (!result.ok()) {
+        return result.status();
+      }
+      std::shared_ptr<arrow::Buffer> bitmap = std::move(result).ValueOrDie();
+      std::memset(bitmap->mutable_data(), 0, static_cast<size_t>(size));
+      CopyBits(arr.null_bitmap()->data(), arr.offset(), bitmap->mutable_data(), base, arr.length());
+      out_->fields.back().buffers.emplace_back(bitmap->data(), bitmap->size(), desc, level);
+      out_->fields.back().buffers.back().owner_ = bitmap;
     } else {
       auto dummy = std::make_shared<arrow::Buffer>(nullptr, 0);
       out_->fields.back().buffers.emplace_back(dummy->data(), dummy->size(), desc, level, true);
@@ -50,6 +107,14 @@ arrow::Status RecordBatchAnalyzer::VisitArray(const arrow::Array &arr) {
 bool RecordBatchAnalyzer::Analyze(const arrow::RecordBatch &batch) {
   out_->name = fletcher::GetMeta(*batch.schema(), fletcher::meta::NAME);
   out_->rows = batch.num_rows();
+  // Sliced columns are presented from the byte holding the bit of their first row onwards.
+  int64_t min_offset = 0;
+  for (int i = 0; i < batch.num_columns(); ++i) {
+    min_offset = (i == 0) ? batch.column(i)->offset() : std::min(min_offset, batch.column(i)->offset());
+  }
+  out_->first_index = min_offset % 8;
+  base = out_->first_index;
+  out_->mode = fletcher::GetMode(*batch.schema());
   // Depth-first search every column (arrow::Array) for buffers.
   for (int i = 0; i < batch.num_columns(); ++i) {
     auto arr = batch.column(i);
@@ -69,15 +134,31 @@ arrow::Status RecordBatchAnalyzer::VisitBinary(const arrow::BinaryArray &array)
   odesc.emplace_back("offsets");
   auto vdesc = buf_name;
   vdesc.emplace_back("values");
-  out_->fields.back().buffers.emplace_back(array.value_offsets()->data(), array.value_offsets()->size(), odesc, level);
-  out_->fields.back().buffers.emplace_back(array.value_data()->data(), array.value_data()->size(), vdesc, level);
+  // Offsets are absolute, so only the offsets buffer needs to start at the first row of a slice.
+  auto skip = static_cast<int64_t>((array.offset() - base) * sizeof(int32_t));
+  auto size = static_cast<int64_t>((base + array.length() + 1) * sizeof(int32_t));
+  out_->fields.back().buffers.emplace_back(array.value_offsets()->data() + skip,
+                                           std::min(array.value_offsets()->size() - skip, size),
+                                           odesc,
+                                           level);
+  // Values beyond the last offset are not used by the kernel, unless it is yet to write them.
+  auto values_size = array.value_data()->size();
+  if (out_->mode == Mode::READ) {
+    values_size = std::min(values_size, static_cast<int64_t>(array.value_offset(array.length())));
+  }
+  out_->fields.back().buffers.emplace_back(array.value_data()->data(), values_size, vdesc, level);
   return arrow::Status::OK();
 }
 
 arrow::Status RecordBatchAnalyzer::Visit(const arrow::ListArray &array) {
   auto desc = buf_name;
   desc.emplace_back("offsets");
-  out_->fields.back().buffers.emplace_back(array.value_offsets()->data(), array.value_offsets()->size(), desc, level);
+  auto skip = static_cast<int64_t>((array.offset() - base) * sizeof(int32_t));
+  auto size = static_cast<int64_t>((base + array.length() + 1) * sizeof(int32_t));
+  out_->fields.back().buffers.emplace_back(array.value_offsets()->data() + skip,
+                                           std::min(array.value_offsets()->size() - skip, size),
+                                           desc,
+                                           level);
   // Advance to the next nesting level.
   level++;
   // A list should only have one child.
@@ -85,8 +166,12 @@ arrow::Status RecordBatchAnalyzer::Visit(const arrow::ListArray &array) {
     return arrow::Status::TypeError("List type does not have exactly one child.");
   }
   field = field->type()->field(0);
-  // Visit the nested values array
-  return VisitArray(*array.values());
+  // Visit the nested values array, which is indexed through the absolute offsets.
+  auto list_base = base;
+  base = 0;
+  auto status = VisitArray(*array.values());
+  base = list_base;
+  return status;
 }
 
 arrow::Status RecordBatchAnalyzer::Visit(const arrow::StructArray &array) {
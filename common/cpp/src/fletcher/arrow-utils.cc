@@ -111,12 +111,12 @@ std::shared_ptr<arrow::Schema> WithMetaRequired(const arrow::Schema &schema,
 std::shared_ptr<arrow::Schema> WithMetaBusSpec(const arrow::Schema &schema,
                                                int aw,
                                                int dw,
-                                               int sw,
                                                int lw,
                                                int bs,
                                                int bm) {
+  // The format parsed by fletchgen::BusDim::FromString().
   std::stringstream ss;
-  ss << aw << "," << aw << "," << dw << "," << sw << "," << lw << "," << bs << "," << bm;
+  ss << aw << "," << dw << "," << lw << "," << bs << "," << bm;
   auto meta = std::make_shared<arrow::KeyValueMetadata>(std::vector<std::string>({meta::BUS_SPEC}),
                                                         std::vector<std::string>({ss.str()}));
   return schema.WithMetadata(meta);
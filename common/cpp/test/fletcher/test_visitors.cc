@@ -156,3 +156,69 @@ TEST(SchemaAnalyzer, VisitStruct) {
   ASSERT_EQ(rbd.fields[0].buffers[1].desc_, vs({"S", "B", "values"}));
   ASSERT_EQ(rbd.fields[0].buffers[1].size_, 0);
 }
+
+/// @brief Create an int32 array of \p length rows holding their row index, of which every third row is null.
+static std::shared_ptr<arrow::Array> GetSparseInt32Array(int32_t length) {
+  arrow::Int32Builder builder;
+  for (int32_t i = 0; i < length; i++) {
+    if (i % 3 == 0) {
+      EXPECT_TRUE(builder.AppendNull().ok());
+    } else {
+      EXPECT_TRUE(builder.Append(i).ok());
+    }
+  }
+  std::shared_ptr<arrow::Array> array;
+  EXPECT_TRUE(builder.Finish(&array).ok());
+  return array;
+}
+
+TEST(RecordBatchAnalyzer, VisitSlice) {
+  auto schema = arrow::schema({arrow::field("number", arrow::int32(), true),
+                               arrow::field("text", arrow::utf8(), false)});
+  auto numbers = GetSparseInt32Array(20);
+  arrow::StringBuilder builder;
+  for (int i = 0; i < 20; i++) {
+    ASSERT_TRUE(builder.Append(std::to_string(i)).ok());
+  }
+  std::shared_ptr<arrow::Array> strings;
+  ASSERT_TRUE(builder.Finish(&strings).ok());
+  auto rb = arrow::RecordBatch::Make(schema, 20, {numbers, strings})->Slice(11, 6);
+
+  fletcher::RecordBatchDescription rbd;
+  fletcher::RecordBatchAnalyzer rba(&rbd);
+  ASSERT_TRUE(rba.Analyze(*rb));
+  // Buffers start at the byte holding the validity bit of row 11, i.e. at row 8.
+  ASSERT_EQ(rbd.first_index, 3);
+  ASSERT_EQ(rbd.fields[0].buffers[0].raw_buffer_, numbers->null_bitmap_data() + 1);
+  ASSERT_EQ(rbd.fields[0].buffers[0].owner_, nullptr);
+  auto values = reinterpret_cast<const int32_t *>(rbd.fields[0].buffers[1].raw_buffer_);
+  ASSERT_EQ(values[rbd.first_index], 11);
+  auto offsets = reinterpret_cast<const int32_t *>(rbd.fields[1].buffers[0].raw_buffer_);
+  auto chars = reinterpret_cast<const char *>(rbd.fields[1].buffers[1].raw_buffer_);
+  ASSERT_EQ(std::string(chars + offsets[rbd.first_index], 2), "11");
+}
+
+TEST(RecordBatchAnalyzer, RealignValidity) {
+  auto schema = arrow::schema({arrow::field("a", arrow::int32(), true), arrow::field("b", arrow::int32(), true)});
+  auto numbers = GetSparseInt32Array(300);
+  auto a = numbers->Slice(3, 200);
+  auto b = numbers->Slice(6, 200);
+  auto rb = arrow::RecordBatch::Make(schema, 200, {a, b});
+
+  fletcher::RecordBatchDescription rbd;
+  fletcher::RecordBatchAnalyzer rba(&rbd);
+  ASSERT_TRUE(rba.Analyze(*rb));
+  ASSERT_EQ(rbd.first_index, 3);
+  // The validity bits of b are three rows off from the first index, so they are realigned into a new bitmap.
+  ASSERT_EQ(rbd.fields[0].buffers[0].owner_, nullptr);
+  ASSERT_NE(rbd.fields[1].buffers[0].owner_, nullptr);
+  auto bitmap = rbd.fields[1].buffers[0].raw_buffer_;
+  auto values = reinterpret_cast<const int32_t *>(rbd.fields[1].buffers[1].raw_buffer_);
+  for (int64_t i = 0; i < 200; i++) {
+    auto row = rbd.first_index + i;
+    ASSERT_EQ(((bitmap[row / 8] >> (row % 8)) & 1) == 1, b->IsValid(i));
+    if (b->IsValid(i)) {
+      ASSERT_EQ(values[row], 6 + i);
+    }
+  }
+}
@@ -228,12 +228,12 @@ int main(int argc, char **argv) {
   std::cout << "FPGA Process stream              : " << t.seconds() << std::endl;
 
   t.start();
-  // Get raw pointers to host-side Arrow buffers and reconstruct
-  auto sa = std::dynamic_pointer_cast<arrow::StringArray>(dataset_fpga->column(0));
-  auto raw_offsets = sa->value_offsets()->mutable_data();
-  auto raw_values = sa->value_data()->mutable_data();
-  platform->CopyDeviceToHost(context->device_buffer(0).device_address, raw_offsets, sizeof(int32_t) * (num_str + 1));
-  platform->CopyDeviceToHost(context->device_buffer(1).device_address, raw_values, (uint64_t) num_values);
+  // Copy back the offsets, and only as many characters as the kernel produced.
+  std::shared_ptr<fletcher::ResultRecordBatch> result;
+  std::shared_ptr<arrow::Array> column;
+  context->GetResultRecordBatch(0, &result).ewf("Could not obtain results.");
+  result->GetColumn(0, &column).ewf("Could not copy results to host.");
+  auto sa = std::dynamic_pointer_cast<arrow::StringArray>(column);
   t.stop();
   std::cout << "FPGA Device-to-Host              : " << t.seconds() << std::endl;
 
@@ -12,9 +12,18 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "fletcher/fletcher.h"
 
@@ -25,9 +34,165 @@
                                  }                                       \
                                  (void)0
 
-#define echo_print(...) do { if (!options.quiet) fprintf(stdout, __VA_ARGS__); } while (0)
+/// State of a virtual device.
+typedef struct {
+  /// Options passed upon initialization.
+  InitOptions options;
+  /// Whether the device was initialized.
+  int initialized;
+  /// File descriptor used to emulate kernel completion interrupts.
+  int completion_fd;
+  /// The register file.
+  uint32_t registers[FLETCHER_ECHO_NUM_REGISTERS];
+  /// The software kernel, NULL for the default kernel.
+  EchoKernel kernel;
+  /// User data passed to the software kernel.
+  void *kernel_data;
+  /// Handle of the shared library holding the software kernel, if loaded through FLETCHER_ECHO_KERNEL.
+  void *kernel_library;
+  /// The capabilities reported to the run-time library.
+  fcaps_t capabilities;
+  /// The cost model, all zero if disabled.
+  EchoCostModel cost;
+  /// Statistics.
+  EchoStats stats;
+  /// Wall-clock time at which the statistics were reset, in nanoseconds.
+  uint64_t stats_start_ns;
+  /// Bytes copied to the device since the previous kernel start.
+  uint64_t kernel_bytes;
+  /// Duration requested by the running software kernel through echoSetKernelDuration, in nanoseconds.
+  uint64_t kernel_duration_ns;
+  /// Wall-clock time at which a delayed kernel completes per instance, in nanoseconds, zero if it is not running.
+  uint64_t kernel_done_ns[FLETCHER_ECHO_MAX_INSTANCES];
+} EchoDevice;
+
+static EchoDevice devices[FLETCHER_ECHO_MAX_DEVICES];
+
+/// The device selected by the calling thread.
+static __thread size_t current_device = 0;
+
+#define DEVICE (&devices[current_device])
+
+#define echo_print(...) do { if (!DEVICE->options.quiet) fprintf(stdout, __VA_ARGS__); } while (0)
+
+/// @brief Return the time of a monotonic clock in nanoseconds.
+static uint64_t echoNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/// @brief Block the calling thread for \p ns nanoseconds.
+static void echoDelay(uint64_t ns) {
+  uint64_t until = echoNow() + ns;
+  // Sleep for the bulk of long delays, and spin for the remainder to be accurate.
+  if (ns > 200000) {
+    struct timespec ts;
+    uint64_t sleep_ns = ns - 100000;
+    ts.tv_sec = (time_t) (sleep_ns / 1000000000ull);
+    ts.tv_nsec = (long) (sleep_ns % 1000000000ull);
+    nanosleep(&ts, NULL);
+  }
+  while (echoNow() < until) {
+  }
+}
+
+/// @brief Account \p ns nanoseconds of modelled time to some statistic, delaying the caller if the model requires so.
+static void echoAccount(uint64_t *category, uint64_t ns) {
+  *category += ns;
+  DEVICE->stats.simulated_ns += ns;
+  if (DEVICE->cost.delay && (ns > 0)) {
+    echoDelay(ns);
+  }
+}
+
+/// @brief Account a DMA transfer of \p bytes bytes.
+static void echoAccountDMA(uint64_t bytes) {
+  double ns = (double) DEVICE->cost.dma_setup_ns;
+  // One GB/s equals one byte per nanosecond.
+  if (DEVICE->cost.dma_gbps > 0.0) {
+    ns += (double) bytes / DEVICE->cost.dma_gbps;
+  }
+  DEVICE->stats.dma_transfers++;
+  DEVICE->stats.dma_bytes += bytes;
+  echoAccount(&DEVICE->stats.dma_ns, (uint64_t) ns);
+}
+
+/// @brief Return whether a host-to-device copy respects the maximum transfer size and DMA alignment of the device.
+static int echoTransferFits(da_t device_destination, int64_t size) {
+  uint64_t max = DEVICE->capabilities.max_transfer_size;
+  uint64_t alignment = DEVICE->capabilities.dma_alignment;
+  if ((max != 0) && ((uint64_t) size > max)) {
+    echo_print("[ECHO] Copy of %ld bytes exceeds the maximum transfer size of %lu bytes.\n", size, max);
+    return 0;
+  }
+  if ((alignment > 1) && (size > 0) && (device_destination % alignment != 0)) {
+    echo_print("[ECHO] Copy to 0x%016lX is not aligned to %lu bytes.\n", device_destination, alignment);
+    return 0;
+  }
+  return 1;
+}
+
+fstatus_t echoGetCostModel(const char *name, EchoCostModel *model) {
+  size_t len = strcspn(name, ":");
+  memset(model, 0, sizeof(EchoCostModel));
+  if ((len == 2) && (strncmp(name, "f1", len) == 0)) {
+    model->mmio_read_ns = 1500;
+    model->mmio_write_ns = 250;
+    model->dma_setup_ns = 10000;
+    model->dma_gbps = 6.0;
+    model->kernel_bytes_per_cycle = 64.0;
+    model->kernel_mhz = 250.0;
+  } else if ((len == 8) && (strncmp(name, "opencapi", len) == 0)) {
+    model->mmio_read_ns = 700;
+    model->mmio_write_ns = 150;
+    model->dma_setup_ns = 1000;
+    model->dma_gbps = 20.0;
+    model->kernel_bytes_per_cycle = 128.0;
+    model->kernel_mhz = 200.0;
+  } else if (!((len == 4) && (strncmp(name, "none", len) == 0))) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // A ":delay" suffix makes calls take their modelled time.
+  if (name[len] == ':') {
+    if (strcmp(name + len + 1, "delay") != 0) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    model->delay = 1;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t echoSetCostModel(const EchoCostModel *model) {
+  if (model == NULL) {
+    memset(&DEVICE->cost, 0, sizeof(EchoCostModel));
+  } else {
+    DEVICE->cost = *model;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t echoGetStats(EchoStats *stats) {
+  *stats = DEVICE->stats;
+  stats->wall_ns = echoNow() - DEVICE->stats_start_ns;
+  return FLETCHER_STATUS_OK;
+}
 
-InitOptions options = {0};
+fstatus_t echoResetStats(void) {
+  memset(&DEVICE->stats, 0, sizeof(EchoStats));
+  DEVICE->stats_start_ns = echoNow();
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t echoSetCapabilities(const fcaps_t *capabilities) {
+  if (capabilities == NULL) {
+    memset(&DEVICE->capabilities, 0, sizeof(fcaps_t));
+  } else {
+    DEVICE->capabilities = *capabilities;
+  }
+  DEVICE->capabilities.size = sizeof(fcaps_t);
+  return FLETCHER_STATUS_OK;
+}
 
 fstatus_t platformGetName(char *name, size_t size) {
   size_t len = strlen(FLETCHER_PLATFORM_NAME);
@@ -40,32 +205,278 @@ fstatus_t platformGetName(char *name, size_t size) {
   return FLETCHER_STATUS_OK;
 }
 
+fstatus_t platformGetDeviceCount(size_t *count) {
+  const char *env = getenv(FLETCHER_ECHO_DEVICES_ENV);
+  unsigned long n = (env == NULL) ? 1 : strtoul(env, NULL, 10);
+  if (n < 1) {
+    n = 1;
+  } else if (n > FLETCHER_ECHO_MAX_DEVICES) {
+    n = FLETCHER_ECHO_MAX_DEVICES;
+  }
+  *count = (size_t) n;
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformSetDevice(size_t index) {
+  if (index >= FLETCHER_ECHO_MAX_DEVICES) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  current_device = index;
+  return FLETCHER_STATUS_OK;
+}
+
 fstatus_t platformInit(void *arg) {
   if (arg != NULL) {
-    options = *(InitOptions *) arg;
+    DEVICE->options = *(InitOptions *) arg;
+  }
+  echo_print("[ECHO] Initializing device %lu.      Arguments @ [host] %016lX.\n",
+             (unsigned long) current_device,
+             (unsigned long) arg);
+  if (!DEVICE->initialized) {
+    const char *interactive = getenv(FLETCHER_ECHO_INTERACTIVE_ENV);
+    const char *library = getenv(FLETCHER_ECHO_KERNEL_ENV);
+    if ((interactive != NULL) && (strcmp(interactive, "1") == 0)) {
+      DEVICE->options.interactive = 1;
+    }
+    const char *cost_model = getenv(FLETCHER_ECHO_COST_MODEL_ENV);
+    if ((cost_model != NULL) && (echoGetCostModel(cost_model, &DEVICE->cost) != FLETCHER_STATUS_OK)) {
+      fprintf(stderr, "[ECHO] Unknown cost model: %s\n", cost_model);
+      return FLETCHER_STATUS_ERROR;
+    }
+    echoResetStats();
+    DEVICE->kernel_bytes = 0;
+    memset(DEVICE->kernel_done_ns, 0, sizeof(DEVICE->kernel_done_ns));
+    memset(DEVICE->registers, 0, sizeof(DEVICE->registers));
+    for (size_t i = 0; i < FLETCHER_ECHO_MAX_INSTANCES; i++) {
+      DEVICE->registers[i * FLETCHER_ECHO_INSTANCE_REGISTERS + FLETCHER_REG_STATUS] = 1u << FLETCHER_REG_STATUS_IDLE;
+    }
+    // A kernel set through echoSetKernel takes precedence.
+    if ((library != NULL) && (DEVICE->kernel == NULL)) {
+      DEVICE->kernel_library = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+      if (DEVICE->kernel_library == NULL) {
+        fprintf(stderr, "[ECHO] Could not load software kernel: %s\n", dlerror());
+        return FLETCHER_STATUS_ERROR;
+      }
+      *(void **) (&DEVICE->kernel) = dlsym(DEVICE->kernel_library, FLETCHER_ECHO_KERNEL_SYMBOL);
+      if (DEVICE->kernel == NULL) {
+        fprintf(stderr, "[ECHO] Software kernel library does not define %s.\n", FLETCHER_ECHO_KERNEL_SYMBOL);
+        dlclose(DEVICE->kernel_library);
+        DEVICE->kernel_library = NULL;
+        return FLETCHER_STATUS_ERROR;
+      }
+      DEVICE->kernel_data = NULL;
+      echo_print("[ECHO] Loaded software kernel from %s.\n", library);
+    }
+    DEVICE->completion_fd = -1;
+#ifdef __linux__
+    DEVICE->completion_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (DEVICE->completion_fd < 0) {
+      return FLETCHER_STATUS_ERROR;
+    }
+#endif
+    DEVICE->initialized = 1;
   }
-  echo_print("[ECHO] Initializing platform.       Arguments @ [host] %016lX.\n", (unsigned long) arg);
   return FLETCHER_STATUS_OK;
 }
 
-fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value) {
+fstatus_t echoSetKernel(EchoKernel kernel, void *user_data) {
+  if (DEVICE->kernel_library != NULL) {
+    dlclose(DEVICE->kernel_library);
+    DEVICE->kernel_library = NULL;
+  }
+  DEVICE->kernel = kernel;
+  DEVICE->kernel_data = user_data;
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t echoSetKernelDuration(uint64_t ns) {
+  DEVICE->kernel_duration_ns = ns;
+  return FLETCHER_STATUS_OK;
+}
+
+/// @brief Set the status of an instance of the selected device to done, and raise a completion event.
+static fstatus_t echoSignalDone(size_t instance) {
+  size_t base = instance * FLETCHER_ECHO_INSTANCE_REGISTERS;
+  __atomic_store_n(&DEVICE->registers[base + FLETCHER_REG_STATUS], 1u << FLETCHER_REG_STATUS_DONE, __ATOMIC_RELEASE);
+#ifdef __linux__
+  uint64_t one = 1;
+  if (write(DEVICE->completion_fd, &one, sizeof(one)) != sizeof(one)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  echo_print("[ECHO] Signalled kernel completion of instance %lu.\n", (unsigned long) instance);
+#endif
+  return FLETCHER_STATUS_OK;
+}
+
+/// @brief Complete a delayed instance once its modelled duration has passed. May be called without the platform lock.
+static fstatus_t echoCompleteIfDue(size_t instance) {
+  uint64_t due = __atomic_load_n(&DEVICE->kernel_done_ns[instance], __ATOMIC_ACQUIRE);
+  if ((due != 0) && (echoNow() >= due)
+      && __atomic_compare_exchange_n(&DEVICE->kernel_done_ns[instance], &due, 0, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+    return echoSignalDone(instance);
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+/// @brief Run the kernel of an instance of the selected device, as if it was started.
+static fstatus_t echoRunKernel(size_t instance) {
+  fstatus_t status = FLETCHER_STATUS_OK;
+  uint64_t kernel_ns = 0;
+  size_t base = instance * FLETCHER_ECHO_INSTANCE_REGISTERS;
+  __atomic_store_n(&DEVICE->registers[base + FLETCHER_REG_STATUS], 1u << FLETCHER_REG_STATUS_BUSY, __ATOMIC_RELEASE);
+  DEVICE->kernel_duration_ns = 0;
+  if (DEVICE->kernel != NULL) {
+    status = DEVICE->kernel(DEVICE->registers + base, FLETCHER_ECHO_NUM_REGISTERS - base, DEVICE->kernel_data);
+    if (status != FLETCHER_STATUS_OK) {
+      echo_print("[ECHO] Software kernel failed.\n");
+      return status;
+    }
+  }
+  // The kernel is modelled to process all bytes copied to the device since it was last started.
+  if ((DEVICE->cost.kernel_bytes_per_cycle > 0.0) && (DEVICE->cost.kernel_mhz > 0.0)) {
+    kernel_ns = (uint64_t) ((double) DEVICE->kernel_bytes / DEVICE->cost.kernel_bytes_per_cycle
+        / DEVICE->cost.kernel_mhz * 1000.0);
+  }
+  DEVICE->kernel_bytes = 0;
+  DEVICE->stats.kernel_launches++;
+  DEVICE->stats.kernel_ns += kernel_ns + DEVICE->kernel_duration_ns;
+  DEVICE->stats.simulated_ns += kernel_ns + DEVICE->kernel_duration_ns;
+  // A delayed kernel runs in the background, and completes when it is polled after its modelled duration.
+  if ((DEVICE->cost.delay && (kernel_ns > 0)) || (DEVICE->kernel_duration_ns > 0)) {
+    kernel_ns = (DEVICE->cost.delay ? kernel_ns : 0) + DEVICE->kernel_duration_ns;
+    __atomic_store_n(&DEVICE->kernel_done_ns[instance], echoNow() + kernel_ns, __ATOMIC_RELEASE);
+    return FLETCHER_STATUS_OK;
+  }
+  return echoSignalDone(instance);
+}
+
+/// @brief Write a register of the selected device, without accounting the latency of the write.
+static fstatus_t echoWriteRegister(uint64_t offset, uint32_t value) {
   echo_print("[ECHO] Wrote MMIO register.       %04lu <= 0x%08X\n", offset, value);
+  if (offset >= FLETCHER_ECHO_NUM_REGISTERS) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  DEVICE->stats.mmio_writes++;
+  DEVICE->registers[offset] = value;
+  if (((offset % FLETCHER_ECHO_INSTANCE_REGISTERS) == FLETCHER_REG_CONTROL) && DEVICE->initialized) {
+    size_t instance = offset / FLETCHER_ECHO_INSTANCE_REGISTERS;
+    if (value & (1u << FLETCHER_REG_CONTROL_RESET)) {
+      // Abort a delayed kernel.
+      __atomic_store_n(&DEVICE->kernel_done_ns[instance], 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&DEVICE->registers[offset + FLETCHER_REG_STATUS], 1u << FLETCHER_REG_STATUS_IDLE,
+                       __ATOMIC_RELEASE);
+      DEVICE->registers[offset + FLETCHER_REG_RETURN0] = 0;
+      DEVICE->registers[offset + FLETCHER_REG_RETURN1] = 0;
+    } else if (value & (1u << FLETCHER_REG_CONTROL_START)) {
+      return echoRunKernel(instance);
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value) {
+  echoAccount(&DEVICE->stats.mmio_ns, DEVICE->cost.mmio_write_ns);
+  return echoWriteRegister(offset, value);
+}
+
+fstatus_t platformWriteMMIOBatch(const fmmio_t *writes, size_t count) {
+  fstatus_t status;
+  echo_print("[ECHO] Writing batch of %lu MMIO registers.\n", (unsigned long) count);
+  // Posted writes of a batch are modelled to pay the write latency only once.
+  if (count > 0) {
+    echoAccount(&DEVICE->stats.mmio_ns, DEVICE->cost.mmio_write_ns);
+  }
+  for (size_t i = 0; i < count; i++) {
+    status = echoWriteRegister(writes[i].offset, writes[i].value);
+    if (status != FLETCHER_STATUS_OK) {
+      return status;
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+#ifdef __linux__
+fstatus_t platformWaitForCompletion(uint64_t timeout_usec) {
+  struct pollfd pfd;
+  uint64_t count = 0;
+  uint64_t due, now, remaining_ns;
+  int timeout_ms;
+  int ret;
+
+  if (!DEVICE->initialized) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // Let the first delayed kernel complete if it is due within the timeout.
+  due = 0;
+  for (size_t i = 0; i < FLETCHER_ECHO_MAX_INSTANCES; i++) {
+    uint64_t instance_due = __atomic_load_n(&DEVICE->kernel_done_ns[i], __ATOMIC_ACQUIRE);
+    if ((instance_due != 0) && ((due == 0) || (instance_due < due))) {
+      due = instance_due;
+    }
+  }
+  if (due != 0) {
+    now = echoNow();
+    remaining_ns = due > now ? due - now : 0;
+    if (remaining_ns / 1000 <= timeout_usec) {
+      echoDelay(remaining_ns);
+      for (size_t i = 0; i < FLETCHER_ECHO_MAX_INSTANCES; i++) {
+        echoCompleteIfDue(i);
+      }
+      timeout_usec -= remaining_ns / 1000;
+    }
+  }
+  // Round up to milliseconds, saturating at the maximum poll timeout.
+  if (timeout_usec > (uint64_t) 0x7FFFFFFF * 1000) {
+    timeout_ms = 0x7FFFFFFF;
+  } else {
+    timeout_ms = (int) ((timeout_usec + 999) / 1000);
+  }
+  pfd.fd = DEVICE->completion_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ret = poll(&pfd, 1, timeout_ms);
+  if (ret == 0) {
+    return FLETCHER_STATUS_TIMEOUT;
+  }
+  // Consume a single completion.
+  if ((ret < 0) || (read(DEVICE->completion_fd, &count, sizeof(count)) != sizeof(count))) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  echo_print("[ECHO] Received kernel completion.\n");
   return FLETCHER_STATUS_OK;
 }
+#endif
 
 fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value) {
-  char buffer[256];
-  unsigned long val = 0;
-  printf("[ECHO] Enter the value for MMIO register at offset %lu: 0x", offset);
-  fgets(buffer, 256, stdin);
-  val = strtoul(buffer, NULL, 16);
-  *value = val;
+  if (DEVICE->options.interactive) {
+    char buffer[256];
+    printf("[ECHO] Enter the value for MMIO register at offset %lu: 0x", offset);
+    if (fgets(buffer, 256, stdin) == NULL) {
+      buffer[0] = '\0';
+    }
+    *value = (uint32_t) strtoul(buffer, NULL, 16);
+  } else if (offset < FLETCHER_ECHO_NUM_REGISTERS) {
+    if ((offset % FLETCHER_ECHO_INSTANCE_REGISTERS) == FLETCHER_REG_STATUS) {
+      echoCompleteIfDue(offset / FLETCHER_ECHO_INSTANCE_REGISTERS);
+    }
+    *value = __atomic_load_n(&DEVICE->registers[offset], __ATOMIC_ACQUIRE);
+  } else {
+    return FLETCHER_STATUS_ERROR;
+  }
+  DEVICE->stats.mmio_reads++;
+  echoAccount(&DEVICE->stats.mmio_ns, DEVICE->cost.mmio_read_ns);
   echo_print("[ECHO] Read MMIO register.       %04lu => 0x%08X\n", offset, *value);
   return FLETCHER_STATUS_OK;
 }
 
 fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size) {
+  if (!echoTransferFits(device_destination, size)) {
+    return FLETCHER_STATUS_ERROR;
+  }
   memcpy((void *) device_destination, host_source, size);
+  echoAccountDMA((uint64_t) size);
+  DEVICE->kernel_bytes += (uint64_t) size;
   echo_print("[ECHO] Copied from host to device.  [host] 0x%016lX --> [dev] 0x%016lX (%ld bytes)\n",
              (uint64_t) host_source,
              device_destination,
@@ -73,8 +484,27 @@ fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_desti
   return FLETCHER_STATUS_OK;
 }
 
+fstatus_t platformCopyHostToDeviceV(const fcopy_t *copies, size_t count) {
+  int64_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!echoTransferFits(copies[i].device_destination, copies[i].size)) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    memcpy((void *) copies[i].device_destination, copies[i].host_source, copies[i].size);
+    total += copies[i].size;
+  }
+  // A vector of copies is modelled as a single scatter-gather transfer.
+  echoAccountDMA((uint64_t) total);
+  DEVICE->kernel_bytes += (uint64_t) total;
+  echo_print("[ECHO] Copied vector from host to device. %lu copies (%ld bytes)\n", (unsigned long) count, total);
+  return FLETCHER_STATUS_OK;
+}
+
 fstatus_t platformCopyDeviceToHost(da_t device_source, uint8_t *host_destination, int64_t size) {
   memcpy(host_destination, (void *) device_source, size);
+  echoAccountDMA((uint64_t) size);
   echo_print("[ECHO] Copied from device to host.  [dev] 0x%016lX --> [host] 0x%016lX (%ld bytes)\n",
              device_source,
              (uint64_t) host_destination,
@@ -83,13 +513,29 @@ fstatus_t platformCopyDeviceToHost(da_t device_source, uint8_t *host_destination
 }
 
 fstatus_t platformTerminate(void *arg) {
-  echo_print("[ECHO] Terminating platform.        Arguments @ [host] 0x%016lX.\n", (uint64_t) arg);
+  echo_print("[ECHO] Terminating device %lu.       Arguments @ [host] 0x%016lX.\n",
+             (unsigned long) current_device,
+             (uint64_t) arg);
+  if (DEVICE->initialized) {
+    if (DEVICE->completion_fd >= 0) {
+      close(DEVICE->completion_fd);
+    }
+    if (DEVICE->kernel_library != NULL) {
+      dlclose(DEVICE->kernel_library);
+      DEVICE->kernel_library = NULL;
+      DEVICE->kernel = NULL;
+    }
+    DEVICE->initialized = 0;
+  }
   return FLETCHER_STATUS_OK;
 }
 
 fstatus_t platformDeviceMalloc(da_t *device_address, int64_t size) {
   // Aligned allocate some memory.
-  posix_memalign((void **) device_address, FLETCHER_ECHO_ALIGNMENT, (size_t) size);
+  if (posix_memalign((void **) device_address, FLETCHER_ECHO_ALIGNMENT, (size_t) size) != 0) {
+    echo_print("[ECHO] Allocating \"device\" memory failed.              (%10lu bytes).\n", size);
+    return FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY;
+  }
   echo_print("[ECHO] Allocating \"device\" memory.    [device] 0x%016lX (%10lu bytes).\n",
              (uint64_t) *device_address,
              size);
@@ -102,14 +548,38 @@ fstatus_t platformDeviceFree(da_t device_address) {
   return FLETCHER_STATUS_OK;
 }
 
+fstatus_t platformHostMalloc(uint8_t **host_address, da_t *device_address, int64_t size) {
+  if (posix_memalign((void **) host_address, FLETCHER_ECHO_ALIGNMENT, (size_t) size) != 0) {
+    echo_print("[ECHO] Allocating device-visible host memory failed.  (%10lu bytes).\n", size);
+    return FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY;
+  }
+  *device_address = (da_t) *host_address;
+  echo_print("[ECHO] Allocating host memory.      [host] 0x%016lX (%10lu bytes).\n", (uint64_t) *host_address, size);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformHostFree(uint8_t *host_address) {
+  echo_print("[ECHO] Freeing host memory.         [host] 0x%016lX.\n", (uint64_t) host_address);
+  free(host_address);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformGetCapabilities(fcaps_t *capabilities) {
+  size_t size = capabilities->size < sizeof(fcaps_t) ? (size_t) capabilities->size : sizeof(fcaps_t);
+  memcpy(capabilities, &DEVICE->capabilities, size);
+  capabilities->size = size;
+  echo_print("[ECHO] Reported capabilities.       (%lu bytes).\n", (unsigned long) size);
+  return FLETCHER_STATUS_OK;
+}
+
 fstatus_t platformPrepareHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size, int *alloced) {
   fstatus_t status;
 
   // Allocate new memory.
   status = platformDeviceMalloc(device_destination, size);
+  CHECK_STATUS(status);
   // We have newly allocated the buffer, signal this back to the caller.
   *alloced = 1;
-  CHECK_STATUS(status);
 
   // Copy data
   status = platformCopyHostToDevice(host_source, *device_destination, size);
@@ -131,6 +601,10 @@ fstatus_t platformCacheHostBuffer(const uint8_t *host_source, da_t *device_desti
 
   // Copy data
   status = platformCopyHostToDevice(host_source, *device_destination, size);
+  if (status != FLETCHER_STATUS_OK) {
+    platformDeviceFree(*device_destination);
+    return status;
+  }
 
   echo_print("[ECHO] Cached buffer on device.    [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
              (unsigned long) host_source,
@@ -16,20 +16,193 @@
 
 #include "fletcher/fletcher.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /// Platform name.
 #define FLETCHER_PLATFORM_NAME "echo"
 
 /// Alignment for allocations.
 #define FLETCHER_ECHO_ALIGNMENT 4096
 
+/// Maximum number of virtual devices.
+#define FLETCHER_ECHO_MAX_DEVICES 16
+
+/// Environment variable holding the number of virtual devices to expose, one if not set.
+#define FLETCHER_ECHO_DEVICES_ENV "FLETCHER_ECHO_DEVICES"
+
+/// Number of 32-bit registers in the register file of a virtual device.
+#define FLETCHER_ECHO_NUM_REGISTERS 4096
+
+/**
+ * Number of registers of the window of a kernel instance. Instance i has its registers at MMIO base offset
+ * i * FLETCHER_ECHO_INSTANCE_REGISTERS, such that designs with replicated kernels can be modelled.
+ */
+#define FLETCHER_ECHO_INSTANCE_REGISTERS 1024
+
+/// Number of kernel instances of a virtual device.
+#define FLETCHER_ECHO_MAX_INSTANCES (FLETCHER_ECHO_NUM_REGISTERS / FLETCHER_ECHO_INSTANCE_REGISTERS)
+
+/// Environment variable that, when set to 1, makes MMIO register reads take their value from stdin.
+#define FLETCHER_ECHO_INTERACTIVE_ENV "FLETCHER_ECHO_INTERACTIVE"
+
+/// Environment variable holding the path of a shared library with a software kernel, see EchoKernel.
+#define FLETCHER_ECHO_KERNEL_ENV "FLETCHER_ECHO_KERNEL"
+
+/// Name of the software kernel function looked up in the library set through FLETCHER_ECHO_KERNEL.
+#define FLETCHER_ECHO_KERNEL_SYMBOL "echoKernel"
+
+/// Environment variable holding the name of a cost model preset applied upon initialization, see echoGetCostModel.
+#define FLETCHER_ECHO_COST_MODEL_ENV "FLETCHER_ECHO_COST_MODEL"
+
 /// Platform options.
 typedef struct {
   int quiet;
+  /// Take the values of MMIO register reads from stdin instead of the register file.
+  int interactive;
 } InitOptions;
 
+/**
+ * @brief A software kernel, run by the echo platform when the start bit of the control register of an instance is
+ * written.
+ *
+ * The kernel has access to the register file of the device from the MMIO base of the started instance onwards, which
+ * holds the RecordBatch ranges, buffer addresses and arguments written by the host. Device addresses of the echo
+ * platform are host addresses. The kernel may write the return registers. Once it returns, the status register of the
+ * instance signals done, and a completion event is raised. See echoSetKernelDuration to complete later.
+ *
+ * A kernel in a shared library must be named echoKernel, see FLETCHER_ECHO_KERNEL_ENV. It receives NULL user data.
+ *
+ * @param registers             The register file of the device, from the MMIO base of the started instance.
+ * @param num_registers         The number of registers from the MMIO base of the started instance.
+ * @param user_data             The user data passed to echoSetKernel.
+ * @return                      FLETCHER_STATUS_OK if successful, otherwise the write of the start bit fails.
+ */
+typedef fstatus_t (*EchoKernel)(uint32_t *registers, size_t num_registers, void *user_data);
+
+/**
+ * @brief Costs of platform calls, to mimic the performance of a real device.
+ *
+ * Without a cost model, copies are plain memcpy calls, and MMIO accesses and kernels take no time. With a cost model,
+ * every call accounts the time it would take on the modelled device, see EchoStats. If delay is set, calls also take
+ * that time: MMIO accesses and copies block the caller, and the kernel signals done only after its modelled duration,
+ * such that host-side overlap of copies and kernel execution shows in wall time.
+ *
+ * The kernel is modelled to process all bytes copied to the device since its previous start.
+ */
+typedef struct {
+  /// Round-trip latency of an MMIO register read, in nanoseconds.
+  uint64_t mmio_read_ns;
+  /// Latency of an MMIO register write, or of a batch of writes, in nanoseconds.
+  uint64_t mmio_write_ns;
+  /// Fixed cost of setting up a DMA transfer, in nanoseconds. A vectored copy is a single transfer.
+  uint64_t dma_setup_ns;
+  /// Bandwidth of DMA transfers, in GB/s. Zero means infinitely fast.
+  double dma_gbps;
+  /// Number of bytes the kernel processes per cycle. Zero means the kernel takes no time.
+  double kernel_bytes_per_cycle;
+  /// Kernel clock frequency, in MHz.
+  double kernel_mhz;
+  /// Whether to actually delay calls, rather than only accounting their cost.
+  int delay;
+} EchoCostModel;
+
+/// Statistics of a virtual device, accumulated since initialization or the last call to echoResetStats.
+typedef struct {
+  /// The number of MMIO register reads.
+  uint64_t mmio_reads;
+  /// The number of MMIO register writes.
+  uint64_t mmio_writes;
+  /// The number of DMA transfers.
+  uint64_t dma_transfers;
+  /// The number of bytes transferred through DMA.
+  uint64_t dma_bytes;
+  /// The number of kernel launches.
+  uint64_t kernel_launches;
+  /// Modelled time spent on MMIO accesses, in nanoseconds.
+  uint64_t mmio_ns;
+  /// Modelled time spent on DMA transfers, in nanoseconds.
+  uint64_t dma_ns;
+  /// Modelled time spent on kernel execution, in nanoseconds.
+  uint64_t kernel_ns;
+  /// Modelled time of all calls, if none of them overlapped, in nanoseconds.
+  uint64_t simulated_ns;
+  /// Wall-clock time, in nanoseconds.
+  uint64_t wall_ns;
+} EchoStats;
+
+/**
+ * @brief Obtain a cost model preset.
+ *
+ * Available presets are "none", "f1" (a PCIe Gen3 x16 device like the AWS EC2 F1, which copies data to on-board memory)
+ * and "opencapi" (a coherently attached device, accessing host memory at low latency). The values are rough
+ * approximations, intended to compare host-side optimizations rather than to predict absolute performance.
+ * Appending ":delay" to the name, e.g. "f1:delay", sets the delay flag of the preset.
+ *
+ * @param name                  The name of the preset.
+ * @param model                 Pointer to store the cost model at.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR if the preset does not exist.
+ */
+fstatus_t echoGetCostModel(const char *name, EchoCostModel *model);
+
+/// @brief Set the cost model of the selected device. NULL disables the cost model.
+fstatus_t echoSetCostModel(const EchoCostModel *model);
+
+/// @brief Store the statistics of the selected device in \p stats.
+fstatus_t echoGetStats(EchoStats *stats);
+
+/// @brief Reset the statistics of the selected device.
+fstatus_t echoResetStats(void);
+
+/**
+ * @brief Set the capabilities the selected device reports through platformGetCapabilities.
+ *
+ * Allows the run-time library to be tested against the constraints of other platforms, e.g. a maximum transfer size.
+ * Host-to-device copies that exceed the maximum transfer size, or whose destination is not aligned to the DMA alignment,
+ * fail. By default, a device reports no capabilities and no constraints. The size field of \p capabilities is ignored.
+ *
+ * @param capabilities          The capabilities to report, or NULL to restore the default.
+ * @return                      FLETCHER_STATUS_OK.
+ */
+fstatus_t echoSetCapabilities(const fcaps_t *capabilities);
+
+/**
+ * @brief Set the software kernel of the device selected by the calling thread, see platformSetDevice.
+ *
+ * Without a software kernel, the echo kernel completes as soon as it is started, without returning any value.
+ *
+ * @param kernel                The kernel to run upon start, or NULL to restore the default kernel.
+ * @param user_data             Data passed to every invocation of the kernel.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t echoSetKernel(EchoKernel kernel, void *user_data);
+
+/**
+ * @brief Let the running software kernel take some time.
+ *
+ * Only to be called by a software kernel. The started instance signals done \p ns nanoseconds after it was started,
+ * in addition to the time of the cost model, and regardless of the delay flag of the cost model.
+ *
+ * @param ns                    The duration of the kernel in nanoseconds.
+ * @return                      FLETCHER_STATUS_OK.
+ */
+fstatus_t echoSetKernelDuration(uint64_t ns);
+
 /// @brief Store the platform name in a buffer of size /p size pointed to by /p name.
 fstatus_t platformGetName(char *name, size_t size);
 
+/// @brief Store the number of virtual devices in \p count, as set through the FLETCHER_ECHO_DEVICES variable.
+fstatus_t platformGetDeviceCount(size_t *count);
+
+/**
+ * @brief Select the device that subsequent calls from the calling thread apply to.
+ *
+ * Every device has its own state, so calls for different devices may be made from different threads at once. Calls
+ * for the same device are serialized by the run-time library.
+ */
+fstatus_t platformSetDevice(size_t index);
+
 /// @brief Initialize the platform. \p arg may point to a null pointer or some custom structure for initialization
 /// arguments.
 fstatus_t platformInit(void *arg);
@@ -37,12 +210,52 @@ fstatus_t platformInit(void *arg);
 /// @brief Write \p value to MMIO register \p offset.
 fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value);
 
-/// @brief Read MMIO register \p offset into \p value. For the Echo platform, the value is taken from stdin.
+/**
+ * @brief Perform \p count MMIO register writes described by \p writes, in order.
+ *
+ * Platforms that can combine register writes (e.g. into a single PCIe transaction or ioctl) should implement this
+ * function, such that the run-time library can program kernel metadata at once.
+ *
+ * @param writes                The register writes to perform.
+ * @param count                 The number of register writes.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformWriteMMIOBatch(const fmmio_t *writes, size_t count);
+
+/**
+ * @brief Read MMIO register \p offset into \p value.
+ *
+ * For the Echo platform, the value is taken from the register file of the device, or from stdin in interactive mode.
+ */
 fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value);
 
+/**
+ * @brief Block until the kernel signals completion, or until \p timeout_usec microseconds have passed.
+ *
+ * The echo platform emulates completion interrupts with an eventfd that is signalled whenever the start bit of the
+ * control register is written, after the software kernel (see EchoKernel) has run. Only available on Linux.
+ *
+ * @param timeout_usec          Maximum time to wait in microseconds, zero to only check for a pending completion.
+ * @return                      FLETCHER_STATUS_OK on completion, FLETCHER_STATUS_TIMEOUT if the timeout expired,
+ *                              FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformWaitForCompletion(uint64_t timeout_usec);
+
 /// @brief Copy \p size bytes from host address \p host_source to device address \p device_destination.
 fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size);
 
+/**
+ * @brief Perform \p count host-to-device copies described by \p copies as a single transfer.
+ *
+ * Platforms that can gather scattered host memory in one DMA transfer should implement this function, such that the
+ * run-time library can upload all buffers of a RecordBatch at once.
+ *
+ * @param copies                The copies to perform.
+ * @param count                 The number of copies.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformCopyHostToDeviceV(const fcopy_t *copies, size_t count);
+
 /// @brief Copy \p size bytes from device address \p device_source to host address \p host_destination.
 fstatus_t platformCopyDeviceToHost(da_t device_source, uint8_t *host_destination, int64_t size);
 
@@ -57,6 +270,36 @@ fstatus_t platformDeviceMalloc(da_t *device_address, int64_t size);
 /// @brief Free the memory allocated at \p device_address.
 fstatus_t platformDeviceFree(da_t device_address);
 
+/**
+ * @brief Allocate \p size bytes of pinned host memory that the device can access in place.
+ *
+ * The memory must be aligned to at least 64 bytes. Buffers in such memory need not be copied before the device can use
+ * them. The host address is stored at \p host_address, the address at which the device sees the same memory is stored
+ * at \p device_address.
+ *
+ * For the Echo platform, the device shares the address space of the host, so both addresses are the same.
+ *
+ * @param host_address          Pointer to store the host address at.
+ * @param device_address        Pointer to store the device address at.
+ * @param size                  Number of bytes to allocate.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY otherwise.
+ */
+fstatus_t platformHostMalloc(uint8_t **host_address, da_t *device_address, int64_t size);
+
+/// @brief Free the host memory allocated at \p host_address through platformHostMalloc.
+fstatus_t platformHostFree(uint8_t *host_address);
+
+/**
+ * @brief Obtain the capabilities of the platform.
+ *
+ * Only the first capabilities->size bytes of the structure are filled, after which size is set to the number of bytes
+ * filled.
+ *
+ * @param capabilities          The capabilities, of which the caller sets the size field.
+ * @return                      FLETCHER_STATUS_OK.
+ */
+fstatus_t platformGetCapabilities(fcaps_t *capabilities);
+
 /**
  * @brief Ensure the device can read \p size bytes from a host buffer at \p host_source.
  *
@@ -102,3 +345,7 @@ fstatus_t platformCacheHostBuffer(const uint8_t *host_source, da_t *device_desti
  * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR otherwise.
  */
 fstatus_t platformTerminate(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
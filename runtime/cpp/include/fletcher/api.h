@@ -29,6 +29,17 @@
 #include "fletcher/context.h"
 #include "fletcher/platform.h"
 #include "fletcher/kernel.h"
+#include "fletcher/future.h"
+#include "fletcher/executor.h"
+#include "fletcher/pool.h"
+#include "fletcher/cache.h"
+#include "fletcher/scheduler.h"
+#include "fletcher/sharding.h"
+#include "fletcher/result.h"
+#include "fletcher/table.h"
+#include "fletcher/trace.h"
+#include "fletcher/profiler.h"
+#include "fletcher/numa.h"
 
 /// Contains all Fletcher classes and functions for use in run-time applications.
 namespace fletcher {
@@ -0,0 +1,175 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fletcher/fletcher.h>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "fletcher/platform.h"
+#include "fletcher/pool.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// Statistics of a DeviceBufferCache.
+struct CacheStats {
+  /// The number of times a device copy was found in the cache.
+  size_t hits = 0;
+  /// The number of times a host buffer had to be copied to the device.
+  size_t misses = 0;
+  /// The number of device copies evicted to make room for others.
+  size_t evictions = 0;
+  /// The number of device copies in the cache.
+  size_t entries = 0;
+  /// The number of bytes of all device copies in the cache.
+  size_t bytes = 0;
+
+  /// @brief Return the ratio of hits over all lookups.
+  double hit_rate() const {
+    return (hits + misses) == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(hits + misses);
+  }
+};
+
+/**
+ * @brief A platform-wide cache of device copies of host buffers.
+ *
+ * Host buffers are identified by their address, size and a generation that is bumped through Invalidate() whenever
+ * the host data changes. Optionally, buffers are identified by their contents instead, such that unchanged data is
+ * found regardless of its host address and without explicit invalidation. Contents are looked up by a hash, after
+ * which they are compared to a host copy of the cached data, so this costs hashing, comparing and host memory.
+ *
+ * Device copies that are not referenced by any Context are evicted in least-recently-used order when the capacity of
+ * the cache is exceeded or the device runs out of memory. All functions are thread-safe.
+ */
+class DeviceBufferCache {
+ public:
+  /**
+   * @brief Construct a new DeviceBufferCache.
+   * @param[in] platform       The platform to cache buffers on.
+   * @param[in] capacity       The maximum number of bytes of device copies in the cache, zero for no limit.
+   * @param[in] hash_contents  Whether to identify buffers by a hash of their contents.
+   */
+  DeviceBufferCache(std::shared_ptr<Platform> platform, size_t capacity, bool hash_contents);
+
+  /// @brief Destruct the cache, freeing all device copies.
+  ~DeviceBufferCache();
+
+  /**
+   * @brief Create a new DeviceBufferCache.
+   * @param[out] out            A pointer to a shared pointer that will own the new cache.
+   * @param[in]  platform       The platform to cache buffers on.
+   * @param[in]  capacity       The maximum number of bytes of device copies in the cache, zero for no limit.
+   * @param[in]  hash_contents  Whether to identify buffers by a hash of their contents.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<DeviceBufferCache> *out,
+                     const std::shared_ptr<Platform> &platform,
+                     size_t capacity = 0,
+                     bool hash_contents = false);
+
+  /**
+   * @brief Obtain a device copy of a host buffer, copying it to the device only if it is not cached yet.
+   *
+   * Every successful call must be matched by a call to Release().
+   *
+   * @param[in]  host_address   The host address of the buffer.
+   * @param[in]  size           The size of the buffer in bytes.
+   * @param[out] device_address The device address of the copy.
+   * @return Status::OK() if successful, Status::DEVICE_OUT_OF_MEMORY() if nothing could be evicted to make room,
+   *         otherwise a descriptive error status.
+   */
+  Status Acquire(const uint8_t *host_address, int64_t size, da_t *device_address);
+
+  /**
+   * @brief Release a reference to a device copy obtained through Acquire(). The copy remains cached.
+   * @param[in] device_address The device address of the copy.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Release(da_t device_address);
+
+  /**
+   * @brief Signal that the host data at some address has changed, such that cached copies are no longer used.
+   *
+   * Not needed if buffers are identified by their contents.
+   *
+   * @param[in] host_address The host address of the buffer that changed.
+   */
+  void Invalidate(const uint8_t *host_address);
+
+  /// @brief Evict all device copies that are not referenced.
+  Status Clear();
+
+  /// @brief Return the statistics of the cache.
+  CacheStats stats() const;
+
+  /// @brief Allocate device copies from a DeviceMemoryPool rather than through the platform.
+  void set_memory_pool(std::shared_ptr<DeviceMemoryPool> pool);
+
+ protected:
+  /// Host address, size and generation of a host buffer, or a collision index, size and hash of its contents.
+  using Key = std::tuple<uintptr_t, int64_t, uint64_t>;
+
+  /// A device copy of a host buffer.
+  struct Entry {
+    /// The device address of the copy.
+    da_t device_address = D_NULLPTR;
+    /// The size of the copy in bytes.
+    int64_t size = 0;
+    /// The number of outstanding Acquire() calls.
+    size_t references = 0;
+    /// The position of this entry in the LRU list.
+    std::list<Key>::iterator lru;
+    /// A host copy of the cached data, to compare with when buffers are identified by their contents.
+    std::vector<uint8_t> contents;
+  };
+
+  /// @brief Free a device copy and remove its entry.
+  Status EvictEntry(std::map<Key, Entry>::iterator entry);
+  /// @brief Forget the generation of a host address of which no device copies are cached anymore.
+  void PruneGeneration(uintptr_t host_address);
+  /// @brief Evict least-recently-used entries until \p bytes fit, returning false if not enough could be evicted.
+  bool EvictFor(int64_t bytes);
+  /// @brief Allocate device memory for a copy, evicting entries when the device is out of memory.
+  Status AllocateEvicting(da_t *device_address, int64_t size);
+
+  /// The platform to cache buffers on.
+  std::shared_ptr<Platform> platform_;
+  /// The pool to allocate device copies from, if any.
+  std::shared_ptr<DeviceMemoryPool> pool_;
+  /// The maximum number of bytes in the cache, zero for no limit.
+  size_t capacity_;
+  /// Whether to identify buffers by a hash of their contents.
+  bool hash_contents_;
+  /// The cached device copies.
+  std::map<Key, Entry> entries_;
+  /// Keys of entries, from most to least recently used.
+  std::list<Key> lru_;
+  /// Keys of entries, by device address.
+  std::map<da_t, Key> by_device_address_;
+  /// Generations of host addresses that were invalidated, while copies of them were cached.
+  std::map<uintptr_t, uint64_t> generations_;
+  /// Statistics.
+  CacheStats stats_;
+  /// Mutex protecting all members above.
+  mutable std::mutex mutex_;
+};
+
+}  // namespace fletcher
@@ -22,6 +22,9 @@
 #include <iostream>
 
 #include "fletcher/platform.h"
+#include "fletcher/pool.h"
+#include "fletcher/cache.h"
+#include "fletcher/numa.h"
 #include "fletcher/status.h"
 
 namespace fletcher {
@@ -52,6 +55,38 @@ enum class MemType {
       CACHE
 };
 
+/// Enumeration for the ways to upload the buffers of a RecordBatch to device memory.
+enum class UploadMode {
+  /// Allocate and copy every buffer separately.
+      PER_BUFFER,
+
+  /**
+   * @brief Lay out all buffers of a RecordBatch in a single device allocation and copy them with a single transfer.
+   *
+   * Buffers are placed at offsets aligned to the packing alignment of the Context. This avoids the per-transfer
+   * overhead that dominates the many small buffers (validity bitmaps, offsets) of a RecordBatch. Platforms that support
+   * vectored copies gather the buffers directly, otherwise they are packed in a host-side staging buffer first.
+   */
+      PACKED,
+
+  /**
+   * @brief Allocate every buffer separately, and copy it in transfers of at most the chunk size of the Context.
+   *
+   * For platforms that limit the size of a single DMA transfer.
+   */
+      CHUNKED,
+
+  /**
+   * @brief Choose an upload mode for every RecordBatch from the capabilities the platform reports.
+   *
+   * Buffers that the device can access in place (with MemType::ANY on platforms with shared virtual memory or
+   * device-visible host memory) are not copied. Otherwise, RecordBatches are uploaded CHUNKED if they exceed the
+   * maximum transfer size of the platform, and PACKED if not. Platforms that do not report their capabilities are
+   * treated as in PER_BUFFER mode.
+   */
+      AUTO
+};
+
 /// A buffer on the device
 struct DeviceBuffer {
   /// The host-side mirror address of this buffer.
@@ -60,6 +95,8 @@ struct DeviceBuffer {
   da_t device_address = D_NULLPTR;
   /// The size of this buffer in bytes.
   int64_t size = 0;
+  /// The size of the device allocation backing this buffer in bytes, if it was allocated.
+  int64_t capacity = 0;
 
   /// The memory type of this buffer.
   MemType memory = MemType::CACHE;
@@ -68,8 +105,16 @@ struct DeviceBuffer {
 
   /// Whether this buffer has been made available to the device.
   bool available_to_device = false;
-  /// Whether this buffer was allocated on the device using Platform malloc.
+  /// Whether this buffer was allocated on the device using Platform malloc or a DeviceMemoryPool.
   bool was_alloced = false;
+  /// Whether the device accesses this buffer in place, because it lives in device-visible host memory.
+  bool zero_copy = false;
+  /// The DeviceMemoryPool the allocation of this buffer was obtained from, if any.
+  std::shared_ptr<DeviceMemoryPool> pool;
+  /// The DeviceBufferCache holding the device copy of this buffer, if any.
+  std::shared_ptr<DeviceBufferCache> cache;
+  /// The StagingArena block holding the realigned copy the device accesses instead of the host buffer, if any.
+  std::shared_ptr<uint8_t> staging;
 
   /// @brief Construct a default DeviceBuffer.
   DeviceBuffer() = default;
@@ -79,8 +124,20 @@ struct DeviceBuffer {
       : host_address(host_address), size(size), memory(type), mode(access_mode) {}
 };
 
+/// Statistics of the buffers a Context realigned, see Context::set_realign().
+struct RealignStats {
+  /// The number of buffers copied into the staging arena.
+  uint64_t buffers = 0;
+  /// The number of bytes copied into the staging arena.
+  uint64_t bytes = 0;
+  /// The number of bytes of host memory currently held by the staging arena.
+  uint64_t staging_bytes = 0;
+};
+
+class ResultRecordBatch;
+
 /// A Context for a platform where a RecordBatches can be prepared for processing by the Kernel.
-class Context {
+class Context : public std::enable_shared_from_this<Context> {
  public:
   /**
    * @brief Context constructor.
@@ -112,18 +169,175 @@ class Context {
   Status QueueRecordBatch(const std::shared_ptr<arrow::RecordBatch> &record_batch,
                           MemType mem_type = MemType::ANY);
 
+  /**
+   * @brief Replace a queued arrow::RecordBatch by another one.
+   *
+   * The device buffers of the old RecordBatch are freed immediately. Only the new RecordBatch is prepared by the next
+   * call to Enable(); the device buffers of all other RecordBatches are left untouched. The new RecordBatch must have
+   * the same schema and number of buffers as the old one, as kernels keep the register layout of the old one.
+   *
+   * @param[in] i             The index of the RecordBatch to replace.
+   * @param[in] record_batch  The arrow::RecordBatch to queue in its place.
+   * @param[in] mem_type      Force caching; i.e. the RecordBatch is guaranteed to be copied to on-board memory.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status ReplaceRecordBatch(size_t i,
+                            const std::shared_ptr<arrow::RecordBatch> &record_batch,
+                            MemType mem_type = MemType::ANY);
+
+  /**
+   * @brief Remove a queued arrow::RecordBatch, freeing its device buffers immediately.
+   *
+   * The indices of all subsequent RecordBatches decrease by one.
+   *
+   * @param[in] i The index of the RecordBatch to remove.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Remove(size_t i);
+
   /// @brief Obtain the size (in bytes) of all buffers currently enqueued.
   size_t GetQueueSize() const;
 
-  /// @brief Enable the usage of the enqueued buffers by the device.
+  /**
+   * @brief Enable the usage of the enqueued buffers by the device.
+   *
+   * Only RecordBatches that were queued or replaced after the previous call to Enable() are prepared.
+   *
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
   Status Enable();
 
+  /**
+   * @brief Remove all RecordBatches from this context, retaining device allocations for reuse.
+   *
+   * The next call to Enable() copies the buffers of newly queued RecordBatches into the retained allocations, rather
+   * than allocating new device memory, as long as they fit. Retained allocations that are not reused are freed by
+   * Enable().
+   */
+  void Clear();
+
+  /**
+   * @brief Obtain the results a kernel wrote to the device buffers of an enabled RecordBatch.
+   *
+   * Intended for RecordBatches of write-mode schemas, that were queued with buffers large enough to hold the worst-case
+   * output. Columns are copied back lazily, and only up to the size actually produced by the kernel. See
+   * ResultRecordBatch. The Context must be owned by a std::shared_ptr, as obtained through Make().
+   *
+   * @param[in]  i        The index of the RecordBatch.
+   * @param[out] out      The results.
+   * @param[in]  num_rows The number of rows produced by the kernel, or -1 for all rows of the RecordBatch.
+   * @param[in]  pool     The memory pool to allocate host buffers from.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status GetResultRecordBatch(size_t i,
+                              std::shared_ptr<ResultRecordBatch> *out,
+                              int64_t num_rows = -1,
+                              arrow::MemoryPool *pool = arrow::default_memory_pool());
+
   /// @brief Return the platform this context is active on.
   std::shared_ptr<Platform> platform() const { return platform_; }
 
-  /// @brief Return the number of device buffers in this context.
+  /**
+   * @brief Allocate device buffers from a DeviceMemoryPool rather than through the platform.
+   *
+   * The pool is used for buffers of RecordBatches queued with MemType::CACHE, that always require a device allocation.
+   * Buffers that were already enabled keep their current allocation.
+   *
+   * @param[in] pool The pool to allocate from, or nullptr to allocate through the platform.
+   */
+  void set_memory_pool(std::shared_ptr<DeviceMemoryPool> pool) { pool_ = std::move(pool); }
+
+  /// @brief Return the DeviceMemoryPool of this context, if any.
+  std::shared_ptr<DeviceMemoryPool> memory_pool() const { return pool_; }
+
+  /**
+   * @brief Obtain device copies of buffers from a DeviceBufferCache, which may be shared by many contexts.
+   *
+   * The cache is used for buffers of RecordBatches queued with MemType::CACHE, and takes precedence over the memory
+   * pool of this context. Buffers that were already enabled keep their current device copy.
+   *
+   * @param[in] cache The cache to use, or nullptr to always copy buffers to the device.
+   */
+  void set_buffer_cache(std::shared_ptr<DeviceBufferCache> cache) { cache_ = std::move(cache); }
+
+  /// @brief Return the DeviceBufferCache of this context, if any.
+  std::shared_ptr<DeviceBufferCache> buffer_cache() const { return cache_; }
+
+  /**
+   * @brief Set how the buffers of RecordBatches are uploaded to the device.
+   *
+   * PACKED applies to RecordBatches queued with MemType::CACHE only. Buffers obtained from a DeviceBufferCache are
+   * always uploaded one by one. The alignment is raised to the DMA alignment the platform reports, if larger.
+   *
+   * @param[in] mode      The upload mode.
+   * @param[in] alignment The alignment in bytes of buffers within a packed allocation, e.g. the bus burst size.
+   */
+  void set_upload_mode(UploadMode mode, size_t alignment = 64) {
+    upload_mode_ = mode;
+    packed_alignment_ = alignment;
+  }
+
+  /// @brief Return the upload mode of this context.
+  UploadMode upload_mode() const { return upload_mode_; }
+
+  /**
+   * @brief Set the maximum number of bytes of a single transfer of a CHUNKED upload.
+   * @param[in] size The chunk size, or zero to use the maximum transfer size the platform reports, if any.
+   */
+  void set_chunk_size(size_t size) { chunk_size_ = size; }
+
+  /// @brief Return the maximum number of bytes of a single transfer of a CHUNKED upload, as of the last Enable().
+  size_t chunk_size() const;
+
+  /**
+   * @brief Set whether to realign buffers that the device accesses in place, but not at burst boundaries.
+   *
+   * The hardware BufferReaders read whole bursts. A buffer that does not start at a burst boundary costs an extra
+   * burst for every burst it spans, which halves the bus efficiency for short bursts. This affects buffers of
+   * RecordBatches queued with MemType::ANY that the device accesses in place, i.e. buffers in device-visible host
+   * memory and, on platforms with shared virtual memory, any host buffer. Buffers of sliced Arrays and buffers
+   * created by third-party libraries are often misaligned.
+   *
+   * When enabled, Enable() copies such buffers into a reusable staging arena, padded to whole bursts, and hands the
+   * copy to the device instead. Buffers in device-visible host memory of which the last burst would extend beyond
+   * their allocation are realigned as well. The burst size is taken from the fletcher_bus_spec metadata of the schema
+   * of a RecordBatch, and defaults to 64 bytes. Buffers of write-mode RecordBatches are never realigned, as the kernel
+   * must write to them in place. Buffers that are copied to on-board memory are always aligned by the allocator.
+   *
+   * @param[in] enable Whether to realign buffers. Enabled by default.
+   */
+  void set_realign(bool enable) { realign_ = enable; }
+
+  /// @brief Return whether buffers are realigned.
+  bool realign() const { return realign_; }
+
+  /// @brief Return the statistics of the buffers this context realigned.
+  RealignStats realign_stats() const;
+
+  /**
+   * @brief Place the host memory and threads of this context on the NUMA node of the device.
+   *
+   * Staging buffers of realigned buffers and packed uploads are allocated on the node, and Enable() runs pinned to the
+   * cores of the node if the placement pins threads. Copies to the device are accounted to the placement by the node of
+   * their source, see NumaPlacement::copy_stats(). Staging memory allocated before this call is released once it is no
+   * longer referenced.
+   *
+   * @param[in] numa The NUMA placement, or nullptr to allocate without placement.
+   */
+  void set_numa(std::shared_ptr<NumaPlacement> numa);
+
+  /// @brief Return the NUMA placement of this context, if any.
+  std::shared_ptr<NumaPlacement> numa() const { return numa_; }
+
+  /// @brief Return a counter that changes whenever the RecordBatches or device buffers of this context change.
+  uint64_t generation() const { return generation_; }
+
+  /// @brief Return the number of device buffers in this context, including those of RecordBatches not enabled yet.
   uint64_t num_buffers() const;
 
+  /// @brief Return true if all RecordBatches of this context are enabled, i.e. none is queued or replaced since.
+  bool enabled() const;
+
   /**
    * @brief Return the i-th DeviceBuffer of this context.
    * @param[in] i The index of the DeviceBuffer to return.
@@ -141,9 +355,23 @@ class Context {
    */
   std::shared_ptr<arrow::RecordBatch> recordbatch(size_t i) const { return host_batches_[i]; }
 
+  /**
+   * @brief Return the index at which the kernel sees the first row of the i-th RecordBatch.
+   *
+   * This is non-zero for sliced RecordBatches whose first row does not start a byte of the validity bitmaps.
+   *
+   * @param[in] i The index of the RecordBatch.
+   * @return The first index.
+   */
+  int64_t first_index(size_t i) const { return host_batch_desc_[i].first_index; }
+
  protected:
   /// The platform this context is running on.
   std::shared_ptr<Platform> platform_;
+  /// The pool to allocate device buffers from, if any.
+  std::shared_ptr<DeviceMemoryPool> pool_;
+  /// The cache to obtain device copies from, if any.
+  std::shared_ptr<DeviceBufferCache> cache_;
   /// The RecordBatches on the host side.
   std::vector<std::shared_ptr<arrow::RecordBatch>> host_batches_;
   /// The descriptions of the RecordBatches on the host side.
@@ -152,6 +380,65 @@ class Context {
   std::vector<MemType> host_batch_memtype_;
   /// Prepared/cached buffers on the device.
   std::vector<DeviceBuffer> device_buffers_;
+  /// Whether the RecordBatch was enabled, i.e. its buffers are part of device_buffers_.
+  std::vector<bool> host_batch_enabled_;
+  /// Device buffers retained by Clear() for reuse.
+  std::vector<DeviceBuffer> retained_buffers_;
+  /// Incremented whenever the RecordBatches or device buffers change.
+  uint64_t generation_ = 0;
+  /// How buffers of cached RecordBatches are uploaded.
+  UploadMode upload_mode_ = UploadMode::PER_BUFFER;
+  /// The alignment of buffers within a packed allocation.
+  size_t packed_alignment_ = 64;
+  /// The maximum size of a transfer of a chunked upload, zero to derive it from the platform capabilities.
+  size_t chunk_size_ = 0;
+  /// Whether to realign buffers the device accesses in place.
+  bool realign_ = true;
+  /// Statistics of the realigned buffers.
+  RealignStats realign_stats_;
+  /// The staging arena holding realigned buffers and packed uploads, created when it is first needed.
+  std::shared_ptr<StagingArena> arena_;
+  /// The NUMA placement of host memory and threads, if any.
+  std::shared_ptr<NumaPlacement> numa_;
+  /// The capabilities of the platform, obtained by Enable().
+  fcaps_t capabilities_ = {};
+
+  /// @brief Return the staging arena, creating it if required.
+  StagingArena *arena();
+
+  /// @brief Free the device allocation of a buffer, if any.
+  void FreeDeviceBuffer(const DeviceBuffer &buffer);
+
+  /// @brief Return the number of buffers described by a RecordBatchDescription.
+  static size_t NumBuffers(const RecordBatchDescription &rbd);
+
+  /// @brief Return the index in device_buffers_ at which the buffers of the i-th RecordBatch are, or would be, placed.
+  size_t FirstDeviceBuffer(size_t i) const;
+
+  /// @brief Free the device buffers of the i-th RecordBatch, if it was enabled, and mark it as not enabled.
+  void ReleaseBatch(size_t i);
+
+  /// @brief Prepare the buffers of the i-th RecordBatch, to be placed at index \p first of device_buffers_.
+  Status EnableBatch(size_t i, size_t first, std::vector<DeviceBuffer> *out);
+
+  /// @brief Return the upload mode to use for a RecordBatch.
+  UploadMode ResolveUploadMode(const RecordBatchDescription &rbd, MemType type) const;
+
+  /// @brief Return true if the device would access a buffer in place, but not at a burst boundary or not padded.
+  bool NeedsRealignment(const DeviceBuffer &buffer, size_t burst, bool prepared_in_place) const;
+
+  /// @brief Copy a buffer into the staging arena at a burst boundary, storing the address of the copy in \p source.
+  Status Realign(DeviceBuffer *buffer, size_t burst, const uint8_t **source);
+
+  /// @brief Copy a host buffer to the device, in transfers of at most \p max_transfer bytes unless it is zero.
+  Status Upload(const uint8_t *host_source, da_t device_destination, int64_t size, size_t max_transfer);
+
+  /// @brief Enable all buffers of a RecordBatch through a single allocation and transfer.
+  Status EnablePacked(const RecordBatchDescription &rbd,
+                      MemType type,
+                      size_t burst,
+                      size_t first,
+                      std::vector<DeviceBuffer> *out);
 };
 
 }  // namespace fletcher
@@ -0,0 +1,133 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <memory>
+
+#include "fletcher/platform.h"
+#include "fletcher/context.h"
+#include "fletcher/kernel.h"
+#include "fletcher/future.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// A source of RecordBatches. Must set the output to nullptr when the stream is exhausted.
+using RecordBatchSource = std::function<Status(std::shared_ptr<arrow::RecordBatch> *out)>;
+
+/// A callback invoked for every RecordBatch after the kernel has finished processing it.
+using BatchCallback = std::function<Status(size_t batch_index, uint32_t ret0, uint32_t ret1)>;
+
+/// Statistics of a StreamExecutor run.
+struct StreamStats {
+  /// The number of RecordBatches processed.
+  size_t batches = 0;
+  /// The number of bytes in buffers of the RecordBatches that were processed.
+  size_t bytes = 0;
+  /// Time spent preparing RecordBatches for the device, in seconds.
+  double prepare_seconds = 0.0;
+  /// Time spent waiting for the kernel after preparing the next RecordBatch, in seconds.
+  double wait_seconds = 0.0;
+  /// Total time of the run, in seconds.
+  double total_seconds = 0.0;
+};
+
+/**
+ * @brief Executes a kernel over a stream of RecordBatches, overlapping data preparation with kernel execution.
+ *
+ * The executor rotates over a number of slots, each with its own Context. While the kernel processes a RecordBatch in
+ * one slot, the next RecordBatch is prepared (e.g. copied to on-board memory) in the next slot. Slots retain their
+ * device allocations, such that RecordBatches of similar layout are copied into the same device buffers.
+ */
+class StreamExecutor {
+ public:
+  /**
+   * @brief Construct a new StreamExecutor.
+   * @param[in] platform  The platform to execute on.
+   * @param[in] num_slots The number of device buffer sets to rotate over, at least two for overlap.
+   * @param[in] mem_type  The memory type with which RecordBatches are queued.
+   */
+  StreamExecutor(std::shared_ptr<Platform> platform, size_t num_slots, MemType mem_type);
+
+  /**
+   * @brief Create a new StreamExecutor.
+   * @param[out] out       A pointer to a shared pointer that will own the new StreamExecutor.
+   * @param[in]  platform  The platform to execute on.
+   * @param[in]  num_slots The number of device buffer sets to rotate over, at least two for overlap.
+   * @param[in]  mem_type  The memory type with which RecordBatches are queued.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<StreamExecutor> *out,
+                     const std::shared_ptr<Platform> &platform,
+                     size_t num_slots = 2,
+                     MemType mem_type = MemType::ANY);
+
+  /**
+   * @brief Run the kernel over all RecordBatches of a source.
+   * @param[in] source  The source of RecordBatches.
+   * @param[in] on_done A callback invoked, in order, for every RecordBatch after the kernel has processed it.
+   * @return Status::OK() if successful, otherwise the first error status encountered.
+   */
+  Status Run(const RecordBatchSource &source, const BatchCallback &on_done = nullptr);
+
+  /**
+   * @brief Run the kernel over a vector of RecordBatches.
+   * @param[in] batches The RecordBatches to process.
+   * @param[in] on_done A callback invoked, in order, for every RecordBatch after the kernel has processed it.
+   * @return Status::OK() if successful, otherwise the first error status encountered.
+   */
+  Status Run(const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches, const BatchCallback &on_done = nullptr);
+
+  /// @brief Return the statistics of the most recent run.
+  const StreamStats &stats() const { return stats_; }
+
+  /// Custom arguments written to the kernel before every launch, see Kernel::SetArguments().
+  std::vector<uint32_t> arguments;
+
+ protected:
+  /// A set of device buffers and the kernel operating on them.
+  struct Slot {
+    /// The context holding the device buffers of this slot.
+    std::shared_ptr<Context> context;
+    /// The kernel operating on the context of this slot.
+    std::shared_ptr<Kernel> kernel;
+    /// The launch of the kernel of this slot, if any.
+    KernelFuture future;
+    /// The index of the RecordBatch in the stream occupying this slot.
+    size_t batch_index = 0;
+  };
+
+  /// @brief Prepare a RecordBatch in some slot.
+  Status Prepare(Slot *slot, const std::shared_ptr<arrow::RecordBatch> &batch, size_t batch_index);
+  /// @brief Launch the kernel of some slot.
+  Status Launch(Slot *slot);
+  /// @brief Wait for the kernel of some slot and invoke the callback.
+  Status Finish(Slot *slot, const BatchCallback &on_done);
+
+  /// The platform to execute on.
+  std::shared_ptr<Platform> platform_;
+  /// The memory type with which RecordBatches are queued.
+  MemType mem_type_;
+  /// The slots to rotate over.
+  std::vector<Slot> slots_;
+  /// Statistics of the most recent run.
+  StreamStats stats_;
+};
+
+}  // namespace fletcher
@@ -0,0 +1,171 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+class Kernel;
+class CompletionQueue;
+
+/// Shared state of a single asynchronous kernel launch.
+struct LaunchState {
+  /// The kernel that was launched.
+  Kernel *kernel = nullptr;
+  /// The queue responsible for resolving this launch.
+  CompletionQueue *queue = nullptr;
+  /// Whether the launch has been resolved.
+  bool done = false;
+  /// The resulting status of the launch.
+  Status status;
+  /// Return value 0 of the kernel, read upon completion.
+  uint32_t ret0 = 0;
+  /// Return value 1 of the kernel, read upon completion.
+  uint32_t ret1 = 0;
+};
+
+/// A handle to an asynchronously launched Kernel, resolved by a CompletionQueue.
+class KernelFuture {
+ public:
+  /// @brief Construct an invalid KernelFuture.
+  KernelFuture() = default;
+
+  /// @brief Return true if this future refers to a kernel launch.
+  bool valid() const { return state_ != nullptr; }
+
+  /// @brief Return true if the kernel launch has been resolved. Does not block.
+  bool ready() const;
+
+  /**
+   * @brief Block until the kernel launch is resolved.
+   * @return Status::OK() if the kernel finished successfully, otherwise a descriptive error status.
+   */
+  Status Wait() const;
+
+  /**
+   * @brief Block until the kernel launch is resolved, and obtain the return values of the kernel.
+   * @param[out] ret0 A pointer to a value to store return value 0.
+   * @param[out] ret1 A pointer to a value to store return value 1, ignored if nullptr.
+   * @return Status::OK() if the kernel finished successfully, otherwise a descriptive error status.
+   */
+  Status Get(uint32_t *ret0, uint32_t *ret1 = nullptr) const;
+
+ protected:
+  friend class CompletionQueue;
+  friend Status WaitAny(const std::vector<KernelFuture> &futures, size_t *index);
+  /// The shared state of the launch.
+  std::shared_ptr<LaunchState> state_;
+};
+
+/**
+ * @brief Block until all kernel launches are resolved.
+ * @param[in] futures The futures to wait for.
+ * @return Status::OK() if all kernels finished successfully, otherwise the first error status encountered.
+ */
+Status WaitAll(const std::vector<KernelFuture> &futures);
+
+/**
+ * @brief Block until any of the kernel launches is resolved.
+ *
+ * The futures may be resolved by different CompletionQueues.
+ *
+ * @param[in]  futures  The futures to wait for.
+ * @param[out] index    The index of the first resolved future found.
+ * @return The status of the resolved kernel launch, or an error status if no future is valid.
+ */
+Status WaitAny(const std::vector<KernelFuture> &futures, size_t *index);
+
+/// A thread blocked in WaitAny(), notified by every CompletionQueue of the futures it waits for.
+struct AnyWaiter {
+  /// Mutex protecting signalled.
+  std::mutex mutex;
+  /// Signalled when any launch of the queues the waiter is registered with is resolved.
+  std::condition_variable cv;
+  /// Whether a launch was resolved since the waiter last checked its futures.
+  bool signalled = false;
+};
+
+/**
+ * @brief A runtime-owned thread that polls in-flight kernels and resolves their futures.
+ *
+ * A single completion thread serves all kernels submitted to a queue, such that one host thread can keep many kernels
+ * and contexts in flight while doing other work. The thread is only started when the first launch is submitted.
+ *
+ * When all in-flight kernels signal completion through the completion events of a single platform, the thread blocks
+ * on those events in between reads of the status registers. Otherwise, it polls with an exponentially increasing
+ * interval, from poll_interval_usec up to max_poll_interval_usec.
+ */
+class CompletionQueue {
+ public:
+  /// @brief Construct a new, idle CompletionQueue.
+  CompletionQueue() = default;
+
+  /// @brief Destruct the queue, failing any outstanding launches and joining the completion thread.
+  ~CompletionQueue();
+
+  /// @brief Return the default, process-wide CompletionQueue.
+  static CompletionQueue &Default();
+
+  /**
+   * @brief Submit a started kernel to the queue.
+   * @param[in]  kernel The kernel to track. Must stay alive until the launch is resolved.
+   * @param[out] future The future that will be resolved upon kernel completion.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Submit(Kernel *kernel, KernelFuture *future);
+
+  /// @brief Block until the launch with shared state \p state is resolved.
+  void Wait(const std::shared_ptr<LaunchState> &state);
+
+  /// The initial interval in microseconds at which the completion thread polls when no kernel has finished in a sweep.
+  unsigned int poll_interval_usec = 10;
+  /// The maximum interval in microseconds at which the completion thread polls, after backing off exponentially.
+  unsigned int max_poll_interval_usec = 1000;
+
+ protected:
+  friend class KernelFuture;
+  friend Status WaitAny(const std::vector<KernelFuture> &futures, size_t *index);
+
+  /// @brief The completion thread main loop.
+  void Run();
+
+  /// @brief Wake up all threads waiting for a resolved launch. The caller must hold mutex_.
+  void NotifyDone();
+
+  /// Mutex protecting all members below.
+  std::mutex mutex_;
+  /// Signalled when new launches are submitted or the queue is stopped.
+  std::condition_variable work_cv_;
+  /// Signalled when any launch is resolved.
+  std::condition_variable done_cv_;
+  /// Threads in WaitAny() waiting for launches of this queue.
+  std::vector<AnyWaiter *> waiters_;
+  /// Launches that are still in flight.
+  std::vector<std::shared_ptr<LaunchState>> pending_;
+  /// The completion thread.
+  std::thread thread_;
+  /// Whether the completion thread should stop.
+  bool stop_ = false;
+};
+
+}  // namespace fletcher
@@ -16,16 +16,104 @@
 
 #include <arrow/api.h>
 #include <fletcher/fletcher.h>
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <utility>
 #include <vector>
 #include <memory>
 
 #include "fletcher/context.h"
 #include "fletcher/platform.h"
+#include "fletcher/future.h"
 
 namespace fletcher {
 
-/// The Kernel class is used to manage the computational kernel of the accelerator.
+/**
+ * @brief Strategy to poll a Kernel for completion.
+ *
+ * Polling starts by reading the status register back-to-back for a number of polls, then yields the host thread in
+ * between a number of polls, and finally sleeps in between polls with an exponentially increasing interval. This keeps
+ * the latency low for short kernels, without burning a host core on long-running kernels.
+ */
+struct PollStrategy {
+  /// Number of back-to-back polls before yielding.
+  uint64_t spin_polls = 128;
+  /// Number of polls that yield the host thread in between, after spinning and before sleeping.
+  uint64_t yield_polls = 128;
+  /// The initial interval to sleep in between polls, in microseconds.
+  unsigned int min_sleep_usec = 1;
+  /// The maximum interval to sleep in between polls, in microseconds.
+  unsigned int max_sleep_usec = 1000;
+  /// The factor by which the sleep interval grows after every sleeping poll.
+  double backoff = 2.0;
+  /// The deadline in microseconds after which polling gives up with Status::TIMEOUT(). Zero means no deadline.
+  uint64_t timeout_usec = 0;
+
+  /// @brief Return a strategy that polls at maximum speed.
+  static PollStrategy Spin(uint64_t timeout_usec = 0);
+
+  /// @brief Return a strategy that sleeps for a fixed interval in between polls.
+  static PollStrategy Interval(unsigned int interval_usec, uint64_t timeout_usec = 0);
+};
+
+/// Statistics of the most recent polling run of a Kernel.
+struct PollStats {
+  /// The number of times the kernel was polled.
+  uint64_t polls = 0;
+  /// The number of times the host thread yielded in between polls.
+  uint64_t yields = 0;
+  /// The number of times the host thread slept in between polls.
+  uint64_t sleeps = 0;
+  /// The total time spent waiting for the kernel, in seconds.
+  double seconds = 0.0;
+  /// Whether the deadline passed before the kernel was done.
+  bool timed_out = false;
+};
+
+/**
+ * @brief Policy of the watchdog that guards kernel launches through Kernel::Run().
+ *
+ * A launch that does not complete before the deadline is considered stuck. The kernel is then reset, after which the
+ * launch is retried a bounded number of times. Since registers may not hold their values after a reset, the metadata,
+ * ranges and arguments that were written to the kernel can be rewritten before retrying.
+ */
+struct WatchdogPolicy {
+  /// The deadline of a single launch in microseconds. Zero disables the watchdog.
+  uint64_t deadline_usec = 0;
+  /// The number of times a launch that missed its deadline is retried.
+  unsigned int max_retries = 0;
+  /// Whether to rewrite the metadata, ranges and arguments after a reset, before retrying.
+  bool rewrite_metadata = true;
+};
+
+/// Counters of the launches guarded by the watchdog, accumulated over the lifetime of a Kernel.
+struct WatchdogStats {
+  /// The number of times the kernel was started, including retries.
+  uint64_t launches = 0;
+  /// The number of launches that missed their deadline.
+  uint64_t timeouts = 0;
+  /// The number of resets issued by the watchdog.
+  uint64_t resets = 0;
+  /// The number of launches that were retried.
+  uint64_t retries = 0;
+  /// The number of runs that did not complete within any of their attempts.
+  uint64_t failures = 0;
+};
+
+/**
+ * @brief The Kernel class is used to manage the computational kernel of the accelerator.
+ *
+ * A Kernel reserves the kernel hardware at its MMIO base on the platform while it writes registers (through
+ * WriteMetaData(), SetRange() or SetArguments()), and from Start() until the run is observed done (through IsDone(),
+ * PollUntilDone() or WaitForCompletionEvent()), the return registers are read through GetReturn(), the kernel is
+ * Reset(), Release() is called, or the Kernel is destructed. Other Kernels that program the same hardware meanwhile
+ * block until the reservation is released. This allows independent Kernels to be used from multiple threads at once,
+ * and many Kernels of the same hardware to be programmed before any of them is started. If another Kernel programmed
+ * the hardware in between, Start() first restores the metadata, ranges and arguments of this Kernel. When a run is
+ * observed done, its return registers are latched, such that GetReturn() still returns them after another Kernel has
+ * used the hardware.
+ */
 class Kernel {
  public:
   /**
@@ -34,6 +122,9 @@ class Kernel {
    */
   explicit Kernel(std::shared_ptr<Context> context);
 
+  /// @brief Destruct the kernel, blocking until any asynchronous launch of this kernel is resolved.
+  ~Kernel();
+
   /**
    * @brief Returns true if the kernel implements an operation over a set of arrow::Schemas. Not implemented.
    * @param[in] schema_set A vector of shared pointers to arrow::Schemas to check.
@@ -49,6 +140,10 @@ class Kernel {
 
   /**
    * @brief Set the first (inclusive) and last (exclusive) row to process of some RecordBatch.
+   *
+   * Rows are relative to the RecordBatch. For sliced RecordBatches, the first index (see Context::first_index()) is
+   * added before the range is written to the kernel.
+   *
    * @param[in] recordbatch_index The index of the RecordBatch to set the range for.
    * @param[in] first             The first index of the range (inclusive).
    * @param[in] last              The last index of the range (exclusive).
@@ -65,10 +160,35 @@ class Kernel {
 
   /**
    * @brief Start the kernel.
-   * @return Status::OK() if successful, otherwise a descriptive error status.
+   * @return Status::OK() if successful, otherwise a descriptive error status, e.g. if the context holds RecordBatches
+   *         that are queued but not enabled.
    */
   Status Start();
 
+  /**
+   * @brief Start the kernel asynchronously.
+   *
+   * The returned future is resolved by the completion thread of \p queue when the kernel is done, after which the
+   * return registers are available through KernelFuture::Get(). The Kernel must stay alive until then.
+   *
+   * @param[out] future A future that is resolved upon kernel completion.
+   * @param[in]  queue  The CompletionQueue to submit the launch to.
+   * @return Status::OK() if the kernel was started successfully, otherwise a descriptive error status.
+   */
+  Status StartAsync(KernelFuture *future, CompletionQueue *queue = &CompletionQueue::Default());
+
+  /**
+   * @brief Start the kernel and block until it is done, guarded by the watchdog policy.
+   *
+   * If the kernel misses the deadline of the watchdog policy, it is reset and, if the policy allows, started again.
+   * Without a deadline, this is equivalent to Start() followed by PollUntilDone(). The return registers can be read
+   * through GetReturn() afterwards.
+   *
+   * @return Status::OK() when the kernel is finished, Status::TIMEOUT() if no attempt finished before its deadline,
+   *         otherwise a descriptive error status.
+   */
+  Status Run();
+
   /**
    * @brief Read the status register of the Kernel.
    * @param[out] status_out A pointer to a value to store the status.
@@ -77,7 +197,18 @@ class Kernel {
   Status GetStatus(uint32_t *status_out);
 
   /**
-   * @brief Read the return registers of the Kernel. If ret1 is nullptr, REG_RETURN1 is ignored.
+   * @brief Check once, without blocking, whether the done flag of the status register is asserted.
+   *
+   * When the kernel is done, its return registers are latched and its reservation is released.
+   *
+   * @param[out] done Set to true if the kernel is done, false otherwise.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status IsDone(bool *done);
+
+  /**
+   * @brief Read the return registers of the Kernel and release its reservation. If ret1 is nullptr, REG_RETURN1 is
+   * ignored. If the run was observed done, the return values latched at that point are returned.
    * @param[out] ret0 A pointer to a value to store return value 0.
    * @param[out] ret1 A pointer to a value to store return value 1.
    * @return Status::OK() if successful, otherwise a descriptive error status.
@@ -86,28 +217,73 @@ class Kernel {
 
   /**
    * @brief Poll (blocking) the done flag of the status register for assertion with an interval.
-   * @param[in] poll_interval_usec The interval at which to poll the Kernel.
+   *
+   * If the platform supports completion events, this blocks on the completion event instead of polling MMIO.
+   *
+   * @param[in] poll_interval_usec The interval at which to poll the Kernel. Zero polls at maximum speed.
    * @return Status::OK() when the kernel is finished, otherwise a descriptive error status.
    */
   Status PollUntilDoneInterval(unsigned int poll_interval_usec);
 
   /**
-   * @brief Poll the done flag of the status register for assertion (blocking). Polls at maximum speed.
-   * @return Status::OK() when the kernel is finished, otherwise a descriptive error status.
+   * @brief Poll the done flag of the status register for assertion (blocking), using the kernel poll_strategy.
+   * @return Status::OK() when the kernel is finished, Status::TIMEOUT() if the deadline of the strategy passed,
+   *         otherwise a descriptive error status.
    *
-   * Polling at maximum speed can cause a significant amount of traffic on the accelerator interface; use with care.
+   * If the strategy has no deadline, the deadline of the watchdog policy applies.
+   * If the platform supports completion events, this blocks on the completion event instead of polling MMIO.
    */
   Status PollUntilDone();
 
+  /**
+   * @brief Poll the done flag of the status register for assertion (blocking), using some poll strategy.
+   * @param[in] strategy The strategy to poll with.
+   * @return Status::OK() when the kernel is finished, Status::TIMEOUT() if the deadline of the strategy passed,
+   *         otherwise a descriptive error status.
+   */
+  Status PollUntilDone(const PollStrategy &strategy);
+
+  /**
+   * @brief Block until the platform signals kernel completion. Requires Platform::has_completion_events().
+   * @param[in] timeout_usec The deadline in microseconds, zero to wait without deadline.
+   * @return Status::OK() when the kernel is finished, Status::TIMEOUT() if the deadline passed, otherwise a descriptive
+   *         error status.
+   */
+  Status WaitForCompletionEvent(uint64_t timeout_usec = 0);
+
+  /// @brief Release the reservation of the kernel hardware without reading the return registers, e.g. after a failure.
+  void Release();
+
+  /// @brief Return the statistics of the most recent polling run.
+  const PollStats &poll_stats() const { return poll_stats_; }
+
+  /// @brief Return the counters of the watchdog.
+  const WatchdogStats &watchdog_stats() const { return watchdog_stats_; }
+
   /// @brief Return the context of this Kernel.
   std::shared_ptr<Context> context();
 
   /**
    * @brief Write RecordBatch metadata from the Context to the Kernel MMIO registers.
+   *
+   * Start() calls this function automatically if the metadata was not written yet, or if the context changed since.
+   * All RecordBatches of the context must be enabled (see Context::Enable()).
+   *
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
   Status WriteMetaData();
 
+  /**
+   * @brief Let the kernel operate on another context, and write the metadata of that context.
+   *
+   * When the shadow registers of the platform are enabled, only registers of which the value differs from the previous
+   * context are written, which makes relaunching a kernel over many similar RecordBatches cheap.
+   *
+   * @param[in] context The context to operate on.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Rebind(std::shared_ptr<Context> context);
+
   // Default control and status values:
   /// Control register start command value.
   uint32_t ctrl_start = 1ul << FLETCHER_REG_CONTROL_START;
@@ -117,12 +293,60 @@ class Kernel {
   uint32_t done_status = 1ul << FLETCHER_REG_STATUS_DONE;
   /// Status register done mask bits.
   uint32_t done_status_mask = 1ul << FLETCHER_REG_STATUS_DONE;
+  /// The strategy used by PollUntilDone().
+  PollStrategy poll_strategy;
+  /// The watchdog policy applied by Run().
+  WatchdogPolicy watchdog;
+  /// The offset of the MMIO registers of this kernel instance, for designs that replicate the kernel.
+  uint64_t mmio_base = 0;
+  /**
+   * Whether PollUntilDone() blocks on platform completion events between reads of the status register, if the platform
+   * supports them. Completion events are not attributed to a kernel instance, so an event only causes the status
+   * register of this instance to be read again.
+   */
+  bool use_completion_events = true;
 
  protected:
   /// Whether RecordBatch metadata was written.
   bool metadata_written = false;
+  /// The generation of the context when the metadata was written.
+  uint64_t metadata_generation_ = 0;
+  /// The most recent asynchronous launch of this kernel.
+  KernelFuture launch_;
+  /// Statistics of the most recent polling run.
+  PollStats poll_stats_;
+  /// Counters of the watchdog.
+  WatchdogStats watchdog_stats_;
+  /// Ranges written through SetRange() since the metadata was written, per RecordBatch, to restore after a reset.
+  std::map<size_t, std::pair<int32_t, int32_t>> ranges_;
+  /// Arguments written through SetArguments(), to restore after a reset.
+  std::vector<uint32_t> arguments_;
   /// The context that this kernel should operate on.
   std::shared_ptr<Context> context_;
+  /// Whether this kernel holds the reservation of its hardware. Released when a run is observed done.
+  std::atomic<bool> reserved_{false};
+  /// An identifier of this kernel, unique within the process.
+  const uint64_t id_;
+  /// Whether another kernel may have programmed the hardware since this kernel last did.
+  bool registers_stale_ = false;
+  /// Whether the return registers were latched when the most recent run was observed done.
+  bool returns_latched_ = false;
+  /// The latched return value 0.
+  uint32_t ret0_ = 0;
+  /// The latched return value 1.
+  uint32_t ret1_ = 0;
+
+  /// @brief Reserve the kernel hardware for this kernel, if it is not reserved by this kernel already.
+  void Reserve();
+
+  /// @brief Release a reservation taken to program registers, unless it was \p held before, e.g. by a running launch.
+  void ReleaseUnlessHeld(bool held);
+
+  /// @brief Issue a reset command to the kernel hardware, without releasing the reservation.
+  Status ResetHardware();
+
+  /// @brief Rewrite the metadata, ranges and arguments of the kernel after a reset.
+  Status RestoreRegisters();
 };
 
 }  // namespace fletcher
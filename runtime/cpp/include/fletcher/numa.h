@@ -0,0 +1,174 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fletcher/platform.h"
+#include "fletcher/status.h"
+
+/// Environment variable holding the NUMA node of the device, overriding the node reported by the platform.
+#define FLETCHER_NUMA_NODE_ENV "FLETCHER_NUMA_NODE"
+
+namespace fletcher {
+
+/// Statistics of the copies to the device from host memory on a single NUMA node.
+struct NumaCopyStats {
+  /// The number of copies.
+  uint64_t copies = 0;
+  /// The number of bytes copied.
+  uint64_t bytes = 0;
+  /// The total duration of the copies in seconds.
+  double seconds = 0.0;
+
+  /// @brief Return the throughput of the copies in GB/s.
+  double gbps() const { return seconds > 0.0 ? static_cast<double>(bytes) / seconds * 1E-9 : 0.0; }
+};
+
+/**
+ * @brief Places host memory and threads on the NUMA node of a device.
+ *
+ * On multi-socket hosts, copies from host memory on a remote node and polling from cores of a remote node are
+ * considerably slower. A NumaPlacement allocates host memory bound to the node of the device, preferably backed by
+ * hugepages, and can pin threads to the cores of that node, see NumaPinScope. It also counts the copies to the device
+ * per node of their source, such that copies from remote memory can be identified.
+ *
+ * NUMA placement is only supported on Linux. Elsewhere, or if the node of the device is unknown, memory is allocated
+ * without binding and threads are never pinned. All functions are thread-safe.
+ */
+class NumaPlacement {
+ public:
+  /// The node of a placement for a device of which the NUMA node is unknown.
+  static constexpr int kUnknownNode = -1;
+
+  /**
+   * @brief Construct a new NumaPlacement.
+   * @param[in] node        The NUMA node of the device, or kUnknownNode.
+   * @param[in] hugepages   Whether to back allocations by hugepages.
+   * @param[in] pin_threads Whether NumaPinScopes pin threads to the cores of the node.
+   */
+  NumaPlacement(int node, bool hugepages, bool pin_threads);
+
+  /**
+   * @brief Create a new NumaPlacement for the device of a platform.
+   *
+   * The node of the device is, in order of precedence: \p node, the value of the FLETCHER_NUMA_NODE environment
+   * variable, or the first node of the numa_node_mask the platform reports through its capabilities.
+   *
+   * @param[out] out          A pointer to a shared pointer that will own the new NumaPlacement.
+   * @param[in]  platform     The platform of the device.
+   * @param[in]  node         The NUMA node of the device, or kUnknownNode to discover it.
+   * @param[in]  hugepages    Whether to back allocations by hugepages.
+   * @param[in]  pin_threads  Whether NumaPinScopes pin threads to the cores of the node.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<NumaPlacement> *out,
+                     const std::shared_ptr<Platform> &platform,
+                     int node = kUnknownNode,
+                     bool hugepages = true,
+                     bool pin_threads = false);
+
+  /// @brief Return the NUMA node of the device, or kUnknownNode.
+  int node() const { return node_; }
+
+  /// @brief Return the cores of the NUMA node of the device.
+  const std::vector<int> &cpus() const { return cpus_; }
+
+  /// @brief Return whether allocations are backed by hugepages.
+  bool hugepages() const { return hugepages_; }
+
+  /// @brief Return whether NumaPinScopes pin threads to the cores of the node.
+  bool pin_threads() const { return pin_threads_ && !cpus_.empty(); }
+
+  /**
+   * @brief Allocate host memory on the NUMA node of the device.
+   *
+   * With hugepages, the size is rounded up to whole hugepages. Explicit hugepages are used if the system reserved them,
+   * otherwise transparent hugepages are requested.
+   *
+   * @param[out] out  The address of the allocation, aligned to at least a page.
+   * @param[in]  size The number of bytes to allocate.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Allocate(uint8_t **out, size_t size);
+
+  /**
+   * @brief Free host memory obtained through Allocate().
+   * @param[in] address The address of the allocation.
+   * @param[in] size    The size that was passed to Allocate().
+   */
+  void Free(uint8_t *address, size_t size);
+
+  /// @brief Return the NUMA node of the page holding some address, or kUnknownNode if it cannot be determined.
+  static int NodeOf(const void *address);
+
+  /**
+   * @brief Account a copy to the device.
+   * @param[in] source  The host address copied from.
+   * @param[in] bytes   The number of bytes copied.
+   * @param[in] seconds The duration of the copy in seconds.
+   */
+  void RecordCopy(const void *source, uint64_t bytes, double seconds);
+
+  /// @brief Return the statistics of the copies to the device, by NUMA node of their source.
+  std::map<int, NumaCopyStats> copy_stats() const;
+
+ private:
+  /// @brief Return the number of bytes allocated for a request of some size.
+  size_t AllocationSize(size_t size) const;
+
+  /// The NUMA node of the device.
+  int node_;
+  /// The cores of the NUMA node of the device.
+  std::vector<int> cpus_;
+  /// Whether to back allocations by hugepages.
+  bool hugepages_;
+  /// Whether to pin threads.
+  bool pin_threads_;
+  /// Copy statistics by node.
+  std::map<int, NumaCopyStats> copy_stats_;
+  /// Mutex protecting the copy statistics.
+  mutable std::mutex mutex_;
+};
+
+/**
+ * @brief Pins the calling thread to the cores of the NUMA node of a device for the lifetime of a scope.
+ *
+ * The previous affinity of the thread is restored when the scope ends. Does nothing if the placement is nullptr or does
+ * not pin threads.
+ */
+class NumaPinScope {
+ public:
+  explicit NumaPinScope(const NumaPlacement *placement);
+  ~NumaPinScope();
+
+  NumaPinScope(const NumaPinScope &) = delete;
+  NumaPinScope &operator=(const NumaPinScope &) = delete;
+
+  /// @brief Return true if the thread was pinned.
+  bool pinned() const { return pinned_; }
+
+ private:
+  /// Whether the thread was pinned.
+  bool pinned_ = false;
+  /// The cores the thread was allowed to run on before it was pinned.
+  std::vector<int> previous_;
+};
+
+}  // namespace fletcher
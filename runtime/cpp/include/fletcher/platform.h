@@ -18,9 +18,15 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
 #include <cassert>
 
 #include "fletcher/status.h"
+#include "fletcher/trace.h"
 
 #if defined(__MACH__)
 #define DYLIB_EXT ".dylib"
@@ -30,12 +36,32 @@
 
 namespace fletcher {
 
-/// A Fletcher Platform. Links during run-time and abstracts access to lower-level platform-specific libraries / API's.
+/// Statistics of the MMIO register writes of a Platform.
+struct MmioStats {
+  /// The number of register writes issued to the platform.
+  uint64_t writes_issued = 0;
+  /// The number of register writes skipped because the shadow register file held the same value.
+  uint64_t writes_elided = 0;
+};
+
+/**
+ * @brief A Fletcher Platform. Links during run-time and abstracts access to lower-level platform-specific libraries /
+ * API's.
+ *
+ * Thread-safety: all functions of a Platform may be called from multiple threads at once. Calls into the platform
+ * library are serialized per Platform instance, except for WaitForCompletion(), which may block. Platform libraries
+ * that expose multiple devices must allow concurrent calls for different devices.
+ *
+ * Contexts and Kernels are not synchronized internally; a single Context or Kernel must not be used by multiple threads
+ * at once. Independent Contexts and Kernels may be used from many threads at once against the same Platform. Kernels
+ * reserve the kernel hardware they program (see Kernel), such that their register accesses never interleave.
+ */
 class Platform {
  public:
   /// @brief Platform destructor.
   ~Platform() {
     if (!terminated) {
+      Select();
       platformTerminate(terminate_data);
     }
   }
@@ -49,6 +75,22 @@ class Platform {
    */
   static Status Make(const std::string &name, std::shared_ptr<Platform> *platform_out, bool quiet = true);
 
+  /**
+   * @brief Create a platform instance for every device the platform library exposes.
+   *
+   * Platform libraries that expose multiple devices export platformGetDeviceCount and platformSetDevice. Every instance
+   * selects its own device before calling into the library, such that instances can be used independently (and from
+   * different threads). Libraries without these functions expose a single device.
+   *
+   * @param[in]  name           The name of the platform.
+   * @param[out] platforms_out  The platform instances, one per device.
+   * @param[in]  quiet          Whether to suppress any logging messages
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status MakeAll(const std::string &name,
+                        std::vector<std::shared_ptr<Platform>> *platforms_out,
+                        bool quiet = true);
+
   /**
    * @brief Create a new platform by attempting to autodetect the platform driver.
    * @param[out] platform_out  A pointer to a shared pointer that will point to the new platform instance.
@@ -60,19 +102,51 @@ class Platform {
   /// @brief Return the name of the platform.
   std::string name();
 
+  /// @brief Return the index of the device of this platform instance.
+  size_t device() const { return device_; }
+
+  /// @brief Return the number of devices the platform library exposes.
+  size_t num_devices();
+
   /// @brief Print the contents of the MMIO registers within some range.
   Status MmioToString(std::string *str, uint64_t start, uint64_t stop, bool quiet = false);
 
   /// @brief Initialize the platform.
-  inline Status Init() { return Status(platformInit(init_data)); }
+  inline Status Init() {
+    InvalidateShadowRegisters();
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
+    return Status(platformInit(init_data));
+  }
 
   /**
    * @brief Write to an MMIO register.
+   *
+   * If shadow registers are enabled, writes of the value a schema-derived register already holds are skipped.
+   *
    * @param[in] offset  Register offset to write to.
    * @param[in] value   Value to write.
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
-  inline Status WriteMMIO(uint64_t offset, uint32_t value) { return Status(platformWriteMMIO(offset, value)); }
+  Status WriteMMIO(uint64_t offset, uint32_t value);
+
+  /**
+   * @brief Write to a number of MMIO registers, in order.
+   *
+   * Uses platformWriteMMIOBatch if the platform provides it, otherwise writes the registers one by one.
+   *
+   * @param[in] writes  The register writes to perform.
+   * @param[in] count   The number of register writes.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status WriteMMIOBatch(const fmmio_t *writes, size_t count);
+
+  /**
+   * @brief Write to a number of MMIO registers, in order.
+   * @param[in] writes  The register writes to perform.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  inline Status WriteMMIOBatch(const std::vector<fmmio_t> &writes) { return WriteMMIOBatch(writes.data(), writes.size()); }
 
   /**
   * @brief Read from an MMIO register.
@@ -80,7 +154,12 @@ class Platform {
   * @param[out] value   Pointer to a value to store the result.
   * @return Status::OK() if successful, otherwise a descriptive error status.
   */
-  inline Status ReadMMIO(uint64_t offset, uint32_t *value) { return Status(platformReadMMIO(offset, value)); }
+  inline Status ReadMMIO(uint64_t offset, uint32_t *value) {
+    TraceSpan span("Platform::ReadMMIO", "mmio", 0, offset);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
+    return Status(platformReadMMIO(offset, value));
+  }
 
   /**
   * @brief Read 64 bit value from two successive 32 bit MMIO registers. The lower register will go to the lower bits.
@@ -97,6 +176,9 @@ class Platform {
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
   inline Status DeviceMalloc(da_t *device_address, size_t size) {
+    TraceSpan span("Platform::DeviceMalloc", "memory", size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     return Status(platformDeviceMalloc(device_address, size));
   }
 
@@ -105,7 +187,12 @@ class Platform {
    * @param[in] device_address  The device address of the memory region.
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
-  inline Status DeviceFree(da_t device_address) { return Status(platformDeviceFree(device_address)); }
+  inline Status DeviceFree(da_t device_address) {
+    TraceSpan span("Platform::DeviceFree", "memory", 0, device_address);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
+    return Status(platformDeviceFree(device_address));
+  }
 
   /**
    * @brief Copy data from host memory to device memory.
@@ -115,9 +202,100 @@ class Platform {
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
   inline Status CopyHostToDevice(uint8_t *host_source, da_t device_destination, uint64_t size) {
+    TraceSpan span("Platform::CopyHostToDevice", "copy", size, device_destination);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     return Status(platformCopyHostToDevice(host_source, device_destination, size));
   }
 
+  /**
+   * @brief Enable or disable the shadow register file.
+   *
+   * The shadow register file holds the values last written by the host to schema-derived registers, i.e. registers at
+   * or beyond FLETCHER_REG_SCHEMA such as RecordBatch ranges, buffer addresses and arguments. When enabled, writes of
+   * identical values are skipped. This is only correct if the kernel itself never modifies these registers, and if no
+   * other Platform instance writes to the same device. The default control and status registers are never shadowed,
+   * neither at offset zero nor at the MMIO base of any Kernel, see ExcludeFromShadow().
+   *
+   * @param[in] enable Whether to enable the shadow register file.
+   */
+  void set_shadow_registers(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shadow_enabled_ = enable;
+    shadow_.clear();
+  }
+
+  /// @brief Return whether the shadow register file is enabled.
+  bool shadow_registers() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return shadow_enabled_;
+  }
+
+  /**
+   * @brief Never shadow a register, e.g. the control register of a kernel at a non-zero MMIO base.
+   * @param[in] offset The offset of the register.
+   */
+  void ExcludeFromShadow(uint64_t offset);
+
+  /// @brief Forget all shadowed register values, e.g. after the device was reset, such that they are written again.
+  void InvalidateShadowRegisters() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shadow_.clear();
+  }
+
+  /**
+   * @brief Reserve the kernel hardware at some MMIO base for the calling Kernel, blocking while it is reserved.
+   *
+   * Used by Kernel to ensure that only one Kernel at a time programs and runs the same kernel hardware.
+   *
+   * @param[in] mmio_base The MMIO base offset of the kernel.
+   * @param[in] owner     An identifier of the reserving Kernel.
+   * @return True if the hardware was never reserved, or last reserved by the same owner, i.e. its registers were not
+   *         programmed by anyone else since.
+   */
+  bool ReserveKernel(uint64_t mmio_base, uint64_t owner = 0);
+
+  /**
+   * @brief Release a reservation obtained through ReserveKernel().
+   * @param[in] mmio_base The MMIO base offset of the kernel.
+   */
+  void ReleaseKernel(uint64_t mmio_base);
+
+  /// @brief Return the statistics of the MMIO register writes of this platform.
+  MmioStats mmio_stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return mmio_stats_;
+  }
+
+  /// @brief Return true if the platform can perform vectored host-to-device copies through platformCopyHostToDeviceV.
+  inline bool has_vectored_copy() const { return platformCopyHostToDeviceV != nullptr; }
+
+  /**
+   * @brief Perform a number of host-to-device copies as a single transfer.
+   *
+   * Only available if has_vectored_copy().
+   *
+   * @param[in] copies  The copies to perform.
+   * @param[in] count   The number of copies.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  inline Status CopyHostToDeviceV(const fcopy_t *copies, size_t count) {
+    if (platformCopyHostToDeviceV == nullptr) {
+      return Status::ERROR("Platform does not support vectored copies.");
+    }
+    TraceSpan span("Platform::CopyHostToDeviceV", "copy", 0, 0, count);
+    if (Tracer::Global().enabled()) {
+      uint64_t bytes = 0;
+      for (size_t i = 0; i < count; i++) {
+        bytes += copies[i].size;
+      }
+      span.set_bytes(bytes);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
+    return Status(platformCopyHostToDeviceV(copies, count));
+  }
+
   /**
    * @brief Copy data from device memory to host memory.
    * @param[in] device_source       Source pointer in device memory.
@@ -126,6 +304,9 @@ class Platform {
    * @return Status::OK() if successful, otherwise a descriptive error status.
    */
   inline Status CopyDeviceToHost(da_t device_source, uint8_t *host_destination, uint64_t size) {
+    TraceSpan span("Platform::CopyDeviceToHost", "copy", size, device_source);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     return Status(platformCopyDeviceToHost(device_source, host_destination, size));
   }
 
@@ -140,6 +321,9 @@ class Platform {
   inline Status PrepareHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size, bool *alloced) {
     assert(platformPrepareHostBuffer != nullptr);
     int ll_alloced = 0;
+    TraceSpan span("Platform::PrepareHostBuffer", "copy", size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     auto stat = platformPrepareHostBuffer(host_source, device_destination, size, &ll_alloced);
     *alloced = ll_alloced == 1;
     return Status(stat);
@@ -147,6 +331,9 @@ class Platform {
 
   /**
   * @brief Cache a memory region of the host for use by the device. Always causes an allocation and copy.
+  *
+  * On failure, the platform must not leave an allocation behind.
+  *
   * @param[in]  host_source          Source pointer in host memory.
   * @param[out] device_destination   Destination pointer in device memory.
   * @param[in]  size                 The amount of bytes to copy.
@@ -154,9 +341,78 @@ class Platform {
   */
   inline Status CacheHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size) {
     assert(platformCacheHostBuffer != nullptr);
+    TraceSpan span("Platform::CacheHostBuffer", "copy", size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     return Status(platformCacheHostBuffer(host_source, device_destination, size));
   }
 
+  /// @brief Return true if the platform can allocate device-visible host memory through platformHostMalloc.
+  inline bool has_host_memory() const { return (platformHostMalloc != nullptr) && (platformHostFree != nullptr); }
+
+  /**
+   * @brief Allocate pinned host memory that the device can access in place.
+   *
+   * Only available if has_host_memory(). Buffers in such memory are used by Contexts without copying them.
+   *
+   * @param[out] host_address The host address of the allocation, aligned to at least 64 bytes.
+   * @param[in]  size         The number of bytes to allocate.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status HostMalloc(uint8_t **host_address, int64_t size);
+
+  /**
+   * @brief Free host memory obtained through HostMalloc().
+   * @param[in] host_address The host address of the allocation.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status HostFree(uint8_t *host_address);
+
+  /**
+   * @brief Translate a host buffer to the address at which the device sees it, if it lies in device-visible memory.
+   * @param[in]  host_address    The host address of the buffer.
+   * @param[in]  size            The size of the buffer in bytes.
+   * @param[out] device_address  The device address of the buffer.
+   * @return True if the buffer lies entirely within a single allocation obtained through HostMalloc(), false otherwise.
+   */
+  bool TranslateHostAddress(const uint8_t *host_address, int64_t size, da_t *device_address) const;
+
+  /// @brief Return true if the platform reports its capabilities through platformGetCapabilities.
+  inline bool has_capabilities() const { return platformGetCapabilities != nullptr; }
+
+  /**
+   * @brief Obtain the capabilities of the platform.
+   *
+   * Fields the platform does not report, e.g. because it does not export platformGetCapabilities or was built against
+   * an older version of fcaps_t, are zero. The size field holds the number of bytes the platform reported, which is
+   * zero for platforms that do not report their capabilities at all.
+   *
+   * @param[out] out The capabilities.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status GetCapabilities(fcaps_t *out);
+
+  /// @brief Return true if the platform can signal kernel completion through platformWaitForCompletion.
+  inline bool has_completion_events() const { return platformWaitForCompletion != nullptr; }
+
+  /**
+   * @brief Block until the platform signals kernel completion, e.g. through an interrupt.
+   *
+   * Each completion is signalled once; a successful wait consumes it. Only available if has_completion_events().
+   *
+   * @param[in] timeout_usec The maximum time to wait in microseconds. Zero only checks for a pending completion.
+   * @return Status::OK() on completion, Status::TIMEOUT() if the timeout expired, otherwise an error status.
+   */
+  inline Status WaitForCompletion(uint64_t timeout_usec) {
+    if (platformWaitForCompletion == nullptr) {
+      return Status::ERROR("Platform does not support completion events.");
+    }
+    // The platform lock is not held while blocking, such that other threads can access the device meanwhile.
+    TraceSpan span("Platform::WaitForCompletion", "wait");
+    Select();
+    return Status(platformWaitForCompletion(timeout_usec));
+  }
+
   /**
    * @brief Terminate the platform
    * @return Status::OK() if successful, otherwise a descriptive error status.
@@ -164,6 +420,8 @@ class Platform {
   inline Status Terminate() {
     assert(platformTerminate != nullptr);
     terminated = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
     return Status(platformTerminate(terminate_data));
   }
 
@@ -189,9 +447,64 @@ class Platform {
   fstatus_t (*platformCacheHostBuffer)(const uint8_t *host_source, da_t *device_destination, int64_t size) = nullptr;
   fstatus_t (*platformTerminate)(void *arg) = nullptr;
 
+  // Optional functions, these may be nullptr after linking:
+  fstatus_t (*platformWaitForCompletion)(uint64_t timeout_usec) = nullptr;
+  fstatus_t (*platformCopyHostToDeviceV)(const fcopy_t *copies, size_t count) = nullptr;
+  fstatus_t (*platformWriteMMIOBatch)(const fmmio_t *writes, size_t count) = nullptr;
+  fstatus_t (*platformGetDeviceCount)(size_t *count) = nullptr;
+  fstatus_t (*platformSetDevice)(size_t index) = nullptr;
+  fstatus_t (*platformHostMalloc)(uint8_t **host_address, da_t *device_address, int64_t size) = nullptr;
+  fstatus_t (*platformHostFree)(uint8_t *host_address) = nullptr;
+  fstatus_t (*platformGetCapabilities)(fcaps_t *capabilities) = nullptr;
+
   /// @brief Attempt to link all functions using a handle obtained by dlopen.
   Status Link(void *handle, bool quiet = true);
 
+  /// @brief Select the device of this instance for subsequent library calls from the calling thread.
+  inline void Select() const {
+    if (platformSetDevice != nullptr) {
+      platformSetDevice(device_);
+    }
+  }
+
+  /// The index of the device of this instance.
+  size_t device_ = 0;
+
+  /// @brief Return true if a write can be skipped because the shadow register file holds the same value.
+  bool IsShadowed(uint64_t offset, uint32_t value) const;
+  /// @brief Record a value written to a register in the shadow register file.
+  void Shadow(uint64_t offset, uint32_t value);
+
+  /// Whether the shadow register file is enabled.
+  bool shadow_enabled_ = false;
+  /// Values of schema-derived registers last written by the host, indexed from FLETCHER_REG_SCHEMA, -1 if unknown.
+  std::vector<int64_t> shadow_;
+  /// Offsets of registers that are never shadowed, besides those below FLETCHER_REG_SCHEMA.
+  std::set<uint64_t> unshadowed_;
+  /// MMIO write statistics.
+  MmioStats mmio_stats_;
+  /// Mutex serializing library calls and protecting the shadow register file, statistics and host allocations.
+  mutable std::mutex mutex_;
+
+  /// A device-visible host memory allocation.
+  struct HostAllocation {
+    /// The address at which the device sees the allocation.
+    da_t device_address;
+    /// The size of the allocation in bytes.
+    int64_t size;
+  };
+  /// Device-visible host memory allocations, by host address.
+  std::map<const uint8_t *, HostAllocation> host_allocations_;
+
+  /// MMIO base offsets of reserved kernels.
+  std::set<uint64_t> reserved_kernels_;
+  /// The owner that most recently reserved the kernel at every MMIO base.
+  std::map<uint64_t, uint64_t> kernel_owners_;
+  /// Mutex protecting the reserved kernels.
+  std::mutex reservation_mutex_;
+  /// Signalled whenever a kernel reservation is released.
+  std::condition_variable reservation_cv_;
+
   /// Whether this platform was terminated.
   bool terminated = false;
 };
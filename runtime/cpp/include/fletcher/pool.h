@@ -0,0 +1,296 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/memory_pool.h>
+#include <fletcher/fletcher.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <set>
+#include <utility>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "fletcher/platform.h"
+#include "fletcher/numa.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// Statistics of a DeviceMemoryPool.
+struct PoolStats {
+  /// The number of bytes of device memory obtained from the platform.
+  size_t bytes_reserved = 0;
+  /// The number of bytes currently handed out, rounded up to whole blocks.
+  size_t bytes_in_use = 0;
+  /// The maximum of bytes_in_use since the pool was created.
+  size_t peak_bytes_in_use = 0;
+  /// The number of bytes in free blocks of all regions.
+  size_t bytes_free = 0;
+  /// The size of the largest free block in bytes.
+  size_t largest_free_block = 0;
+  /// The number of regions obtained from the platform, including dedicated allocations.
+  size_t num_regions = 0;
+  /// The number of allocations currently handed out.
+  size_t num_allocations = 0;
+  /// The total number of allocations handed out since the pool was created.
+  size_t total_allocations = 0;
+
+  /// @brief Return the external fragmentation of the free memory, between 0.0 (none) and 1.0.
+  double fragmentation() const {
+    return bytes_free == 0 ? 0.0 : 1.0 - static_cast<double>(largest_free_block) / static_cast<double>(bytes_free);
+  }
+};
+
+/**
+ * @brief A pool of device memory that hands out aligned sub-allocations of large device regions.
+ *
+ * Regions are obtained from the platform once and carved up by a buddy allocator, with block sizes of powers of two
+ * times the minimum block size. Freed blocks are recycled across all Contexts sharing the pool. Requests larger than
+ * a region are served by a dedicated platform allocation. All functions are thread-safe.
+ */
+class DeviceMemoryPool {
+ public:
+  /**
+   * @brief Construct a new DeviceMemoryPool.
+   * @param[in] platform        The platform to allocate device memory on.
+   * @param[in] region_size     The size of regions obtained from the platform, rounded up to a power of two blocks.
+   * @param[in] min_block_size  The minimum block size and alignment of sub-allocations, must be a power of two.
+   */
+  DeviceMemoryPool(std::shared_ptr<Platform> platform, size_t region_size, size_t min_block_size);
+
+  /// @brief Destruct the pool, returning all regions to the platform.
+  ~DeviceMemoryPool();
+
+  /**
+   * @brief Create a new DeviceMemoryPool.
+   * @param[out] out            A pointer to a shared pointer that will own the new pool.
+   * @param[in]  platform       The platform to allocate device memory on.
+   * @param[in]  region_size    The size of regions obtained from the platform.
+   * @param[in]  min_block_size The minimum block size and alignment of sub-allocations, must be a power of two.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<DeviceMemoryPool> *out,
+                     const std::shared_ptr<Platform> &platform,
+                     size_t region_size = 64 * 1024 * 1024,
+                     size_t min_block_size = 64);
+
+  /**
+   * @brief Allocate a block of device memory from the pool.
+   * @param[out] device_address The device address of the block.
+   * @param[in]  size           The number of bytes to allocate.
+   * @return Status::OK() if successful, Status::DEVICE_OUT_OF_MEMORY() if the platform could not supply a new region,
+   *         otherwise a descriptive error status.
+   */
+  Status Allocate(da_t *device_address, int64_t size);
+
+  /**
+   * @brief Return a block of device memory to the pool.
+   * @param[in] device_address The device address of a block obtained through Allocate().
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Free(da_t device_address);
+
+  /// @brief Return regions without any blocks in use to the platform.
+  Status Trim();
+
+  /// @brief Return the statistics of the pool.
+  PoolStats stats() const;
+
+  /// @brief Return the platform of this pool.
+  std::shared_ptr<Platform> platform() const { return platform_; }
+
+ protected:
+  /// A large region of device memory managed by a buddy allocator.
+  struct Region {
+    /// The device address of the region.
+    da_t base = D_NULLPTR;
+    /// The free blocks of every order, as offsets into the region.
+    std::vector<std::set<size_t>> free_lists;
+    /// The number of blocks in use.
+    size_t blocks_in_use = 0;
+  };
+
+  /// An allocation that was handed out.
+  struct Allocation {
+    /// The region the allocation lives in, or -1 for dedicated allocations.
+    int64_t region = -1;
+    /// The order of the block, or the size in bytes for dedicated allocations.
+    size_t order = 0;
+  };
+
+  /// @brief Return the block size of some order.
+  size_t BlockSize(size_t order) const { return min_block_size_ << order; }
+  /// @brief Attempt to take a block of some order from a region. Returns false if the region has no such block.
+  bool TakeBlock(Region *region, size_t order, size_t *offset);
+  /// @brief Obtain a new region from the platform, storing its index in \p index.
+  Status AddRegion(int64_t *index);
+
+  /// The platform to allocate device memory on.
+  std::shared_ptr<Platform> platform_;
+  /// The minimum block size.
+  size_t min_block_size_;
+  /// The order of a whole region.
+  size_t max_order_ = 0;
+  /// The regions obtained from the platform.
+  std::vector<Region> regions_;
+  /// All allocations handed out, by device address.
+  std::map<da_t, Allocation> allocations_;
+  /// Statistics.
+  PoolStats stats_;
+  /// Mutex protecting all members above.
+  mutable std::mutex mutex_;
+};
+
+/**
+ * @brief An arrow::MemoryPool allocating pinned host memory that the device can access in place.
+ *
+ * Arrow builders, readers and kernels using this pool produce buffers that Contexts hand to the device without copying
+ * them, as long as they are queued with MemType::ANY. Requires a platform that supports device-visible host memory,
+ * see Platform::has_host_memory(). This pool is not to be confused with the DeviceMemoryPool, which sub-allocates
+ * on-board device memory that is only reachable through copies.
+ */
+class DeviceVisibleMemoryPool : public arrow::MemoryPool {
+ public:
+  /**
+   * @brief Construct a new DeviceVisibleMemoryPool.
+   * @param[in] platform The platform to allocate device-visible host memory on.
+   */
+  explicit DeviceVisibleMemoryPool(std::shared_ptr<Platform> platform) : platform_(std::move(platform)) {}
+
+  /**
+   * @brief Create a new DeviceVisibleMemoryPool.
+   * @param[out] out      A pointer to a shared pointer that will own the new pool.
+   * @param[in]  platform The platform to allocate device-visible host memory on.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<DeviceVisibleMemoryPool> *out, const std::shared_ptr<Platform> &platform);
+
+  arrow::Status Allocate(int64_t size, uint8_t **out) override;
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) override;
+  void Free(uint8_t *buffer, int64_t size) override;
+  int64_t bytes_allocated() const override { return bytes_allocated_; }
+  int64_t max_memory() const override { return max_memory_; }
+  std::string backend_name() const override { return "fletcher"; }
+
+  /// @brief Return the platform of this pool.
+  std::shared_ptr<Platform> platform() const { return platform_; }
+
+ protected:
+  /// The platform to allocate device-visible host memory on.
+  std::shared_ptr<Platform> platform_;
+  /// The number of bytes currently allocated.
+  std::atomic<int64_t> bytes_allocated_{0};
+  /// The maximum of bytes_allocated_ since the pool was created.
+  std::atomic<int64_t> max_memory_{0};
+};
+
+/**
+ * @brief An arrow::MemoryPool allocating host memory on the NUMA node of a device, see NumaPlacement.
+ *
+ * Copies to the device from buffers built in this pool do not cross the interconnect between NUMA nodes.
+ */
+class NumaMemoryPool : public arrow::MemoryPool {
+ public:
+  /**
+   * @brief Construct a new NumaMemoryPool.
+   * @param[in] placement The placement of the device.
+   */
+  explicit NumaMemoryPool(std::shared_ptr<NumaPlacement> placement) : placement_(std::move(placement)) {}
+
+  arrow::Status Allocate(int64_t size, uint8_t **out) override;
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) override;
+  void Free(uint8_t *buffer, int64_t size) override;
+  int64_t bytes_allocated() const override { return bytes_allocated_; }
+  int64_t max_memory() const override { return max_memory_; }
+  std::string backend_name() const override { return "fletcher-numa"; }
+
+  /// @brief Return the placement of this pool.
+  std::shared_ptr<NumaPlacement> placement() const { return placement_; }
+
+ protected:
+  /// The placement of the device.
+  std::shared_ptr<NumaPlacement> placement_;
+  /// The number of bytes currently allocated.
+  std::atomic<int64_t> bytes_allocated_{0};
+  /// The maximum of bytes_allocated_ since the pool was created.
+  std::atomic<int64_t> max_memory_{0};
+};
+
+/**
+ * @brief A staging arena holding aligned copies of host buffers that the device accesses in place.
+ *
+ * Copies are bump-allocated from large host memory blocks. Every copy shares ownership of its block, see Allocate().
+ * Once no copy of the current block is referenced anymore, the block is reused from its start, such that a Context
+ * that realigns buffers of similar sizes for every RecordBatch settles on a fixed amount of staging memory.
+ *
+ * Blocks are allocated through Platform::HostMalloc() if the platform supports device-visible host memory, such that
+ * the device can access the copies in place. Otherwise, they are plain host memory, which is only accessible to
+ * devices with shared virtual memory, allocated on the NUMA node of the device if a NumaPlacement is supplied. Not
+ * thread-safe.
+ */
+class StagingArena {
+ public:
+  /**
+   * @brief Construct a new StagingArena.
+   * @param[in] platform    The platform to allocate device-visible host memory on.
+   * @param[in] numa        The placement to allocate other host memory with, if any.
+   * @param[in] block_size  The minimum size of the blocks of the arena in bytes.
+   */
+  explicit StagingArena(std::shared_ptr<Platform> platform,
+                        std::shared_ptr<NumaPlacement> numa = nullptr,
+                        size_t block_size = 4 * 1024 * 1024)
+      : platform_(std::move(platform)), numa_(std::move(numa)), block_size_(block_size) {}
+
+  /**
+   * @brief Allocate an aligned region of the arena.
+   * @param[out] out        The address of the region.
+   * @param[out] block      The block holding the region. The region remains valid as long as a copy of it exists.
+   * @param[in]  size       The size of the region in bytes.
+   * @param[in]  alignment  The alignment of the region in bytes, must be a power of two.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Allocate(uint8_t **out, std::shared_ptr<uint8_t> *block, int64_t size, size_t alignment);
+
+  /// @brief Return the number of bytes of host memory held by blocks of this arena that are still referenced.
+  size_t bytes_reserved() const;
+
+ protected:
+  /// A block of the arena.
+  struct Block {
+    /// The block, freed when the arena and all regions of the block dropped it.
+    std::shared_ptr<uint8_t> data;
+    /// The size of the block in bytes.
+    size_t size = 0;
+  };
+
+  /// The platform to allocate device-visible host memory on.
+  std::shared_ptr<Platform> platform_;
+  /// The placement to allocate other host memory with, if any.
+  std::shared_ptr<NumaPlacement> numa_;
+  /// The minimum size of blocks.
+  size_t block_size_;
+  /// The block regions are currently allocated from.
+  Block current_;
+  /// The number of bytes of the current block in use.
+  size_t used_ = 0;
+  /// Blocks that were replaced while regions still referred to them, and their sizes.
+  std::vector<std::pair<std::weak_ptr<uint8_t>, size_t>> previous_;
+};
+
+}  // namespace fletcher
@@ -0,0 +1,149 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "fletcher/platform.h"
+#include "fletcher/context.h"
+#include "fletcher/kernel.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// The counters of a single stream profiled in hardware, and the ratios derived from them.
+struct StreamProfile {
+  /// The name of the stream, i.e. <RecordBatch>_<field>_<stream index>.
+  std::string name;
+  /// The number of elements transferred.
+  uint32_t elements = 0;
+  /// The number of cycles the stream was valid.
+  uint32_t valids = 0;
+  /// The number of cycles the stream was ready.
+  uint32_t readies = 0;
+  /// The number of cycles the stream was handshaked.
+  uint32_t transfers = 0;
+  /// The number of handshaked last signals.
+  uint32_t packets = 0;
+  /// The number of cycles the profiler was enabled.
+  uint32_t cycles = 0;
+
+  /// @brief Return the number of elements transferred per cycle.
+  double elements_per_cycle() const { return Ratio(elements); }
+  /// @brief Return the fraction of cycles in which the stream transferred, i.e. the utilization of the stream.
+  double utilization() const { return Ratio(transfers); }
+  /// @brief Return the fraction of cycles in which the source was valid but the sink was not ready.
+  double backpressure() const { return Ratio(valids > transfers ? valids - transfers : 0); }
+  /// @brief Return the fraction of cycles in which the sink was ready but the source was not valid.
+  double starvation() const { return Ratio(readies > transfers ? readies - transfers : 0); }
+
+ private:
+  double Ratio(uint32_t count) const { return cycles > 0 ? static_cast<double>(count) / cycles : 0.0; }
+};
+
+/**
+ * @brief Reads the stream profiling registers that Fletchgen generates for fields with fletcher_profile metadata.
+ *
+ * The profiling registers follow the custom registers of the kernel, see docs/mmio.md. They consist of an enable
+ * register, a clear register, and six 32-bit counters for every profiled stream. A field results in one or more
+ * streams, depending on its type; e.g. a string field has a length stream and a character stream.
+ *
+ * The counters are 32 bits wide, so profiled runs must take fewer than 2^32 kernel clock cycles.
+ */
+class StreamProfiler {
+ public:
+  /**
+   * @brief Construct a new StreamProfiler for a known register layout.
+   * @param[in] platform  The platform of the kernel.
+   * @param[in] base      The register offset of the Profile_enable register, including the MMIO base of the kernel.
+   * @param[in] streams   The names of the profiled streams, in register order.
+   */
+  StreamProfiler(std::shared_ptr<Platform> platform, uint64_t base, std::vector<std::string> streams);
+
+  /**
+   * @brief Create a new StreamProfiler, deriving the register layout from the RecordBatches of a context.
+   *
+   * The RecordBatches must be queued in the same order as they were supplied to Fletchgen.
+   *
+   * @param[out] out              A pointer to a shared pointer that will own the new StreamProfiler.
+   * @param[in]  context          The context the kernel operates on.
+   * @param[in]  custom_registers The number of 32-bit registers taken by custom registers of the kernel.
+   * @param[in]  mmio_base        The offset of the MMIO registers of the kernel instance.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<StreamProfiler> *out,
+                     const Context &context,
+                     size_t custom_registers = 0,
+                     uint64_t mmio_base = 0);
+
+  /**
+   * @brief Return the names of the streams that Fletchgen profiles for some schema.
+   * @param[in] schema The schema, with fletcher_profile metadata on the fields to profile.
+   * @return The stream names, in register order.
+   */
+  static std::vector<std::string> ProfiledStreams(const arrow::Schema &schema);
+
+  /// @brief Clear the counters and start counting.
+  Status Start();
+
+  /// @brief Stop counting. The counters retain their values.
+  Status Stop();
+
+  /**
+   * @brief Read the counters of all streams.
+   * @param[out] out The counters of all streams, in register order.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Read(std::vector<StreamProfile> *out);
+
+  /**
+   * @brief Profile a single run of a kernel.
+   * @param[in]  kernel The kernel to run, see Kernel::Run().
+   * @param[out] out    The counters of all streams, in register order.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Profile(Kernel *kernel, std::vector<StreamProfile> *out);
+
+  /**
+   * @brief Return a JSON report of the counters and ratios of some streams.
+   *
+   * The report names the stream with the highest utilization as the bottleneck: it is closest to saturating its
+   * interface. High backpressure on the streams towards the kernel indicates that the kernel itself is the bottleneck.
+   *
+   * @param[in] profiles The stream profiles.
+   * @return The JSON document.
+   */
+  static std::string ToJSON(const std::vector<StreamProfile> &profiles);
+
+  /// @brief Return the names of the profiled streams, in register order.
+  const std::vector<std::string> &streams() const { return streams_; }
+
+  /// @brief Return the register offset of the Profile_enable register.
+  uint64_t base() const { return base_; }
+
+ private:
+  /// The platform of the kernel.
+  std::shared_ptr<Platform> platform_;
+  /// The register offset of the Profile_enable register.
+  uint64_t base_;
+  /// The names of the profiled streams, in register order.
+  std::vector<std::string> streams_;
+};
+
+}  // namespace fletcher
@@ -0,0 +1,127 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/api.h>
+#include <fletcher/common.h>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+#include "fletcher/platform.h"
+#include "fletcher/context.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/**
+ * @brief The results a kernel wrote to the device buffers of a RecordBatch, materialized on the host column by column.
+ *
+ * Columns are copied from the device on first access only. Of every column, only the bytes actually produced by the
+ * kernel are copied: the offsets of variable-length columns are read from the device first, after which the values
+ * are copied up to the final offset. Buffers that the device accessed in place (see DeviceBuffer::zero_copy) are not
+ * copied at all, but wrapped while keeping the original RecordBatch alive.
+ *
+ * Validity bitmaps of fields without nulls at the time the RecordBatch was queued have no device buffer, and are not
+ * materialized. Columns of a sliced RecordBatch start at the first index of its description. Columns can no longer be
+ * materialized after the Context was cleared, enabled again, or destructed.
+ */
+class ResultRecordBatch {
+ public:
+  /**
+   * @brief Construct a new ResultRecordBatch. Use Context::GetResultRecordBatch() to obtain one instead.
+   * @param[in] context     The context holding the device buffers.
+   * @param[in] batch       The RecordBatch that was queued on the context.
+   * @param[in] desc        The description of the RecordBatch.
+   * @param[in] buffers     The device buffers of the RecordBatch.
+   * @param[in] num_rows    The number of rows produced by the kernel.
+   * @param[in] pool        The memory pool to allocate host buffers from.
+   */
+  ResultRecordBatch(const std::shared_ptr<const Context> &context,
+                    std::shared_ptr<arrow::RecordBatch> batch,
+                    RecordBatchDescription desc,
+                    std::vector<DeviceBuffer> buffers,
+                    int64_t num_rows,
+                    arrow::MemoryPool *pool);
+
+  /// @brief Return the schema of the results.
+  std::shared_ptr<arrow::Schema> schema() const { return batch_->schema(); }
+
+  /// @brief Return the number of rows produced by the kernel.
+  int64_t num_rows() const { return num_rows_; }
+
+  /// @brief Return the number of columns.
+  int num_columns() const { return batch_->num_columns(); }
+
+  /**
+   * @brief Obtain a column, copying it from the device if it was not accessed before.
+   * @param[in]  i    The index of the column.
+   * @param[out] out  The column.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status GetColumn(int i, std::shared_ptr<arrow::Array> *out);
+
+  /**
+   * @brief Materialize all columns as an arrow::RecordBatch.
+   * @param[out] out The arrow::RecordBatch.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status ToRecordBatch(std::shared_ptr<arrow::RecordBatch> *out);
+
+  /// @brief Return the number of bytes copied from the device so far.
+  int64_t bytes_copied() const { return bytes_copied_; }
+
+ protected:
+  /// @brief Obtain the first \p size bytes of the i-th device buffer as a host buffer.
+  Status Fetch(size_t i, int64_t size, std::shared_ptr<arrow::Buffer> *out);
+
+  /**
+   * @brief Materialize an array of some field, consuming its device buffers from \p buffer onwards.
+   * @param[in]     field   The field of the array.
+   * @param[in]     length  The number of elements of the array.
+   * @param[in]     offset  The index of the first element in the device buffers.
+   * @param[in,out] buffer  The index of the next device buffer to consume.
+   * @param[out]    out     The array data.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status Materialize(const std::shared_ptr<arrow::Field> &field,
+                     int64_t length,
+                     int64_t offset,
+                     size_t *buffer,
+                     std::shared_ptr<arrow::ArrayData> *out);
+
+  /// The context holding the device buffers.
+  std::weak_ptr<const Context> context_;
+  /// The generation of the context at construction.
+  uint64_t generation_;
+  /// The RecordBatch that was queued on the context.
+  std::shared_ptr<arrow::RecordBatch> batch_;
+  /// The description of the RecordBatch.
+  RecordBatchDescription desc_;
+  /// The device buffers of the RecordBatch.
+  std::vector<DeviceBuffer> buffers_;
+  /// The number of rows produced by the kernel.
+  int64_t num_rows_;
+  /// The memory pool to allocate host buffers from.
+  arrow::MemoryPool *pool_;
+  /// The index of the first device buffer of every column.
+  std::vector<size_t> first_buffer_;
+  /// Columns that were materialized, nullptr if not accessed yet.
+  std::vector<std::shared_ptr<arrow::Array>> columns_;
+  /// The number of bytes copied from the device.
+  int64_t bytes_copied_ = 0;
+};
+
+}  // namespace fletcher
@@ -0,0 +1,119 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <memory>
+
+#include "fletcher/context.h"
+#include "fletcher/kernel.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/**
+ * @brief A function combining the 64-bit return value of a chunk with the accumulated result of previous chunks.
+ *
+ * The return value of a chunk is formed by REG_RETURN1 (high bits) and REG_RETURN0 (low bits). Chunks complete in
+ * any order, so the function should be associative and commutative.
+ */
+using ReduceFunction = std::function<uint64_t(uint64_t accumulator, uint64_t value)>;
+
+/// Statistics of a KernelScheduler run.
+struct SchedulerStats {
+  /// The number of chunks processed.
+  size_t chunks = 0;
+  /// The number of chunks processed by every instance.
+  std::vector<size_t> chunks_per_instance;
+  /// Total time of the run, in seconds.
+  double seconds = 0.0;
+};
+
+/**
+ * @brief Schedules the rows of a RecordBatch over a number of replicated kernel instances.
+ *
+ * Every instance lives at its own MMIO base offset. The rows of a RecordBatch are split into chunks that are handed
+ * out through Kernel::SetRange. Instances that finish early immediately receive the next chunk, such that faster or
+ * less loaded instances process more chunks. Return values of all chunks are combined through a ReduceFunction.
+ *
+ * While all instances are busy, the scheduler blocks on the completion events of the platform if it has them. Otherwise
+ * it backs off according to its PollStrategy. Completion events are not attributed to an instance; only the status
+ * register of an instance decides whether its chunk is done.
+ */
+class KernelScheduler {
+ public:
+  /**
+   * @brief Construct a new KernelScheduler.
+   * @param[in] context     The context holding the RecordBatches to process.
+   * @param[in] mmio_bases  The MMIO base offsets of the kernel instances.
+   * @param[in] chunk_rows  The number of rows of a chunk.
+   */
+  KernelScheduler(const std::shared_ptr<Context> &context, const std::vector<uint64_t> &mmio_bases, int32_t chunk_rows);
+
+  /**
+   * @brief Create a new KernelScheduler.
+   * @param[out] out         A pointer to a shared pointer that will own the new KernelScheduler.
+   * @param[in]  context     The context holding the RecordBatches to process.
+   * @param[in]  mmio_bases  The MMIO base offsets of the kernel instances.
+   * @param[in]  chunk_rows  The number of rows of a chunk.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<KernelScheduler> *out,
+                     const std::shared_ptr<Context> &context,
+                     const std::vector<uint64_t> &mmio_bases,
+                     int32_t chunk_rows = 1024);
+
+  /**
+   * @brief Process all rows of a RecordBatch, blocking until all chunks are done.
+   *
+   * Other RecordBatches of the context are presented to every instance in full.
+   *
+   * Only instances that receive a chunk are programmed. If an instance fails or the deadline of the poll strategy
+   * passes, instances that are still running are reset. No instance remains reserved after returning.
+   *
+   * @param[in]  recordbatch_index The index of the RecordBatch of which to split the rows.
+   * @param[in]  reduce            The function to combine the return values of chunks with.
+   * @param[in]  init              The initial value of the accumulator.
+   * @param[out] result            The combined return value of all chunks.
+   * @return Status::OK() if successful, Status::TIMEOUT() if the deadline passed, otherwise the status of the first
+   *         failing instance.
+   */
+  Status Run(size_t recordbatch_index, const ReduceFunction &reduce, uint64_t init, uint64_t *result);
+
+  /// @brief Return the kernel instances of this scheduler.
+  const std::vector<std::shared_ptr<Kernel>> &instances() const { return instances_; }
+
+  /// @brief Return the statistics of the most recent run.
+  const SchedulerStats &stats() const { return stats_; }
+
+  /// The strategy to poll the instances with when the platform has no completion events. Its deadline bounds a run.
+  PollStrategy poll_strategy;
+  /// Whether to block on completion events while all instances are busy, if the platform has them.
+  bool use_completion_events = true;
+
+ protected:
+  /// The context holding the RecordBatches to process.
+  std::shared_ptr<Context> context_;
+  /// The kernel instances.
+  std::vector<std::shared_ptr<Kernel>> instances_;
+  /// The number of rows of a chunk.
+  int32_t chunk_rows_;
+  /// Statistics of the most recent run.
+  SchedulerStats stats_;
+};
+
+}  // namespace fletcher
@@ -0,0 +1,92 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+#include "fletcher/platform.h"
+#include "fletcher/context.h"
+#include "fletcher/kernel.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/**
+ * @brief A context spread over multiple devices.
+ *
+ * Every device holds a shard: a Context and a Kernel of its own. Queued RecordBatches are assigned to the shard with
+ * the least queued bytes, after which all shards are enabled and run in parallel, each from its own host thread.
+ */
+class ShardedContext {
+ public:
+  /**
+   * @brief Construct a new ShardedContext.
+   * @param[in] platforms The platforms of the devices to shard over, e.g. obtained through Platform::MakeAll().
+   */
+  explicit ShardedContext(const std::vector<std::shared_ptr<Platform>> &platforms);
+
+  /**
+   * @brief Create a new ShardedContext.
+   * @param[out] out        A pointer to a shared pointer that will own the new ShardedContext.
+   * @param[in]  platforms  The platforms of the devices to shard over, e.g. obtained through Platform::MakeAll().
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<ShardedContext> *out, const std::vector<std::shared_ptr<Platform>> &platforms);
+
+  /**
+   * @brief Enqueue an arrow::RecordBatch on the shard with the least queued bytes.
+   * @param[in] record_batch  The arrow::RecordBatch to queue.
+   * @param[in] mem_type      The memory type to use on the device.
+   * @param[out] shard        Optionally, the index of the shard the RecordBatch was queued on.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status QueueRecordBatch(const std::shared_ptr<arrow::RecordBatch> &record_batch,
+                          MemType mem_type = MemType::ANY,
+                          size_t *shard = nullptr);
+
+  /**
+   * @brief Enable the queued RecordBatches of all shards, in parallel.
+   * @return Status::OK() if successful, otherwise the status of the first failing shard.
+   */
+  Status Enable();
+
+  /**
+   * @brief Run the kernels of all shards that hold RecordBatches in parallel, blocking until all are done.
+   * @param[out] returns The return value of every shard, REG_RETURN1 in the high and REG_RETURN0 in the low bits. Zero
+   *                     for shards without RecordBatches.
+   * @return Status::OK() if successful, otherwise the status of the first failing shard.
+   */
+  Status Run(std::vector<uint64_t> *returns);
+
+  /// @brief Return the number of shards.
+  size_t num_shards() const { return contexts_.size(); }
+
+  /// @brief Return the Context of the i-th shard.
+  std::shared_ptr<Context> context(size_t i) const { return contexts_[i]; }
+
+  /// @brief Return the Kernel of the i-th shard.
+  std::shared_ptr<Kernel> kernel(size_t i) const { return kernels_[i]; }
+
+ protected:
+  /// The contexts of all shards.
+  std::vector<std::shared_ptr<Context>> contexts_;
+  /// The kernels of all shards.
+  std::vector<std::shared_ptr<Kernel>> kernels_;
+};
+
+}  // namespace fletcher
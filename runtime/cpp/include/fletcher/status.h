@@ -69,6 +69,7 @@ struct Status {
   // Other error states:
   STATUS_FACTORY(NO_PLATFORM, "Could not detect platform.")
   STATUS_FACTORY(DEVICE_OUT_OF_MEMORY, "Device out of memory.")
+  STATUS_FACTORY(TIMEOUT, "Operation timed out.")
 };
 
 }  // namespace fletcher
@@ -0,0 +1,131 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+#include "fletcher/platform.h"
+#include "fletcher/context.h"
+#include "fletcher/executor.h"
+#include "fletcher/scheduler.h"
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// Statistics of a TableExecutor run.
+struct TableStats {
+  /// The number of chunks the kernel processed.
+  size_t chunks = 0;
+  /// The number of rows the kernel processed.
+  int64_t rows = 0;
+  /// The number of bytes of the largest chunk.
+  size_t max_chunk_bytes = 0;
+  /// Total time of the run, in seconds.
+  double seconds = 0.0;
+};
+
+/**
+ * @brief Executes a kernel over inputs of any size, using a bounded amount of device memory.
+ *
+ * Input RecordBatches are cut into chunks of which the buffers fit a share of the device memory budget. Chunks are
+ * streamed through the slots of a StreamExecutor, such that the next chunk is prepared while the kernel processes the
+ * current one, and the return values of all chunks are combined through a ReduceFunction.
+ *
+ * Chunks of fixed-width columns are zero-copy slices. Variable-length columns are compacted on the host, such that
+ * their chunks only hold the values of their own rows. Every slot reuses its device allocations for subsequent chunks,
+ * and frees those it cannot reuse before allocating new ones. Device memory thus stays close to the budget for chunks
+ * of similar layout, and below twice the budget in any case.
+ */
+class TableExecutor {
+ public:
+  /**
+   * @brief Construct a new TableExecutor.
+   * @param[in] platform      The platform to execute on.
+   * @param[in] memory_budget The number of bytes of device memory the buffers of all slots may occupy.
+   * @param[in] num_slots     The number of chunks resident on the device at the same time, at least two for overlap.
+   * @param[in] mem_type      The memory type with which chunks are queued.
+   */
+  TableExecutor(std::shared_ptr<Platform> platform, size_t memory_budget, size_t num_slots, MemType mem_type);
+
+  /**
+   * @brief Create a new TableExecutor.
+   * @param[out] out            A pointer to a shared pointer that will own the new TableExecutor.
+   * @param[in]  platform       The platform to execute on.
+   * @param[in]  memory_budget  The number of bytes of device memory the buffers of all slots may occupy.
+   * @param[in]  num_slots      The number of chunks resident on the device at the same time.
+   * @param[in]  mem_type       The memory type with which chunks are queued.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  static Status Make(std::shared_ptr<TableExecutor> *out,
+                     const std::shared_ptr<Platform> &platform,
+                     size_t memory_budget,
+                     size_t num_slots = 2,
+                     MemType mem_type = MemType::CACHE);
+
+  /**
+   * @brief Run the kernel over all RecordBatches of a reader.
+   * @param[in]  reader  The reader to consume.
+   * @param[in]  reduce  The function to combine the return values of chunks with.
+   * @param[in]  init    The initial value of the accumulator.
+   * @param[out] result  The combined return value of all chunks.
+   * @return Status::OK() if successful, otherwise the first error status encountered.
+   */
+  Status Run(arrow::RecordBatchReader *reader, const ReduceFunction &reduce, uint64_t init, uint64_t *result);
+
+  /**
+   * @brief Run the kernel over all rows of a table.
+   * @param[in]  table   The table to process.
+   * @param[in]  reduce  The function to combine the return values of chunks with.
+   * @param[in]  init    The initial value of the accumulator.
+   * @param[out] result  The combined return value of all chunks.
+   * @return Status::OK() if successful, otherwise the first error status encountered.
+   */
+  Status Run(const arrow::Table &table, const ReduceFunction &reduce, uint64_t init, uint64_t *result);
+
+  /// @brief Return the statistics of the most recent run.
+  const TableStats &stats() const { return stats_; }
+
+  /// @brief Return the StreamExecutor the chunks are streamed through.
+  std::shared_ptr<StreamExecutor> executor() const { return executor_; }
+
+  /// Custom arguments written to the kernel before every launch, see Kernel::SetArguments().
+  std::vector<uint32_t> arguments;
+
+ protected:
+  /**
+   * @brief Cut the next chunk from a RecordBatch.
+   * @param[in]     batch     The RecordBatch to cut the chunk from.
+   * @param[in,out] position  The first row of the chunk, advanced past the chunk.
+   * @param[in,out] rows      The number of rows to attempt, lowered if the chunk exceeds the budget.
+   * @param[out]    out       The chunk.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status NextChunk(const std::shared_ptr<arrow::RecordBatch> &batch,
+                   int64_t *position,
+                   int64_t *rows,
+                   std::shared_ptr<arrow::RecordBatch> *out);
+
+  /// The executor streaming the chunks.
+  std::shared_ptr<StreamExecutor> executor_;
+  /// The number of bytes the buffers of a single chunk may occupy.
+  size_t chunk_budget_;
+  /// Statistics of the most recent run.
+  TableStats stats_;
+};
+
+}  // namespace fletcher
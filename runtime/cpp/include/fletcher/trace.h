@@ -0,0 +1,238 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "fletcher/status.h"
+
+namespace fletcher {
+
+/// A span of time recorded by the Tracer.
+struct TraceEvent {
+  /// The name of the span, a string literal.
+  const char *name = nullptr;
+  /// The category of the span, a string literal.
+  const char *category = nullptr;
+  /// The index of the thread that recorded the span.
+  uint32_t thread = 0;
+  /// The start of the span, in nanoseconds since the tracer was constructed.
+  uint64_t start_ns = 0;
+  /// The duration of the span in nanoseconds.
+  uint64_t duration_ns = 0;
+  /// The number of bytes transferred during the span, if any.
+  uint64_t bytes = 0;
+  /// The register offset or device address the span operated on, if any.
+  uint64_t offset = 0;
+  /// The number of operations the span consisted of, e.g. register accesses of a batch.
+  uint64_t count = 0;
+};
+
+/// A histogram with power-of-two buckets. Bucket 0 counts values below 1, bucket i counts values in [2^(i-1), 2^i).
+struct Log2Histogram {
+  /// The number of values in every bucket.
+  std::vector<uint64_t> buckets;
+
+  /// @brief Add a value to the histogram.
+  void Add(double value);
+
+  /// @brief Return the total number of values in the histogram.
+  uint64_t count() const;
+
+  /// @brief Return the upper bound of the bucket that holds the p-th fraction of all values, with p in [0, 1].
+  double Percentile(double p) const;
+};
+
+/// Aggregated statistics of all spans with the same name.
+struct SpanStats {
+  /// The number of spans.
+  uint64_t count = 0;
+  /// The total duration of the spans in seconds.
+  double seconds = 0.0;
+  /// The total number of bytes transferred during the spans.
+  uint64_t bytes = 0;
+  /// The total number of operations of the spans.
+  uint64_t ops = 0;
+  /// The durations of the spans in microseconds.
+  Log2Histogram latency_us;
+
+  /// @brief Return the throughput of the spans in GB/s.
+  double gbps() const { return seconds > 0.0 ? static_cast<double>(bytes) / seconds * 1E-9 : 0.0; }
+};
+
+/// Statistics aggregated over all recorded spans.
+struct TraceSummary {
+  /// Statistics of every kind of span, by name.
+  std::map<std::string, SpanStats> spans;
+  /// The throughput of individual copies between host and device, in MB/s.
+  Log2Histogram copy_mbps;
+  /// The number of MMIO register accesses per kernel launch, including the set-up and polling of the launch.
+  Log2Histogram mmio_ops_per_launch;
+  /// The number of spans that were overwritten before they could be collected.
+  uint64_t dropped = 0;
+
+  /// @brief Print the summary as a human-readable table.
+  void Print(std::ostream &os) const;
+};
+
+/**
+ * @brief Records timestamped spans of runtime operations into per-thread ring buffers.
+ *
+ * Tracing is disabled by default and costs a single relaxed atomic load per instrumented operation while disabled.
+ * When enabled, every thread records into its own ring buffer without locking; once a ring is full, its oldest spans
+ * are overwritten. Rings are registered with the tracer on the first span of a thread and live as long as the process.
+ *
+ * Collect(), Export and Summarize read the rings of all threads. They should be called when no other thread records
+ * spans, e.g. after Disable(), because spans that are overwritten while being read may be torn.
+ */
+class Tracer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  /// @brief Return the process-wide Tracer that the runtime records into.
+  static Tracer &Global();
+
+  /**
+   * @brief Start recording spans.
+   * @param[in] ring_capacity The number of spans the ring of a thread can hold. Applies to threads that did not record
+   *                          any span yet.
+   */
+  void Enable(size_t ring_capacity = 1u << 16u);
+
+  /// @brief Stop recording spans. Recorded spans are retained until Clear().
+  void Disable();
+
+  /// @brief Return true if spans are being recorded.
+  inline bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  /// @brief Discard all recorded spans.
+  void Clear();
+
+  /**
+   * @brief Record a span into the ring of the calling thread.
+   * @param[in] name      The name of the span, must be a string literal.
+   * @param[in] category  The category of the span, must be a string literal.
+   * @param[in] start     The start of the span.
+   * @param[in] stop      The end of the span.
+   * @param[in] bytes     The number of bytes transferred during the span.
+   * @param[in] offset    The register offset or device address the span operated on.
+   * @param[in] count     The number of operations the span consisted of.
+   */
+  void Record(const char *name,
+              const char *category,
+              clock::time_point start,
+              clock::time_point stop,
+              uint64_t bytes,
+              uint64_t offset,
+              uint64_t count);
+
+  /// @brief Return all recorded spans of all threads, ordered by their start.
+  std::vector<TraceEvent> Collect() const;
+
+  /**
+   * @brief Export all recorded spans in the Chrome trace event format, which Perfetto and chrome://tracing can load.
+   * @param[in] os The stream to write the JSON document to.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status ExportChromeTrace(std::ostream *os) const;
+
+  /**
+   * @brief Export all recorded spans in the Chrome trace event format to a file.
+   * @param[in] path The path of the file to write.
+   * @return Status::OK() if successful, otherwise a descriptive error status.
+   */
+  Status ExportChromeTrace(const std::string &path) const;
+
+  /// @brief Aggregate all recorded spans.
+  TraceSummary Summarize() const;
+
+ private:
+  /// A ring buffer of spans, written by a single thread.
+  struct Ring {
+    Ring(size_t capacity, uint32_t thread) : events(capacity), thread(thread) {}
+    /// The spans.
+    std::vector<TraceEvent> events;
+    /// The number of spans ever recorded into this ring.
+    std::atomic<uint64_t> head{0};
+    /// The index of the thread owning this ring.
+    uint32_t thread;
+  };
+
+  Tracer();
+
+  /// @brief Return the ring of the calling thread, registering a new one if the thread has none.
+  Ring *ThreadRing();
+
+  /// Whether spans are being recorded.
+  std::atomic<bool> enabled_{false};
+  /// The capacity of new rings.
+  size_t ring_capacity_ = 1u << 16u;
+  /// The point in time all spans are relative to.
+  clock::time_point epoch_;
+  /// The rings of all threads that recorded spans.
+  std::vector<std::unique_ptr<Ring>> rings_;
+  /// Mutex protecting the registration of rings.
+  mutable std::mutex mutex_;
+};
+
+/**
+ * @brief Records the lifetime of a scope as a span, if tracing is enabled.
+ *
+ * The name and category must be string literals, since only their addresses are recorded.
+ */
+class TraceSpan {
+ public:
+  TraceSpan(const char *name, const char *category, uint64_t bytes = 0, uint64_t offset = 0, uint64_t count = 1)
+      : name_(name), category_(category), bytes_(bytes), offset_(offset), count_(count),
+        enabled_(Tracer::Global().enabled()) {
+    if (enabled_) {
+      start_ = Tracer::clock::now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (enabled_) {
+      Tracer::Global().Record(name_, category_, start_, Tracer::clock::now(), bytes_, offset_, count_);
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+  /// @brief Set the number of bytes transferred during the span.
+  void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+
+  /// @brief Set the number of operations the span consisted of.
+  void set_count(uint64_t count) { count_ = count; }
+
+ private:
+  const char *name_;
+  const char *category_;
+  uint64_t bytes_;
+  uint64_t offset_;
+  uint64_t count_;
+  bool enabled_;
+  Tracer::clock::time_point start_;
+};
+
+}  // namespace fletcher
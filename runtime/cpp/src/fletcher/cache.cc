@@ -0,0 +1,274 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/cache.h"
+
+#include <fletcher/common.h>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <utility>
+#include <memory>
+
+namespace fletcher {
+
+/// @brief Hash the contents of a buffer, eight bytes at a time.
+static uint64_t HashContents(const uint8_t *data, int64_t size) {
+  const uint64_t m = 0xC6A4A7935BD1E995ull;
+  uint64_t h = 0x9E3779B97F4A7C15ull ^ (static_cast<uint64_t>(size) * m);
+  int64_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t k;
+    std::memcpy(&k, data + i, sizeof(k));
+    k *= m;
+    k ^= k >> 47u;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  for (; i < size; i++) {
+    h ^= static_cast<uint64_t>(data[i]) << (8u * (i % 8));
+    h *= m;
+  }
+  h ^= h >> 47u;
+  h *= m;
+  h ^= h >> 47u;
+  return h;
+}
+
+DeviceBufferCache::DeviceBufferCache(std::shared_ptr<Platform> platform, size_t capacity, bool hash_contents)
+    : platform_(std::move(platform)), capacity_(capacity), hash_contents_(hash_contents) {}
+
+DeviceBufferCache::~DeviceBufferCache() {
+  for (const auto &e : entries_) {
+    if (e.second.references != 0) {
+      FLETCHER_LOG(WARNING, "DeviceBufferCache destructed while device copies are still referenced.");
+    }
+    if (pool_ != nullptr) {
+      pool_->Free(e.second.device_address);
+    } else {
+      platform_->DeviceFree(e.second.device_address);
+    }
+  }
+}
+
+Status DeviceBufferCache::Make(std::shared_ptr<DeviceBufferCache> *out,
+                               const std::shared_ptr<Platform> &platform,
+                               size_t capacity,
+                               bool hash_contents) {
+  *out = std::make_shared<DeviceBufferCache>(platform, capacity, hash_contents);
+  return Status::OK();
+}
+
+void DeviceBufferCache::set_memory_pool(std::shared_ptr<DeviceMemoryPool> pool) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!entries_.empty()) {
+    FLETCHER_LOG(WARNING, "Changing the memory pool of a non-empty DeviceBufferCache; ignored.");
+    return;
+  }
+  pool_ = std::move(pool);
+}
+
+Status DeviceBufferCache::EvictEntry(std::map<Key, Entry>::iterator entry) {
+  auto status = (pool_ != nullptr) ? pool_->Free(entry->second.device_address)
+                                   : platform_->DeviceFree(entry->second.device_address);
+  stats_.entries--;
+  stats_.bytes -= entry->second.size;
+  lru_.erase(entry->second.lru);
+  by_device_address_.erase(entry->second.device_address);
+  auto host_address = std::get<0>(entry->first);
+  entries_.erase(entry);
+  PruneGeneration(host_address);
+  return status;
+}
+
+void DeviceBufferCache::PruneGeneration(uintptr_t host_address) {
+  if (hash_contents_) {
+    return;
+  }
+  auto it = entries_.lower_bound(std::make_tuple(host_address, INT64_MIN, 0));
+  if ((it == entries_.end()) || (std::get<0>(it->first) != host_address)) {
+    generations_.erase(host_address);
+  }
+}
+
+bool DeviceBufferCache::EvictFor(int64_t bytes) {
+  // Walk from the least recently used entry, skipping entries that are still referenced.
+  auto it = lru_.end();
+  while ((capacity_ != 0) && (stats_.bytes + bytes > capacity_)) {
+    if (it == lru_.begin()) {
+      return false;
+    }
+    --it;
+    auto entry = entries_.find(*it);
+    if (entry->second.references == 0) {
+      // Move the iterator off the entry before it is erased.
+      ++it;
+      EvictEntry(entry);
+      stats_.evictions++;
+    }
+  }
+  return true;
+}
+
+Status DeviceBufferCache::AllocateEvicting(da_t *device_address, int64_t size) {
+  if (!EvictFor(size)) {
+    return Status::DEVICE_OUT_OF_MEMORY();
+  }
+  while (true) {
+    auto status = (pool_ != nullptr) ? pool_->Allocate(device_address, size)
+                                     : platform_->DeviceMalloc(device_address, size);
+    if (!(status == Status::DEVICE_OUT_OF_MEMORY())) {
+      return status;
+    }
+    // Evict the least recently used entry that is not referenced and try again.
+    auto it = lru_.rbegin();
+    while ((it != lru_.rend()) && (entries_.find(*it)->second.references != 0)) {
+      ++it;
+    }
+    if (it == lru_.rend()) {
+      return status;
+    }
+    FLETCHER_LOG(DEBUG, "DeviceBufferCache evicting entry, device out of memory.");
+    EvictEntry(entries_.find(*it));
+    stats_.evictions++;
+  }
+}
+
+Status DeviceBufferCache::Acquire(const uint8_t *host_address, int64_t size, da_t *device_address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Key key;
+  if (hash_contents_) {
+    // Entries of different contents with the same hash are told apart by a collision index.
+    auto hash = HashContents(host_address, size);
+    uintptr_t index = 0;
+    while (true) {
+      key = std::make_tuple(index, size, hash);
+      auto entry = entries_.find(key);
+      if ((entry == entries_.end())
+          || (std::memcmp(entry->second.contents.data(), host_address, static_cast<size_t>(size)) == 0)) {
+        break;
+      }
+      index++;
+    }
+  } else {
+    auto gen = generations_.find(reinterpret_cast<uintptr_t>(host_address));
+    key = std::make_tuple(reinterpret_cast<uintptr_t>(host_address),
+                          size,
+                          gen == generations_.end() ? 0 : gen->second);
+  }
+
+  auto entry = entries_.find(key);
+  if (entry != entries_.end()) {
+    stats_.hits++;
+    entry->second.references++;
+    lru_.splice(lru_.begin(), lru_, entry->second.lru);
+    *device_address = entry->second.device_address;
+    return Status::OK();
+  }
+
+  stats_.misses++;
+  auto status = AllocateEvicting(device_address, size);
+  if (!status.ok()) {
+    return status;
+  }
+  status = platform_->CopyHostToDevice(const_cast<uint8_t *>(host_address), *device_address, size);
+  if (!status.ok()) {
+    if (pool_ != nullptr) {
+      pool_->Free(*device_address);
+    } else {
+      platform_->DeviceFree(*device_address);
+    }
+    return status;
+  }
+  Entry e;
+  e.device_address = *device_address;
+  e.size = size;
+  e.references = 1;
+  if (hash_contents_) {
+    e.contents.assign(host_address, host_address + size);
+  }
+  lru_.push_front(key);
+  e.lru = lru_.begin();
+  entries_[key] = e;
+  by_device_address_[*device_address] = key;
+  stats_.entries++;
+  stats_.bytes += size;
+  return Status::OK();
+}
+
+Status DeviceBufferCache::Release(da_t device_address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto key = by_device_address_.find(device_address);
+  if (key == by_device_address_.end()) {
+    return Status::ERROR("Device address is not cached by this DeviceBufferCache.");
+  }
+  auto entry = entries_.find(key->second);
+  if (entry->second.references == 0) {
+    return Status::ERROR("Device copy released more often than it was acquired.");
+  }
+  entry->second.references--;
+  // Copies of data that was invalidated in the mean time can never be hit again.
+  if (!hash_contents_ && (entry->second.references == 0)) {
+    auto gen = generations_.find(std::get<0>(entry->first));
+    if ((gen != generations_.end()) && (std::get<2>(entry->first) != gen->second)) {
+      return EvictEntry(entry);
+    }
+  }
+  return Status::OK();
+}
+
+void DeviceBufferCache::Invalidate(const uint8_t *host_address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (hash_contents_) {
+    return;
+  }
+  auto address = reinterpret_cast<uintptr_t>(host_address);
+  generations_[address]++;
+  // Free unreferenced copies of the old data right away, the others are freed upon release.
+  auto it = entries_.lower_bound(std::make_tuple(address, INT64_MIN, 0));
+  while ((it != entries_.end()) && (std::get<0>(it->first) == address)) {
+    auto next = std::next(it);
+    if (it->second.references == 0) {
+      EvictEntry(it);
+    }
+    it = next;
+  }
+  // Without any copies left, there is nothing to tell the new data apart from.
+  PruneGeneration(address);
+}
+
+Status DeviceBufferCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Status result = Status::OK();
+  auto it = entries_.begin();
+  while (it != entries_.end()) {
+    auto next = std::next(it);
+    if (it->second.references == 0) {
+      auto status = EvictEntry(it);
+      if (!status.ok()) {
+        result = status;
+      }
+    }
+    it = next;
+  }
+  return result;
+}
+
+CacheStats DeviceBufferCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace fletcher
@@ -14,94 +14,564 @@
 
 #include <arrow/api.h>
 #include <fletcher/common.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <utility>
 #include <vector>
 #include <memory>
 
 #include "fletcher/context.h"
+#include "fletcher/result.h"
 
 namespace fletcher {
 
+/// The chunk size of CHUNKED uploads if neither the Context nor the platform sets one.
+static constexpr size_t kDefaultChunkSize = 4 * 1024 * 1024;
+/// The burst size in bytes of the default bus, with a data width of 512 bits and a burst step length of 1.
+static constexpr size_t kDefaultBurstBytes = 64;
+
+/// @brief Return the burst size in bytes of the bus specified by the fletcher_bus_spec metadata of a schema.
+static size_t BurstBytes(const arrow::Schema &schema) {
+  // <address width>,<data width>,<len width>,<burst step length>,<max burst length>
+  std::stringstream spec(GetMeta(schema, meta::BUS_SPEC));
+  std::vector<uint64_t> values;
+  std::string value;
+  while (std::getline(spec, value, ',')) {
+    values.push_back(std::strtoull(value.c_str(), nullptr, 10));
+  }
+  if ((values.size() != 5) || (values[1] < 8)) {
+    return kDefaultBurstBytes;
+  }
+  return values[1] / 8 * std::max<uint64_t>(values[3], 1);
+}
+
 Status Context::Make(std::shared_ptr<Context> *context, const std::shared_ptr<Platform> &platform) {
   *context = std::make_shared<Context>(platform);
   return Status::OK();
 }
 
 Context::~Context() {
-  Status status;
   FLETCHER_LOG(DEBUG, "Destructing Context...");
   for (const auto &buf : device_buffers_) {
-    if (buf.was_alloced) {
-      status = platform_->DeviceFree(buf.device_address);
-      if (!status.ok()) {
-        FLETCHER_LOG(ERROR, "Could not properly free context. Device memory may be corrupted. "
-                            "Status: " + status.message);
-      }
+    FreeDeviceBuffer(buf);
+  }
+  for (const auto &buf : retained_buffers_) {
+    FreeDeviceBuffer(buf);
+  }
+}
+
+void Context::FreeDeviceBuffer(const DeviceBuffer &buffer) {
+  if (buffer.was_alloced) {
+    Status status;
+    if (buffer.cache != nullptr) {
+      status = buffer.cache->Release(buffer.device_address);
+    } else if (buffer.pool != nullptr) {
+      status = buffer.pool->Free(buffer.device_address);
+    } else {
+      status = platform_->DeviceFree(buffer.device_address);
+    }
+    if (!status.ok()) {
+      FLETCHER_LOG(ERROR, "Could not properly free context. Device memory may be corrupted. "
+                          "Status: " + status.message);
     }
   }
 }
 
+/// @brief Return true if a retained allocation can be reused by copying a new buffer into it.
+static bool CanReuse(const DeviceBuffer &retained, const DeviceBuffer &buffer) {
+  // A retained allocation of a MemType::ANY buffer shows that this platform copies such buffers anyway. Cached device
+  // copies may be shared with other contexts, so they must never be overwritten.
+  return retained.was_alloced && (retained.cache == nullptr) && (retained.memory == buffer.memory)
+      && (retained.capacity >= buffer.size);
+}
+
 Status Context::Enable() {
+  TraceSpan span("Context::Enable", "context");
   auto num_batches = host_batches_.size();
   // Sanity check
   assert(num_batches == host_batch_desc_.size());
   assert(num_batches == host_batch_memtype_.size());
+  assert(num_batches == host_batch_enabled_.size());
+
+  FLETCHER_LOG(DEBUG, "Enabling context for "
+      << std::count(host_batch_enabled_.begin(), host_batch_enabled_.end(), false) << " queued RecordBatch(es)");
+  generation_++;
+  NumaPinScope pin(numa_.get());
 
-  FLETCHER_LOG(DEBUG, "Enabling context for " << num_batches << " queued RecordBatch(es)");
+  auto status = platform_->GetCapabilities(&capabilities_);
+  if (!status.ok()) {
+    return status;
+  }
+  // Retained buffers are never handed to the device again, so their staged copies may be reused.
+  for (auto &buf : retained_buffers_) {
+    buf.staging.reset();
+  }
 
-  // Loop over all batches queued on host
+  // Loop over all batches that were queued or replaced since the previous call, leaving the others untouched.
   for (size_t i = 0; i < num_batches; i++) {
-    auto rbd = host_batch_desc_[i];
-    auto type = host_batch_memtype_[i];
-    for (const auto &f : rbd.fields) {
-      for (const auto &b : f.buffers) {
-        fletcher::Status status;
-        DeviceBuffer device_buf(b.raw_buffer_, b.size_, type, rbd.mode);
-        if (type == MemType::ANY) {
-          status = platform_->PrepareHostBuffer(device_buf.host_address,
-                                                &device_buf.device_address,
-                                                device_buf.size,
-                                                &device_buf.was_alloced);
-        } else if (type == MemType::CACHE) {
-          status = platform_->CacheHostBuffer(device_buf.host_address,
+    if (host_batch_enabled_[i]) {
+      continue;
+    }
+    TraceSpan batch_span("Context::EnableBatch", "context", 0, i);
+    auto first = FirstDeviceBuffer(i);
+    std::vector<DeviceBuffer> buffers;
+    status = EnableBatch(i, first, &buffers);
+    if (!status.ok()) {
+      for (const auto &buf : buffers) {
+        FreeDeviceBuffer(buf);
+      }
+      return status;
+    }
+    device_buffers_.insert(device_buffers_.begin() + first, buffers.begin(), buffers.end());
+    host_batch_enabled_[i] = true;
+    uint64_t bytes = 0;
+    for (const auto &buf : buffers) {
+      bytes += buf.size;
+    }
+    batch_span.set_bytes(bytes);
+    batch_span.set_count(buffers.size());
+  }
+
+  // Free retained allocations that were not reused.
+  for (const auto &buf : retained_buffers_) {
+    FreeDeviceBuffer(buf);
+  }
+  retained_buffers_.clear();
+
+  FLETCHER_LOG(DEBUG, "Context contains " << device_buffers_.size() << " device buffer(s).");
+  return Status::OK();
+}
+
+Status Context::EnableBatch(size_t i, size_t first, std::vector<DeviceBuffer> *out) {
+  const auto &rbd = host_batch_desc_[i];
+  auto type = host_batch_memtype_[i];
+  auto mode = ResolveUploadMode(rbd, type);
+  auto burst = BurstBytes(*host_batches_[i]->schema());
+  if (mode == UploadMode::PACKED) {
+    return EnablePacked(rbd, type, burst, first, out);
+  }
+  bool chunked = mode == UploadMode::CHUNKED;
+  // Copies issued by the runtime itself respect the transfer limit of the platform.
+  size_t max_transfer = chunked ? chunk_size() : capabilities_.max_transfer_size;
+  for (const auto &f : rbd.fields) {
+    for (const auto &b : f.buffers) {
+      fletcher::Status status;
+      DeviceBuffer device_buf(b.raw_buffer_, b.size_, type, rbd.mode);
+      size_t pos = first + out->size();
+      bool reuse = (pos < retained_buffers_.size()) && CanReuse(retained_buffers_[pos], device_buf);
+      if (!reuse && (pos < retained_buffers_.size())) {
+        // Free a retained allocation that is not reused before allocating anew, to limit peak device memory usage.
+        FreeDeviceBuffer(retained_buffers_[pos]);
+        retained_buffers_[pos].was_alloced = false;
+      }
+      // The device may access the buffer through a realigned copy.
+      const uint8_t *source = device_buf.host_address;
+      if (realign_ && (type == MemType::ANY) && NeedsRealignment(device_buf, burst, !chunked)) {
+        status = Realign(&device_buf, burst, &source);
+        if (!status.ok()) {
+          return status;
+        }
+      }
+      Timer t;
+      t.start();
+      if ((type == MemType::ANY)
+          && platform_->TranslateHostAddress(source, device_buf.size, &device_buf.device_address)) {
+        // The buffer lives in device-visible host memory, e.g. from a DeviceVisibleMemoryPool. No copy is required.
+        device_buf.zero_copy = true;
+        status = Status::OK();
+      } else if (reuse) {
+        // Reuse the allocation of a previous buffer at the same position.
+        auto &retained = retained_buffers_[pos];
+        device_buf.device_address = retained.device_address;
+        device_buf.capacity = retained.capacity;
+        device_buf.was_alloced = true;
+        device_buf.pool = retained.pool;
+        retained.was_alloced = false;
+        status = Upload(source, device_buf.device_address, device_buf.size, max_transfer);
+      } else if ((type == MemType::ANY) && !chunked) {
+        status = platform_->PrepareHostBuffer(source,
                                               &device_buf.device_address,
-                                              device_buf.size);
-          // Cache always allocates on device.
+                                              device_buf.size,
+                                              &device_buf.was_alloced);
+      } else if ((type == MemType::CACHE) && (cache_ != nullptr)) {
+        status = cache_->Acquire(device_buf.host_address, device_buf.size, &device_buf.device_address);
+        device_buf.was_alloced = status.ok();
+        device_buf.cache = cache_;
+      } else if ((type == MemType::CACHE) && (pool_ != nullptr)) {
+        status = pool_->Allocate(&device_buf.device_address, device_buf.size);
+        if (status.ok()) {
           device_buf.was_alloced = true;
-        } else {
-          status = Status::ERROR("Invalid / unsupported MemType.");
+          device_buf.pool = pool_;
+          status = Upload(device_buf.host_address, device_buf.device_address, device_buf.size, max_transfer);
         }
-        if (!status.ok()) {
-          return status;
+      } else if (chunked) {
+        // Allocate separately from copying, such that the copy can be split.
+        status = platform_->DeviceMalloc(&device_buf.device_address, device_buf.size);
+        if (status.ok()) {
+          device_buf.was_alloced = true;
+          status = Upload(source, device_buf.device_address, device_buf.size, max_transfer);
         }
-        device_buffers_.push_back(device_buf);
+      } else if (type == MemType::CACHE) {
+        status = platform_->CacheHostBuffer(device_buf.host_address,
+                                            &device_buf.device_address,
+                                            device_buf.size);
+        // Cache always allocates on device, unless it fails.
+        device_buf.was_alloced = status.ok();
+      } else {
+        status = Status::ERROR("Invalid / unsupported MemType.");
+      }
+      if (device_buf.was_alloced && (device_buf.capacity == 0)) {
+        device_buf.capacity = device_buf.size;
       }
+      if (!status.ok()) {
+        // The buffer is not part of out yet, so free an allocation that was obtained before the copy failed.
+        FreeDeviceBuffer(device_buf);
+        return status;
+      }
+      // Device copies obtained from a cache or accessed in place were not copied by this call.
+      if ((numa_ != nullptr) && !device_buf.zero_copy && (device_buf.cache == nullptr)
+          && ((type == MemType::CACHE) || device_buf.was_alloced)) {
+        t.stop();
+        numa_->RecordCopy(source, static_cast<uint64_t>(device_buf.size), t.seconds());
+      }
+      out->push_back(device_buf);
     }
   }
+  return Status::OK();
+}
 
-  FLETCHER_LOG(DEBUG, "Context contains " << device_buffers_.size() << " device buffer(s).");
+UploadMode Context::ResolveUploadMode(const RecordBatchDescription &rbd, MemType type) const {
+  // Device copies of a DeviceBufferCache are acquired one by one.
+  if ((type == MemType::CACHE) && (cache_ != nullptr)) {
+    return UploadMode::PER_BUFFER;
+  }
+  if (upload_mode_ == UploadMode::PACKED) {
+    return type == MemType::CACHE ? UploadMode::PACKED : UploadMode::PER_BUFFER;
+  }
+  if (upload_mode_ != UploadMode::AUTO) {
+    return upload_mode_;
+  }
+  // Without capabilities, nothing is known about the costs of transfers.
+  if (capabilities_.size == 0) {
+    return UploadMode::PER_BUFFER;
+  }
+  // Let the platform prepare buffers that the device may access in place.
+  if ((type == MemType::ANY)
+      && ((capabilities_.flags & FLETCHER_CAP_SHARED_VIRTUAL_MEMORY) || platform_->has_host_memory())) {
+    return UploadMode::PER_BUFFER;
+  }
+  uint64_t bytes = 0;
+  for (const auto &f : rbd.fields) {
+    for (const auto &b : f.buffers) {
+      bytes += b.size_;
+    }
+  }
+  if ((capabilities_.max_transfer_size != 0) && (bytes > capabilities_.max_transfer_size)) {
+    return UploadMode::CHUNKED;
+  }
+  return UploadMode::PACKED;
+}
+
+bool Context::NeedsRealignment(const DeviceBuffer &buffer, size_t burst, bool prepared_in_place) const {
+  if ((burst <= 1) || (buffer.mode != Mode::READ) || (buffer.size == 0)) {
+    return false;
+  }
+  da_t device_address = D_NULLPTR;
+  if (platform_->TranslateHostAddress(buffer.host_address, buffer.size, &device_address)) {
+    // The device reads whole bursts, so the last burst must lie within the allocation as well.
+    auto padded = (buffer.size + burst - 1) / burst * burst;
+    return (device_address % burst != 0)
+        || !platform_->TranslateHostAddress(buffer.host_address, static_cast<int64_t>(padded), &device_address);
+  }
+  // Devices with shared virtual memory access host buffers in place, but nothing is known about their padding.
+  if (prepared_in_place && (capabilities_.flags & FLETCHER_CAP_SHARED_VIRTUAL_MEMORY)) {
+    return reinterpret_cast<uintptr_t>(buffer.host_address) % burst != 0;
+  }
+  return false;
+}
+
+StagingArena *Context::arena() {
+  if (arena_ == nullptr) {
+    arena_ = std::make_shared<StagingArena>(platform_, numa_);
+  }
+  return arena_.get();
+}
+
+void Context::set_numa(std::shared_ptr<NumaPlacement> numa) {
+  numa_ = std::move(numa);
+  // Blocks that are still referenced remain valid, as they share ownership with their copies.
+  arena_.reset();
+}
+
+Status Context::Realign(DeviceBuffer *buffer, size_t burst, const uint8_t **source) {
+  auto padded = static_cast<int64_t>((buffer->size + burst - 1) / burst * burst);
+  uint8_t *copy = nullptr;
+  auto status = arena()->Allocate(&copy, &buffer->staging, padded, burst);
+  if (!status.ok()) {
+    return status;
+  }
+  std::memcpy(copy, buffer->host_address, static_cast<size_t>(buffer->size));
+  std::memset(copy + buffer->size, 0, static_cast<size_t>(padded - buffer->size));
+  *source = copy;
+  realign_stats_.buffers++;
+  realign_stats_.bytes += buffer->size;
+  FLETCHER_LOG(DEBUG, "Realigned buffer of " << buffer->size << " bytes to a " << burst << "-byte burst boundary.");
   return Status::OK();
 }
 
+RealignStats Context::realign_stats() const {
+  auto result = realign_stats_;
+  result.staging_bytes = arena_ != nullptr ? arena_->bytes_reserved() : 0;
+  return result;
+}
+
+size_t Context::chunk_size() const {
+  size_t result = chunk_size_;
+  if (result == 0) {
+    result = capabilities_.max_transfer_size != 0 ? capabilities_.max_transfer_size : kDefaultChunkSize;
+  }
+  // Every chunk but the last must start and end at an aligned address.
+  if ((capabilities_.dma_alignment > 1) && (result > capabilities_.dma_alignment)) {
+    result -= result % capabilities_.dma_alignment;
+  }
+  return result;
+}
+
+Status Context::Upload(const uint8_t *host_source, da_t device_destination, int64_t size, size_t max_transfer) {
+  auto chunk = static_cast<int64_t>(max_transfer);
+  if ((chunk == 0) || (chunk > size)) {
+    chunk = size;
+  }
+  int64_t offset = 0;
+  do {
+    auto n = std::min(chunk, size - offset);
+    auto status = platform_->CopyHostToDevice(const_cast<uint8_t *>(host_source + offset),
+                                              device_destination + offset,
+                                              n);
+    if (!status.ok()) {
+      return status;
+    }
+    offset += n;
+  } while (offset < size);
+  return Status::OK();
+}
+
+size_t Context::FirstDeviceBuffer(size_t i) const {
+  size_t first = 0;
+  for (size_t b = 0; b < i; b++) {
+    if (host_batch_enabled_[b]) {
+      first += NumBuffers(host_batch_desc_[b]);
+    }
+  }
+  return first;
+}
+
+size_t Context::NumBuffers(const RecordBatchDescription &rbd) {
+  size_t count = 0;
+  for (const auto &f : rbd.fields) {
+    count += f.buffers.size();
+  }
+  return count;
+}
+
+void Context::ReleaseBatch(size_t i) {
+  if (!host_batch_enabled_[i]) {
+    return;
+  }
+  auto first = device_buffers_.begin() + FirstDeviceBuffer(i);
+  auto last = first + NumBuffers(host_batch_desc_[i]);
+  for (auto it = first; it != last; ++it) {
+    FreeDeviceBuffer(*it);
+  }
+  device_buffers_.erase(first, last);
+  host_batch_enabled_[i] = false;
+}
+
+Status Context::EnablePacked(const RecordBatchDescription &rbd,
+                             MemType type,
+                             size_t burst,
+                             size_t first,
+                             std::vector<DeviceBuffer> *out) {
+  // Lay out all buffers at aligned offsets, temporarily storing the offset as device address.
+  std::vector<DeviceBuffer> buffers;
+  int64_t total = 0;
+  // Buffers start at burst boundaries, such that the device never reads a burst more than required.
+  auto alignment = static_cast<int64_t>(std::max<uint64_t>({packed_alignment_, capabilities_.dma_alignment, burst, 1}));
+  for (const auto &f : rbd.fields) {
+    for (const auto &b : f.buffers) {
+      DeviceBuffer device_buf(b.raw_buffer_, b.size_, type, rbd.mode);
+      total = (total + alignment - 1) / alignment * alignment;
+      device_buf.device_address = static_cast<da_t>(total);
+      total += b.size_;
+      buffers.push_back(device_buf);
+    }
+  }
+  if (buffers.empty()) {
+    return Status::OK();
+  }
+
+  // Obtain a single allocation for all buffers, reusing a retained one if it is large enough.
+  DeviceBuffer packed(nullptr, total, type, rbd.mode);
+  size_t pos = first;
+  Status status;
+  if ((pos < retained_buffers_.size()) && CanReuse(retained_buffers_[pos], packed)) {
+    auto &retained = retained_buffers_[pos];
+    packed.device_address = retained.device_address;
+    packed.capacity = retained.capacity;
+    packed.pool = retained.pool;
+    retained.was_alloced = false;
+  } else {
+    if (pos < retained_buffers_.size()) {
+      FreeDeviceBuffer(retained_buffers_[pos]);
+      retained_buffers_[pos].was_alloced = false;
+    }
+    if (pool_ != nullptr) {
+      status = pool_->Allocate(&packed.device_address, total);
+      packed.pool = pool_;
+    } else {
+      status = platform_->DeviceMalloc(&packed.device_address, total);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    packed.capacity = total;
+  }
+  packed.was_alloced = true;
+
+  // Upload all buffers at once.
+  for (auto &buf : buffers) {
+    buf.device_address += packed.device_address;
+  }
+  Timer t;
+  t.start();
+  if (platform_->has_vectored_copy()) {
+    std::vector<fcopy_t> copies;
+    auto chunk = static_cast<int64_t>(chunk_size());
+    for (const auto &buf : buffers) {
+      // Split buffers that exceed the chunk size, like Upload() does for chunked batches.
+      int64_t offset = 0;
+      do {
+        auto n = (chunk == 0) ? buf.size - offset : std::min(chunk, buf.size - offset);
+        copies.push_back({buf.host_address + offset, buf.device_address + offset, n});
+        offset += n;
+      } while (offset < buf.size);
+    }
+    status = platform_->CopyHostToDeviceV(copies.data(), copies.size());
+  } else {
+    uint8_t *staging = nullptr;
+    std::shared_ptr<uint8_t> block;
+    status = arena()->Allocate(&staging, &block, total, static_cast<size_t>(alignment));
+    if (status.ok()) {
+      for (const auto &buf : buffers) {
+        std::memcpy(staging + (buf.device_address - packed.device_address), buf.host_address, buf.size);
+      }
+      status = Upload(staging, packed.device_address, total, chunk_size());
+    }
+  }
+  if (!status.ok()) {
+    FreeDeviceBuffer(packed);
+    return status;
+  }
+  if ((numa_ != nullptr) && (total > 0)) {
+    // Attribute the duration of the upload to the buffers by their size.
+    t.stop();
+    for (const auto &buf : buffers) {
+      numa_->RecordCopy(buf.host_address, buf.size, t.seconds() * buf.size / total);
+    }
+  }
+
+  // The first buffer owns the allocation, such that it is freed exactly once.
+  buffers[0].was_alloced = true;
+  buffers[0].capacity = packed.capacity;
+  buffers[0].pool = packed.pool;
+  out->insert(out->end(), buffers.begin(), buffers.end());
+  return Status::OK();
+}
+
+void Context::Clear() {
+  // Retained buffers that were never reused are freed first.
+  for (const auto &buf : retained_buffers_) {
+    FreeDeviceBuffer(buf);
+  }
+  retained_buffers_ = std::move(device_buffers_);
+  device_buffers_.clear();
+  host_batches_.clear();
+  host_batch_desc_.clear();
+  host_batch_memtype_.clear();
+  host_batch_enabled_.clear();
+  generation_++;
+}
+
 Status Context::QueueRecordBatch(const std::shared_ptr<arrow::RecordBatch> &record_batch, MemType mem_type) {
+  TraceSpan span("Context::QueueRecordBatch", "context");
   // Sanity check the recordbatch
   if (record_batch == nullptr) {
     return Status::ERROR("RecordBatch is nullptr.");
   }
 
-  host_batches_.push_back(record_batch);
-
   // Create a description of the RecordBatch
   RecordBatchDescription rbd;
   RecordBatchAnalyzer rba(&rbd);
-  rba.Analyze(*record_batch);
+  if (!rba.Analyze(*record_batch)) {
+    return Status::ERROR("RecordBatch could not be analyzed.");
+  }
+  host_batches_.push_back(record_batch);
   host_batch_desc_.push_back(rbd);
 
   // Put the desired memory type of the RecordBatch
   host_batch_memtype_.push_back(mem_type);
+  host_batch_enabled_.push_back(false);
 
   return Status::OK();
 }
 
+Status Context::ReplaceRecordBatch(size_t i,
+                                   const std::shared_ptr<arrow::RecordBatch> &record_batch,
+                                   MemType mem_type) {
+  if (record_batch == nullptr) {
+    return Status::ERROR("RecordBatch is nullptr.");
+  }
+  if (i >= host_batches_.size()) {
+    return Status::ERROR("RecordBatch index out of bounds.");
+  }
+  RecordBatchDescription rbd;
+  RecordBatchAnalyzer rba(&rbd);
+  if (!rba.Analyze(*record_batch)) {
+    return Status::ERROR("RecordBatch could not be analyzed.");
+  }
+  // Kernels address the buffers of all RecordBatches through registers laid out for the replaced RecordBatch.
+  if (!record_batch->schema()->Equals(*host_batches_[i]->schema())
+      || (NumBuffers(rbd) != NumBuffers(host_batch_desc_[i]))) {
+    return Status::ERROR("Replacing RecordBatch must have the same schema and number of buffers.");
+  }
+  ReleaseBatch(i);
+  host_batches_[i] = record_batch;
+  host_batch_desc_[i] = rbd;
+  host_batch_memtype_[i] = mem_type;
+  generation_++;
+  return Status::OK();
+}
+
+Status Context::Remove(size_t i) {
+  if (i >= host_batches_.size()) {
+    return Status::ERROR("RecordBatch index out of bounds.");
+  }
+  ReleaseBatch(i);
+  host_batches_.erase(host_batches_.begin() + i);
+  host_batch_desc_.erase(host_batch_desc_.begin() + i);
+  host_batch_memtype_.erase(host_batch_memtype_.begin() + i);
+  host_batch_enabled_.erase(host_batch_enabled_.begin() + i);
+  generation_++;
+  return Status::OK();
+}
+
+bool Context::enabled() const {
+  return std::find(host_batch_enabled_.begin(), host_batch_enabled_.end(), false) == host_batch_enabled_.end();
+}
+
 uint64_t Context::num_buffers() const {
   uint64_t ret = 0;
   for (const auto &rbd : host_batch_desc_) {
@@ -112,6 +582,25 @@ uint64_t Context::num_buffers() const {
   return ret;
 }
 
+Status Context::GetResultRecordBatch(size_t i,
+                                     std::shared_ptr<ResultRecordBatch> *out,
+                                     int64_t num_rows,
+                                     arrow::MemoryPool *pool) {
+  if ((i >= host_batches_.size()) || !host_batch_enabled_[i]) {
+    return Status::ERROR("RecordBatch index out of bounds, or RecordBatch not enabled.");
+  }
+  const auto &rbd = host_batch_desc_[i];
+  if (num_rows < 0) {
+    num_rows = rbd.rows;
+  } else if (num_rows > rbd.rows) {
+    return Status::ERROR("Kernel cannot have produced more rows than the RecordBatch holds.");
+  }
+  auto first = device_buffers_.begin() + FirstDeviceBuffer(i);
+  std::vector<DeviceBuffer> buffers(first, first + NumBuffers(rbd));
+  *out = std::make_shared<ResultRecordBatch>(shared_from_this(), host_batches_[i], rbd, buffers, num_rows, pool);
+  return Status::OK();
+}
+
 size_t Context::GetQueueSize() const {
   size_t size = 0;
   for (const auto &desc : host_batch_desc_) {
@@ -0,0 +1,151 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/executor.h"
+
+#include <fletcher/common.h>
+#include <vector>
+#include <memory>
+#include <utility>
+
+namespace fletcher {
+
+StreamExecutor::StreamExecutor(std::shared_ptr<Platform> platform, size_t num_slots, MemType mem_type)
+    : platform_(std::move(platform)), mem_type_(mem_type), slots_(num_slots) {
+  for (auto &slot : slots_) {
+    slot.context = std::make_shared<Context>(platform_);
+    slot.kernel = std::make_shared<Kernel>(slot.context);
+  }
+}
+
+Status StreamExecutor::Make(std::shared_ptr<StreamExecutor> *out,
+                            const std::shared_ptr<Platform> &platform,
+                            size_t num_slots,
+                            MemType mem_type) {
+  if (num_slots == 0) {
+    return Status::ERROR("StreamExecutor requires at least one slot.");
+  }
+  *out = std::make_shared<StreamExecutor>(platform, num_slots, mem_type);
+  return Status::OK();
+}
+
+Status StreamExecutor::Prepare(Slot *slot, const std::shared_ptr<arrow::RecordBatch> &batch, size_t batch_index) {
+  Timer t;
+  t.start();
+  // Clearing the context retains its device buffers, so the new batch is copied into them if it fits.
+  slot->context->Clear();
+  auto status = slot->context->QueueRecordBatch(batch, mem_type_);
+  if (!status.ok()) return status;
+  status = slot->context->Enable();
+  if (!status.ok()) return status;
+  slot->batch_index = batch_index;
+  t.stop();
+  stats_.prepare_seconds += t.seconds();
+  stats_.bytes += slot->context->GetQueueSize();
+  return Status::OK();
+}
+
+Status StreamExecutor::Launch(Slot *slot) {
+  // Other slots have written their metadata since this kernel last ran, so always rewrite it.
+  auto status = slot->kernel->WriteMetaData();
+  if (!status.ok()) return status;
+  if (!arguments.empty()) {
+    status = slot->kernel->SetArguments(arguments);
+    if (!status.ok()) return status;
+  }
+  return slot->kernel->StartAsync(&slot->future);
+}
+
+Status StreamExecutor::Finish(Slot *slot, const BatchCallback &on_done) {
+  uint32_t ret0 = 0;
+  uint32_t ret1 = 0;
+  Timer t;
+  t.start();
+  auto status = slot->future.Get(&ret0, &ret1);
+  t.stop();
+  stats_.wait_seconds += t.seconds();
+  if (!status.ok()) return status;
+  stats_.batches++;
+  if (on_done) {
+    return on_done(slot->batch_index, ret0, ret1);
+  }
+  return Status::OK();
+}
+
+Status StreamExecutor::Run(const RecordBatchSource &source, const BatchCallback &on_done) {
+  stats_ = StreamStats();
+  Timer total;
+  total.start();
+
+  Status status;
+  std::shared_ptr<arrow::RecordBatch> batch;
+  // The slot of which the kernel is currently running, if any.
+  Slot *in_flight = nullptr;
+  size_t batch_index = 0;
+  size_t next_slot = 0;
+
+  while (true) {
+    status = source(&batch);
+    if (!status.ok() || (batch == nullptr)) break;
+
+    Slot *slot = &slots_[next_slot];
+    next_slot = (next_slot + 1) % slots_.size();
+    // With a single slot, there is nothing to overlap with.
+    if (slot == in_flight) {
+      status = Finish(in_flight, on_done);
+      in_flight = nullptr;
+      if (!status.ok()) break;
+    }
+
+    // Prepare the next batch while the kernel is processing the previous one.
+    status = Prepare(slot, batch, batch_index);
+    if (!status.ok()) break;
+    batch_index++;
+
+    if (in_flight != nullptr) {
+      status = Finish(in_flight, on_done);
+      in_flight = nullptr;
+      if (!status.ok()) break;
+    }
+
+    status = Launch(slot);
+    if (!status.ok()) break;
+    in_flight = slot;
+  }
+
+  // Always drain the pipeline, such that no kernel is left running.
+  if (in_flight != nullptr) {
+    auto finish_status = Finish(in_flight, on_done);
+    if (status.ok()) {
+      status = finish_status;
+    }
+  }
+
+  total.stop();
+  stats_.total_seconds = total.seconds();
+  FLETCHER_LOG(DEBUG, "StreamExecutor processed " << stats_.batches << " RecordBatch(es) in "
+                                                  << stats_.total_seconds << " s.");
+  return status;
+}
+
+Status StreamExecutor::Run(const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches,
+                           const BatchCallback &on_done) {
+  size_t i = 0;
+  return Run([&batches, &i](std::shared_ptr<arrow::RecordBatch> *out) -> Status {
+    *out = (i < batches.size()) ? batches[i++] : nullptr;
+    return Status::OK();
+  }, on_done);
+}
+
+}  // namespace fletcher
@@ -0,0 +1,258 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/future.h"
+
+#include <fletcher/common.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <memory>
+
+#include "fletcher/kernel.h"
+
+namespace fletcher {
+
+/**
+ * Maximum time the completion thread blocks on completion events at once. This bounds the latency of launches submitted
+ * on other platforms in the mean time, and of stopping the queue.
+ */
+static constexpr uint64_t kCompletionQueueWaitUsec = 1000;
+
+bool KernelFuture::ready() const {
+  if (state_ == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(state_->queue->mutex_);
+  return state_->done;
+}
+
+Status KernelFuture::Wait() const {
+  if (state_ == nullptr) {
+    return Status::ERROR("KernelFuture is invalid.");
+  }
+  state_->queue->Wait(state_);
+  return state_->status;
+}
+
+Status KernelFuture::Get(uint32_t *ret0, uint32_t *ret1) const {
+  auto status = Wait();
+  if (!status.ok()) {
+    return status;
+  }
+  *ret0 = state_->ret0;
+  if (ret1 != nullptr) {
+    *ret1 = state_->ret1;
+  }
+  return status;
+}
+
+Status WaitAll(const std::vector<KernelFuture> &futures) {
+  Status result = Status::OK();
+  // Wait for all futures, even if an earlier one has failed, such that nothing is left in flight.
+  for (const auto &f : futures) {
+    auto status = f.Wait();
+    if (result.ok() && !status.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+Status WaitAny(const std::vector<KernelFuture> &futures, size_t *index) {
+  std::vector<CompletionQueue *> queues;
+  for (const auto &f : futures) {
+    if (f.valid() && (std::find(queues.begin(), queues.end(), f.state_->queue) == queues.end())) {
+      queues.push_back(f.state_->queue);
+    }
+  }
+  if (queues.empty()) {
+    return Status::ERROR("WaitAny requires at least one valid KernelFuture.");
+  }
+  // Register with every queue, such that a launch resolved by any of them wakes this thread up.
+  AnyWaiter waiter;
+  for (auto queue : queues) {
+    std::lock_guard<std::mutex> lock(queue->mutex_);
+    queue->waiters_.push_back(&waiter);
+  }
+  bool found = false;
+  Status result;
+  while (!found) {
+    {
+      std::lock_guard<std::mutex> lock(waiter.mutex);
+      waiter.signalled = false;
+    }
+    for (size_t i = 0; (i < futures.size()) && !found; i++) {
+      const auto &state = futures[i].state_;
+      if (state == nullptr) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(state->queue->mutex_);
+      if (state->done) {
+        *index = i;
+        result = state->status;
+        found = true;
+      }
+    }
+    if (!found) {
+      std::unique_lock<std::mutex> lock(waiter.mutex);
+      waiter.cv.wait(lock, [&waiter] { return waiter.signalled; });
+    }
+  }
+  for (auto queue : queues) {
+    std::lock_guard<std::mutex> lock(queue->mutex_);
+    queue->waiters_.erase(std::find(queue->waiters_.begin(), queue->waiters_.end(), &waiter));
+  }
+  return result;
+}
+
+CompletionQueue &CompletionQueue::Default() {
+  static CompletionQueue queue;
+  return queue;
+}
+
+CompletionQueue::~CompletionQueue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+Status CompletionQueue::Submit(Kernel *kernel, KernelFuture *future) {
+  if (kernel == nullptr) {
+    return Status::ERROR("Cannot submit nullptr Kernel to CompletionQueue.");
+  }
+  auto state = std::make_shared<LaunchState>();
+  state->kernel = kernel;
+  state->queue = this;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+      return Status::ERROR("CompletionQueue is stopped.");
+    }
+    pending_.push_back(state);
+    // Lazily start the completion thread.
+    if (!thread_.joinable()) {
+      thread_ = std::thread(&CompletionQueue::Run, this);
+    }
+  }
+  work_cv_.notify_one();
+  future->state_ = state;
+  return Status::OK();
+}
+
+void CompletionQueue::Wait(const std::shared_ptr<LaunchState> &state) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [&state] { return state->done; });
+}
+
+void CompletionQueue::Run() {
+  std::vector<std::shared_ptr<LaunchState>> sweep;
+  // Completion events consumed while blocking, per platform, of which the kernels were not resolved yet.
+  std::map<const Platform *, uint64_t> consumed;
+  double interval_usec = poll_interval_usec;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+    if (stop_) {
+      break;
+    }
+    // Poll all pending kernels without holding the lock, so new launches can be submitted in the mean time.
+    sweep = pending_;
+    lock.unlock();
+    std::vector<std::shared_ptr<LaunchState>> resolved;
+    // The platform to block on for completion events, if all kernels of the sweep signal completion through it.
+    Platform *event_platform = nullptr;
+    bool blocking = true;
+    for (const auto &state : sweep) {
+      auto platform = state->kernel->context()->platform();
+      bool events = state->kernel->use_completion_events && platform->has_completion_events();
+      if (!events || ((event_platform != nullptr) && (event_platform != platform.get()))) {
+        blocking = false;
+      } else {
+        event_platform = platform.get();
+      }
+      bool done = false;
+      auto status = state->kernel->IsDone(&done);
+      if (!status.ok()) {
+        state->status = status;
+        state->kernel->Release();
+        resolved.push_back(state);
+      } else if (done) {
+        if (events) {
+          // Consume the completion event of the kernel, unless it was consumed while blocking.
+          auto it = consumed.find(platform.get());
+          if (it == consumed.end()) {
+            platform->WaitForCompletion(0);
+          } else if (--it->second == 0) {
+            consumed.erase(it);
+          }
+        }
+        state->status = state->kernel->GetReturn(&state->ret0, &state->ret1);
+        resolved.push_back(state);
+      }
+    }
+    if (resolved.empty() && blocking && (event_platform != nullptr)) {
+      // Nothing finished during this sweep; block until the platform signals a completion.
+      if (event_platform->WaitForCompletion(kCompletionQueueWaitUsec).ok()) {
+        consumed[event_platform]++;
+      }
+      lock.lock();
+      interval_usec = poll_interval_usec;
+      continue;
+    }
+    lock.lock();
+    for (const auto &state : resolved) {
+      state->done = true;
+      pending_.erase(std::find(pending_.begin(), pending_.end(), state));
+    }
+    if (!resolved.empty()) {
+      NotifyDone();
+      interval_usec = poll_interval_usec;
+    } else {
+      // Nothing finished during this sweep; back off exponentially unless we are woken up by a new launch.
+      auto num_pending = pending_.size();
+      work_cv_.wait_for(lock, std::chrono::microseconds(static_cast<uint64_t>(interval_usec)));
+      if (pending_.size() > num_pending) {
+        interval_usec = poll_interval_usec;
+      } else {
+        auto max_usec = std::max(max_poll_interval_usec, poll_interval_usec);
+        interval_usec = std::min(interval_usec * 2, static_cast<double>(max_usec));
+      }
+    }
+  }
+  // Fail whatever is still in flight, so nobody waits forever.
+  for (const auto &state : pending_) {
+    state->status = Status::ERROR("CompletionQueue stopped before kernel completion.");
+    state->done = true;
+  }
+  pending_.clear();
+  NotifyDone();
+}
+
+void CompletionQueue::NotifyDone() {
+  done_cv_.notify_all();
+  for (auto waiter : waiters_) {
+    std::lock_guard<std::mutex> lock(waiter->mutex);
+    waiter->signalled = true;
+    waiter->cv.notify_all();
+  }
+}
+
+}  // namespace fletcher
@@ -14,14 +14,81 @@
 
 #include "fletcher/kernel.h"
 
-#include <unistd.h>
+#include <fletcher/common.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "fletcher/context.h"
 
 namespace fletcher {
 
-Kernel::Kernel(std::shared_ptr<Context> context) : context_(std::move(context)) {}
+/**
+ * Maximum time to block in a single platformWaitForCompletion call. This bounds the latency of a kernel whose
+ * completion event was consumed by a thread waiting for another instance.
+ */
+static constexpr uint64_t kCompletionEventWaitUsec = 10000;
+
+PollStrategy PollStrategy::Spin(uint64_t timeout_usec) {
+  PollStrategy result;
+  result.spin_polls = UINT64_MAX;
+  result.timeout_usec = timeout_usec;
+  return result;
+}
+
+PollStrategy PollStrategy::Interval(unsigned int interval_usec, uint64_t timeout_usec) {
+  PollStrategy result;
+  result.spin_polls = 0;
+  result.yield_polls = 0;
+  result.min_sleep_usec = interval_usec;
+  result.max_sleep_usec = interval_usec;
+  result.backoff = 1.0;
+  result.timeout_usec = timeout_usec;
+  return result;
+}
+
+/// The identifier of the next Kernel to be constructed. Zero is not used by any Kernel.
+static std::atomic<uint64_t> next_kernel_id{1};
+
+Kernel::Kernel(std::shared_ptr<Context> context) : context_(std::move(context)), id_(next_kernel_id++) {}
+
+Kernel::~Kernel() {
+  // The completion thread may still be polling this kernel.
+  if (launch_.valid()) {
+    launch_.Wait();
+  }
+  Release();
+}
+
+void Kernel::Reserve() {
+  if (!reserved_) {
+    auto platform = context_->platform();
+    if (!platform->ReserveKernel(mmio_base, id_)) {
+      registers_stale_ = true;
+    }
+    reserved_ = true;
+    // The default registers of a kernel at a non-zero base lie among the schema-derived registers of the platform.
+    if (mmio_base != 0) {
+      for (uint64_t offset = FLETCHER_REG_CONTROL; offset < FLETCHER_REG_SCHEMA; offset++) {
+        platform->ExcludeFromShadow(mmio_base + offset);
+      }
+    }
+  }
+}
+
+void Kernel::Release() {
+  if (reserved_.exchange(false)) {
+    context_->platform()->ReleaseKernel(mmio_base);
+  }
+}
+
+void Kernel::ReleaseUnlessHeld(bool held) {
+  if (!held) {
+    Release();
+  }
+}
 
 bool Kernel::ImplementsSchemaSet(const std::vector<std::shared_ptr<arrow::Schema>> &schema_set) {
   // TODO(johanpel): Implement checking if the kernel implements the same Schema, probably through some checksum
@@ -32,12 +99,43 @@ bool Kernel::ImplementsSchemaSet(const std::vector<std::shared_ptr<arrow::Schema
 }
 
 Status Kernel::Reset() {
-  auto status = context_->platform()->WriteMMIO(FLETCHER_REG_CONTROL, ctrl_reset);
+  Reserve();
+  auto status = ResetHardware();
+  returns_latched_ = false;
+  Release();
+  return status;
+}
+
+Status Kernel::ResetHardware() {
+  // Registers may not hold their values after a reset.
+  context_->platform()->InvalidateShadowRegisters();
+  auto status = context_->platform()->WriteMMIO(mmio_base + FLETCHER_REG_CONTROL, ctrl_reset);
   if (status.ok()) {
-    return context_->platform()->WriteMMIO(FLETCHER_REG_CONTROL, 0);
-  } else {
-    return status;
+    status = context_->platform()->WriteMMIO(mmio_base + FLETCHER_REG_CONTROL, 0);
   }
+  return status;
+}
+
+Status Kernel::RestoreRegisters() {
+  // Writing the metadata overwrites all ranges, so restore the ranges set afterwards.
+  auto ranges = ranges_;
+  auto status = WriteMetaData();
+  if (!status.ok()) return status;
+  std::vector<fmmio_t> writes;
+  for (const auto &range : ranges) {
+    uint64_t offset = mmio_base + FLETCHER_REG_SCHEMA + 2 * range.first;
+    writes.push_back({offset, static_cast<uint32_t>(range.second.first)});
+    writes.push_back({offset + 1, static_cast<uint32_t>(range.second.second)});
+  }
+  status = context_->platform()->WriteMMIOBatch(writes);
+  if (!status.ok()) return status;
+  ranges_ = ranges;
+  if (!arguments_.empty()) {
+    status = SetArguments(arguments_);
+    if (!status.ok()) return status;
+  }
+  registers_stale_ = false;
+  return Status::OK();
 }
 
 Status Kernel::SetRange(size_t recordbatch_index, int32_t first, int32_t last) {
@@ -46,76 +144,277 @@ Status Kernel::SetRange(size_t recordbatch_index, int32_t first, int32_t last) {
     return Status::ERROR();
   }
 
-  Status ret;
-  if (!context_->platform()->WriteMMIO(FLETCHER_REG_SCHEMA + 2 * recordbatch_index,
-                                       static_cast<uint32_t>(first)).ok()) {
-    ret = Status::ERROR();
+  if (recordbatch_index < context_->num_recordbatches()) {
+    auto first_index = static_cast<int32_t>(context_->first_index(recordbatch_index));
+    first += first_index;
+    last += first_index;
   }
-  if (!context_->platform()->WriteMMIO(FLETCHER_REG_SCHEMA + 2 * recordbatch_index + 1,
-                                       static_cast<uint32_t>(last)).ok()) {
-    ret = Status::ERROR();
-  }
-  return Status::OK();
+
+  bool held = reserved_;
+  Reserve();
+  uint64_t offset = mmio_base + FLETCHER_REG_SCHEMA + 2 * recordbatch_index;
+  std::vector<fmmio_t> writes = {{offset, static_cast<uint32_t>(first)}, {offset + 1, static_cast<uint32_t>(last)}};
+  ranges_[recordbatch_index] = {first, last};
+  auto status = context_->platform()->WriteMMIOBatch(writes);
+  ReleaseUnlessHeld(held);
+  return status;
 }
 
 Status Kernel::SetArguments(const std::vector<uint32_t> &arguments) {
-  for (int i = 0; (size_t) i < arguments.size(); i++) {
-    context_->platform()->WriteMMIO(
-        FLETCHER_REG_SCHEMA + 2 * context_->num_recordbatches() + 2 * context_->num_buffers() + i, arguments[i]);
+  bool held = reserved_;
+  Reserve();
+  uint64_t offset = mmio_base + FLETCHER_REG_SCHEMA + 2 * context_->num_recordbatches() + 2 * context_->num_buffers();
+  std::vector<fmmio_t> writes;
+  writes.reserve(arguments.size());
+  for (size_t i = 0; i < arguments.size(); i++) {
+    writes.push_back({offset + i, arguments[i]});
   }
-
-  return Status::OK();
+  arguments_ = arguments;
+  auto status = context_->platform()->WriteMMIOBatch(writes);
+  ReleaseUnlessHeld(held);
+  return status;
 }
 
 Status Kernel::Start() {
-  Status status;
-  if (!metadata_written) {
-    WriteMetaData();
+  TraceSpan span("Kernel::Start", "kernel");
+  auto status = Status::OK();
+  if (!context_->enabled()) {
+    return Status::ERROR("Cannot start kernel while RecordBatches are queued but not enabled.");
+  }
+  // Hold the reservation until the run is observed done.
+  Reserve();
+  returns_latched_ = false;
+  if (registers_stale_) {
+    // Another kernel programmed the hardware since this kernel did.
+    status = RestoreRegisters();
+  } else if (!metadata_written || (metadata_generation_ != context_->generation())) {
+    status = WriteMetaData();
+  }
+  if (status.ok()) {
+    FLETCHER_LOG(DEBUG, "Starting kernel.");
+    status = context_->platform()->WriteMMIO(mmio_base + FLETCHER_REG_CONTROL, ctrl_start);
+  }
+  if (status.ok()) {
+    status = context_->platform()->WriteMMIO(mmio_base + FLETCHER_REG_CONTROL, 0);
+  }
+  if (!status.ok()) {
+    Release();
+  }
+  return status;
+}
+
+Status Kernel::StartAsync(KernelFuture *future, CompletionQueue *queue) {
+  // Only one launch of this kernel can be in flight.
+  if (launch_.valid() && !launch_.ready()) {
+    return Status::ERROR("Kernel is already running asynchronously.");
+  }
+  auto status = Start();
+  if (!status.ok()) {
+    return status;
   }
-  FLETCHER_LOG(DEBUG, "Starting kernel.");
-  status = context_->platform()->WriteMMIO(FLETCHER_REG_CONTROL, ctrl_start);
-  if (!status.ok())
+  status = queue->Submit(this, &launch_);
+  if (!status.ok()) {
     return status;
-  return context_->platform()->WriteMMIO(FLETCHER_REG_CONTROL, 0);
+  }
+  *future = launch_;
+  return Status::OK();
+}
+
+Status Kernel::Run() {
+  if (watchdog.deadline_usec == 0) {
+    auto status = Start();
+    if (!status.ok()) return status;
+    watchdog_stats_.launches++;
+    return PollUntilDone();
+  }
+
+  auto strategy = poll_strategy;
+  strategy.timeout_usec = watchdog.deadline_usec;
+  unsigned int attempt = 0;
+  while (true) {
+    auto status = Start();
+    if (!status.ok()) return status;
+    watchdog_stats_.launches++;
+    status = PollUntilDone(strategy);
+    if (!(status == Status::TIMEOUT())) {
+      return status;
+    }
+    watchdog_stats_.timeouts++;
+    FLETCHER_LOG(WARNING, "Kernel missed its deadline of " << watchdog.deadline_usec << " us, resetting.");
+    status = ResetHardware();
+    if (!status.ok()) {
+      Release();
+      return status;
+    }
+    watchdog_stats_.resets++;
+    if (attempt == watchdog.max_retries) {
+      break;
+    }
+    attempt++;
+    if (watchdog.rewrite_metadata) {
+      status = RestoreRegisters();
+      if (!status.ok()) {
+        Release();
+        return status;
+      }
+    }
+    watchdog_stats_.retries++;
+  }
+  watchdog_stats_.failures++;
+  Release();
+  FLETCHER_LOG(WARNING, "Kernel did not finish within " << attempt + 1 << " attempt(s).");
+  return Status::TIMEOUT();
 }
 
 Status Kernel::GetStatus(uint32_t *status_out) {
-  return context_->platform()->ReadMMIO(FLETCHER_REG_STATUS, status_out);
+  return context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_STATUS, status_out);
+}
+
+Status Kernel::IsDone(bool *done) {
+  uint32_t status = 0;
+  auto result = context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_STATUS, &status);
+  *done = result.ok() && ((status & done_status_mask) == done_status);
+  if (*done && reserved_) {
+    // Latch the return registers, such that another kernel may use the hardware as soon as this run is observed done.
+    result = context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_RETURN0, &ret0_);
+    if (result.ok()) {
+      result = context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_RETURN1, &ret1_);
+    }
+    returns_latched_ = result.ok();
+    *done = result.ok();
+    Release();
+  }
+  return result;
 }
 
 Status Kernel::GetReturn(uint32_t *ret0, uint32_t *ret1) {
+  TraceSpan span("Kernel::GetReturn", "kernel");
+  if (returns_latched_ && !reserved_) {
+    *ret0 = ret0_;
+    if (ret1 != nullptr) {
+      *ret1 = ret1_;
+    }
+    return Status::OK();
+  }
   Status status;
-  status = context_->platform()->ReadMMIO(FLETCHER_REG_RETURN0, ret0);
-  if ((ret1 == nullptr) || (!status.ok())) {
-    return status;
+  status = context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_RETURN0, ret0);
+  if ((ret1 != nullptr) && status.ok()) {
+    status = context_->platform()->ReadMMIO(mmio_base + FLETCHER_REG_RETURN1, ret1);
   }
-  status = context_->platform()->ReadMMIO(FLETCHER_REG_RETURN1, ret1);
+  // Another kernel may use the hardware now.
+  Release();
   return status;
 }
 
 Status Kernel::PollUntilDone() {
-  return PollUntilDoneInterval(0);
+  if (poll_strategy.timeout_usec == 0) {
+    auto strategy = poll_strategy;
+    strategy.timeout_usec = watchdog.deadline_usec;
+    return PollUntilDone(strategy);
+  }
+  return PollUntilDone(poll_strategy);
 }
 
 Status Kernel::PollUntilDoneInterval(unsigned int poll_interval_usec) {
-  bool done = false;
-  uint32_t status = 0;
-  FLETCHER_LOG(DEBUG, "Polling kernel for completion.");
   if (poll_interval_usec == 0) {
-    while (!done) {
-      context_->platform()->ReadMMIO(FLETCHER_REG_STATUS, &status);
-      done = (status & done_status_mask) == this->done_status;
+    return PollUntilDone(PollStrategy::Spin());
+  }
+  return PollUntilDone(PollStrategy::Interval(poll_interval_usec));
+}
+
+Status Kernel::PollUntilDone(const PollStrategy &strategy) {
+  if (use_completion_events && context_->platform()->has_completion_events()) {
+    return WaitForCompletionEvent(strategy.timeout_usec);
+  }
+
+  TraceSpan span("Kernel::PollUntilDone", "kernel");
+  // Poll from a core close to the device.
+  NumaPinScope pin(context_->numa().get());
+  FLETCHER_LOG(DEBUG, "Polling kernel for completion.");
+  poll_stats_ = PollStats();
+  Timer t;
+  t.start();
+  auto deadline = t.start_ + std::chrono::microseconds(strategy.timeout_usec);
+  double sleep_usec = strategy.min_sleep_usec;
+  bool done = false;
+  Status status;
+
+  while (true) {
+    status = IsDone(&done);
+    poll_stats_.polls++;
+    if (!status.ok() || done) {
+      break;
+    }
+    if ((strategy.timeout_usec != 0) && (Timer::system_clock::now() >= deadline)) {
+      poll_stats_.timed_out = true;
+      status = Status::TIMEOUT();
+      break;
     }
-  } else {
-    while (!done) {
-      context_->platform()->ReadMMIO(FLETCHER_REG_STATUS, &status);
-      done = (status & done_status_mask) == this->done_status;
-      if (done) break;
-      usleep(poll_interval_usec);
+    // Back off according to the phase the strategy is in.
+    if (poll_stats_.polls <= strategy.spin_polls) {
+      continue;
+    } else if (poll_stats_.polls <= strategy.spin_polls + strategy.yield_polls) {
+      std::this_thread::yield();
+      poll_stats_.yields++;
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(static_cast<uint64_t>(sleep_usec)));
+      poll_stats_.sleeps++;
+      sleep_usec = std::min(sleep_usec * strategy.backoff, static_cast<double>(strategy.max_sleep_usec));
     }
   }
-  FLETCHER_LOG(DEBUG, "Kernel status done bit asserted.");
-  return Status::OK();
+
+  t.stop();
+  poll_stats_.seconds = t.seconds();
+  if (done) {
+    FLETCHER_LOG(DEBUG, "Kernel status done bit asserted after " << poll_stats_.polls << " poll(s).");
+  }
+  return status;
+}
+
+Status Kernel::WaitForCompletionEvent(uint64_t timeout_usec) {
+  TraceSpan span("Kernel::WaitForCompletionEvent", "kernel");
+  NumaPinScope pin(context_->numa().get());
+  Status status;
+  FLETCHER_LOG(DEBUG, "Waiting for kernel completion event.");
+  poll_stats_ = PollStats();
+  Timer t;
+  t.start();
+  // Wait in slices, such that a platform can never block the host forever on a single call. The event may belong to
+  // another kernel instance, so only the status register of this instance decides whether it is done.
+  bool done = false;
+  bool consumed = false;
+  while (true) {
+    status = IsDone(&done);
+    poll_stats_.polls++;
+    if (!status.ok() || done) {
+      break;
+    }
+    uint64_t wait_usec = kCompletionEventWaitUsec;
+    if (timeout_usec != 0) {
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Timer::system_clock::now() - t.start_);
+      if (static_cast<uint64_t>(elapsed.count()) >= timeout_usec) {
+        poll_stats_.timed_out = true;
+        status = Status::TIMEOUT();
+        break;
+      }
+      wait_usec = std::min(wait_usec, timeout_usec - static_cast<uint64_t>(elapsed.count()));
+    }
+    status = context_->platform()->WaitForCompletion(wait_usec);
+    consumed = status.ok();
+    if (!consumed && !(status == Status::TIMEOUT())) {
+      break;
+    }
+  }
+  if (done && !consumed) {
+    // Consume the event of a kernel that was done before it was waited for, such that no stale events pile up.
+    context_->platform()->WaitForCompletion(0);
+  }
+  t.stop();
+  poll_stats_.seconds = t.seconds();
+  if (done) {
+    FLETCHER_LOG(DEBUG, "Kernel status done bit asserted after " << poll_stats_.polls << " completion wait(s).");
+  }
+  return status;
 }
 
 std::shared_ptr<Context> Kernel::context() {
@@ -123,42 +422,63 @@ std::shared_ptr<Context> Kernel::context() {
 }
 
 Status Kernel::WriteMetaData() {
-  Status status;
+  TraceSpan span("Kernel::WriteMetaData", "kernel");
   FLETCHER_LOG(DEBUG, "Writing context metadata to kernel.");
 
+  // Device buffers only exist for enabled RecordBatches.
+  if (!context_->enabled()) {
+    return Status::ERROR("Cannot write metadata while RecordBatches are queued but not enabled.");
+  }
+  bool held = reserved_;
+  Reserve();
+
   // Set the starting offset to the first schema-derived register index.
-  uint64_t offset = FLETCHER_REG_SCHEMA;
+  uint64_t offset = mmio_base + FLETCHER_REG_SCHEMA;
 
-  // Get the platform pointer.
-  auto platform = context_->platform();
+  // Collect all register writes, such that the platform can issue them at once.
+  std::vector<fmmio_t> writes;
+  writes.reserve(2 * (context_->num_recordbatches() + context_->num_buffers()));
 
-  // Write RecordBatch ranges.
+  // RecordBatch ranges.
   for (size_t i = 0; i < context_->num_recordbatches(); i++) {
     auto rb = context_->recordbatch(i);
-    status = platform->WriteMMIO(offset, 0);               // First index
-    if (!status.ok()) return status;
-    offset++;
-    status = platform->WriteMMIO(offset, rb->num_rows());  // Last index (exclusive)
-    if (!status.ok()) return status;
-    offset++;
+    auto first = static_cast<uint32_t>(context_->first_index(i));
+    writes.push_back({offset++, first});                                          // First index
+    writes.push_back({offset++, first + static_cast<uint32_t>(rb->num_rows())});  // Last index (exclusive)
   }
 
-  // Write buffer addresses
+  // Buffer addresses
   for (size_t i = 0; i < context_->num_buffers(); i++) {
-    // Get the device address
-    auto device_buf = context_->device_buffer(i);
     dau_t address;
-    address.full = device_buf.device_address;
-    // Write the address
-    platform->WriteMMIO(offset, address.lo);
-    if (!status.ok()) return status;
-    offset++;
-    platform->WriteMMIO(offset, address.hi);
-    if (!status.ok()) return status;
-    offset++;
+    address.full = context_->device_buffer(i).device_address;
+    writes.push_back({offset++, address.lo});
+    writes.push_back({offset++, address.hi});
+  }
+
+  auto status = context_->platform()->WriteMMIOBatch(writes);
+  ReleaseUnlessHeld(held);
+  if (!status.ok()) return status;
+  ranges_.clear();
+  // Only the arguments of this kernel may still be overwritten by another kernel.
+  if (arguments_.empty()) {
+    registers_stale_ = false;
   }
   metadata_written = true;
+  metadata_generation_ = context_->generation();
   return Status::OK();
 }
 
+Status Kernel::Rebind(std::shared_ptr<Context> context) {
+  if (launch_.valid() && !launch_.ready()) {
+    return Status::ERROR("Cannot rebind a Kernel that is running asynchronously.");
+  }
+  if (context == nullptr) {
+    return Status::ERROR("Context is nullptr.");
+  }
+  // The new context may live on another platform.
+  Release();
+  context_ = std::move(context);
+  return WriteMetaData();
+}
+
 }
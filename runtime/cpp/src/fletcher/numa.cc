@@ -0,0 +1,232 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/numa.h"
+
+#include <fletcher/common.h>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <new>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace fletcher {
+
+/// The size of a hugepage on the platforms Fletcher supports.
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+/// The mbind mode that allocates pages on a preferred node, falling back to other nodes if it is full.
+static constexpr int kMpolPreferred = 1;
+
+/// @brief Parse a list of cores in the format of sysfs, e.g. "0-7,16-23".
+static std::vector<int> ParseCpuList(const std::string &list) {
+  std::vector<int> result;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    auto dash = range.find('-');
+    auto first = std::atoi(range.substr(0, dash).c_str());
+    auto last = dash == std::string::npos ? first : std::atoi(range.substr(dash + 1).c_str());
+    for (int cpu = first; cpu <= last; cpu++) {
+      result.push_back(cpu);
+    }
+  }
+  return result;
+}
+
+NumaPlacement::NumaPlacement(int node, bool hugepages, bool pin_threads)
+    : node_(node), hugepages_(hugepages), pin_threads_(pin_threads) {
+  if (node_ != kUnknownNode) {
+    std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node_) + "/cpulist");
+    std::string list;
+    if (std::getline(cpulist, list)) {
+      cpus_ = ParseCpuList(list);
+    }
+  }
+}
+
+Status NumaPlacement::Make(std::shared_ptr<NumaPlacement> *out,
+                           const std::shared_ptr<Platform> &platform,
+                           int node,
+                           bool hugepages,
+                           bool pin_threads) {
+  if (node == kUnknownNode) {
+    const char *env = std::getenv(FLETCHER_NUMA_NODE_ENV);
+    if ((env != nullptr) && (*env != '\0')) {
+      node = std::atoi(env);
+    }
+  }
+  if (node == kUnknownNode) {
+    fcaps_t caps;
+    auto status = platform->GetCapabilities(&caps);
+    if (!status.ok()) {
+      return status;
+    }
+    for (int n = 0; n < 64; n++) {
+      if (caps.numa_node_mask & (1ull << static_cast<uint64_t>(n))) {
+        node = n;
+        break;
+      }
+    }
+  }
+  if (node < kUnknownNode) {
+    return Status::ERROR("Invalid NUMA node " + std::to_string(node) + ".");
+  }
+  *out = std::make_shared<NumaPlacement>(node, hugepages, pin_threads);
+  if (node == kUnknownNode) {
+    FLETCHER_LOG(DEBUG, "NUMA node of the device is unknown.");
+  } else {
+    FLETCHER_LOG(DEBUG, "Device is attached to NUMA node " << node << " with " << (*out)->cpus().size() << " core(s).");
+  }
+  return Status::OK();
+}
+
+size_t NumaPlacement::AllocationSize(size_t size) const {
+  size_t granularity = 4096;
+#ifdef __linux__
+  granularity = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+  if (hugepages_) {
+    granularity = kHugePageSize;
+  }
+  size = size == 0 ? 1 : size;
+  return (size + granularity - 1) / granularity * granularity;
+}
+
+Status NumaPlacement::Allocate(uint8_t **out, size_t size) {
+  auto bytes = AllocationSize(size);
+#ifdef __linux__
+  void *address = MAP_FAILED;
+  if (hugepages_) {
+    // Explicit hugepages are only available if the system reserved them.
+    address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (address == MAP_FAILED) {
+    address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) {
+      return Status::ERROR("Could not allocate " + std::to_string(bytes) + " bytes of host memory.");
+    }
+    if (hugepages_) {
+      madvise(address, bytes, MADV_HUGEPAGE);
+    }
+  }
+  // Pages are placed on the node when they are first touched.
+  if ((node_ != kUnknownNode) && (node_ < 64)) {
+    unsigned long mask = 1ul << static_cast<unsigned long>(node_);
+    if (syscall(SYS_mbind, address, bytes, kMpolPreferred, &mask, sizeof(mask) * 8, 0) != 0) {
+      FLETCHER_LOG(DEBUG, "Could not bind host memory to NUMA node " << node_ << ".");
+    }
+  }
+  *out = static_cast<uint8_t *>(address);
+#else
+  *out = new(std::nothrow) uint8_t[bytes];
+  if (*out == nullptr) {
+    return Status::ERROR("Could not allocate " + std::to_string(bytes) + " bytes of host memory.");
+  }
+#endif
+  return Status::OK();
+}
+
+void NumaPlacement::Free(uint8_t *address, size_t size) {
+#ifdef __linux__
+  munmap(address, AllocationSize(size));
+#else
+  delete[] address;
+#endif
+}
+
+int NumaPlacement::NodeOf(const void *address) {
+#ifdef __linux__
+  auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  void *page = reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(address) / page_size * page_size);
+  int status = -1;
+  // Without target nodes, move_pages only reports the node of every page.
+  if ((syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) == 0) && (status >= 0)) {
+    return status;
+  }
+#endif
+  return kUnknownNode;
+}
+
+void NumaPlacement::RecordCopy(const void *source, uint64_t bytes, double seconds) {
+  auto node = NodeOf(source);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &stats = copy_stats_[node];
+  stats.copies++;
+  stats.bytes += bytes;
+  stats.seconds += seconds;
+}
+
+std::map<int, NumaCopyStats> NumaPlacement::copy_stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return copy_stats_;
+}
+
+NumaPinScope::NumaPinScope(const NumaPlacement *placement) {
+#ifdef __linux__
+  if ((placement == nullptr) || !placement->pin_threads()) {
+    return;
+  }
+  cpu_set_t previous;
+  CPU_ZERO(&previous);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &previous) != 0) {
+    return;
+  }
+  cpu_set_t node;
+  CPU_ZERO(&node);
+  for (auto cpu : placement->cpus()) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &node);
+    }
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node) != 0) {
+    return;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &previous)) {
+      previous_.push_back(cpu);
+    }
+  }
+  pinned_ = true;
+#endif
+}
+
+NumaPinScope::~NumaPinScope() {
+#ifdef __linux__
+  if (!pinned_) {
+    return;
+  }
+  cpu_set_t previous;
+  CPU_ZERO(&previous);
+  for (auto cpu : previous_) {
+    CPU_SET(cpu, &previous);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &previous);
+#endif
+}
+
+}  // namespace fletcher
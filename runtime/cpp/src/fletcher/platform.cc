@@ -17,6 +17,8 @@
 #include <arrow/api.h>
 #include <fletcher/common.h>
 
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <memory>
@@ -58,6 +60,44 @@ Status Platform::Make(const std::string &name, std::shared_ptr<fletcher::Platfor
   }
 }
 
+size_t Platform::num_devices() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t count = 1;
+  if ((platformGetDeviceCount == nullptr) || (platformSetDevice == nullptr)
+      || !Status(platformGetDeviceCount(&count)).ok()) {
+    return 1;
+  }
+  return count;
+}
+
+Status Platform::MakeAll(const std::string &name,
+                         std::vector<std::shared_ptr<Platform>> *platforms_out,
+                         bool quiet) {
+  platforms_out->clear();
+  std::shared_ptr<Platform> first;
+  auto status = Make(name, &first, quiet);
+  if (!status.ok()) {
+    return status;
+  }
+  auto count = first->num_devices();
+  platforms_out->push_back(first);
+  // Every instance links against the same library, but selects its own device.
+  for (size_t i = 1; i < count; i++) {
+    std::shared_ptr<Platform> platform;
+    status = Make(name, &platform, quiet);
+    if (!status.ok()) {
+      platforms_out->clear();
+      return status;
+    }
+    platform->device_ = i;
+    platforms_out->push_back(platform);
+  }
+  if (!quiet) {
+    FLETCHER_LOG(INFO, "Platform " << name << " exposes " << count << " device(s).");
+  }
+  return Status::OK();
+}
+
 Status Platform::Make(std::shared_ptr<fletcher::Platform> *platform_out, bool quiet) {
   Status status = Status::NO_PLATFORM();
   if (!quiet) {
@@ -96,6 +136,16 @@ Status Platform::Link(void *handle, bool quiet) {
     char *err = dlerror();
 
     if (err == nullptr) {
+      // Optional functions are resolved after the check above, the errors of missing ones are cleared below.
+      *reinterpret_cast<void **>((&platformWaitForCompletion)) = dlsym(handle, "platformWaitForCompletion");
+      *reinterpret_cast<void **>((&platformCopyHostToDeviceV)) = dlsym(handle, "platformCopyHostToDeviceV");
+      *reinterpret_cast<void **>((&platformWriteMMIOBatch)) = dlsym(handle, "platformWriteMMIOBatch");
+      *reinterpret_cast<void **>((&platformGetDeviceCount)) = dlsym(handle, "platformGetDeviceCount");
+      *reinterpret_cast<void **>((&platformSetDevice)) = dlsym(handle, "platformSetDevice");
+      *reinterpret_cast<void **>((&platformHostMalloc)) = dlsym(handle, "platformHostMalloc");
+      *reinterpret_cast<void **>((&platformHostFree)) = dlsym(handle, "platformHostFree");
+      *reinterpret_cast<void **>((&platformGetCapabilities)) = dlsym(handle, "platformGetCapabilities");
+      dlerror();
       return Status::OK();
     } else {
       if (!quiet) {
@@ -109,6 +159,181 @@ Status Platform::Link(void *handle, bool quiet) {
   }
 }
 
+Status Platform::HostMalloc(uint8_t **host_address, int64_t size) {
+  if (!has_host_memory()) {
+    return Status::ERROR("Platform does not support device-visible host memory.");
+  }
+  TraceSpan span("Platform::HostMalloc", "memory", size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Select();
+  da_t device_address = D_NULLPTR;
+  auto status = Status(platformHostMalloc(host_address, &device_address, size));
+  if (status.ok()) {
+    host_allocations_[*host_address] = HostAllocation{device_address, size};
+  }
+  return status;
+}
+
+Status Platform::HostFree(uint8_t *host_address) {
+  if (!has_host_memory()) {
+    return Status::ERROR("Platform does not support device-visible host memory.");
+  }
+  TraceSpan span("Platform::HostFree", "memory");
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (host_allocations_.erase(host_address) == 0) {
+    return Status::ERROR("Host address was not allocated through this platform.");
+  }
+  Select();
+  return Status(platformHostFree(host_address));
+}
+
+Status Platform::GetCapabilities(fcaps_t *out) {
+  std::memset(out, 0, sizeof(fcaps_t));
+  out->size = sizeof(fcaps_t);
+  if (platformGetCapabilities == nullptr) {
+    out->size = 0;
+    return Status::OK();
+  }
+  fcaps_t caps;
+  std::memset(&caps, 0, sizeof(fcaps_t));
+  caps.size = sizeof(fcaps_t);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Select();
+    auto status = Status(platformGetCapabilities(&caps));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  // Only use the fields the platform filled.
+  auto filled = std::min<uint64_t>(caps.size, sizeof(fcaps_t));
+  std::memcpy(out, &caps, filled);
+  out->size = filled;
+  return Status::OK();
+}
+
+bool Platform::TranslateHostAddress(const uint8_t *host_address, int64_t size, da_t *device_address) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Find the last allocation starting at or before the buffer.
+  auto it = host_allocations_.upper_bound(host_address);
+  if (it == host_allocations_.begin()) {
+    return false;
+  }
+  --it;
+  auto offset = static_cast<int64_t>(reinterpret_cast<uintptr_t>(host_address)
+      - reinterpret_cast<uintptr_t>(it->first));
+  if (offset + size > it->second.size) {
+    return false;
+  }
+  *device_address = it->second.device_address + offset;
+  return true;
+}
+
+bool Platform::IsShadowed(uint64_t offset, uint32_t value) const {
+  if (!shadow_enabled_ || (offset < FLETCHER_REG_SCHEMA) || (offset - FLETCHER_REG_SCHEMA >= shadow_.size())
+      || (unshadowed_.count(offset) != 0)) {
+    return false;
+  }
+  return shadow_[offset - FLETCHER_REG_SCHEMA] == static_cast<int64_t>(value);
+}
+
+void Platform::Shadow(uint64_t offset, uint32_t value) {
+  if (!shadow_enabled_ || (offset < FLETCHER_REG_SCHEMA) || (unshadowed_.count(offset) != 0)) {
+    return;
+  }
+  if (offset - FLETCHER_REG_SCHEMA >= shadow_.size()) {
+    shadow_.resize(offset - FLETCHER_REG_SCHEMA + 1, -1);
+  }
+  shadow_[offset - FLETCHER_REG_SCHEMA] = value;
+}
+
+void Platform::ExcludeFromShadow(uint64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  unshadowed_.insert(offset);
+  if ((offset >= FLETCHER_REG_SCHEMA) && (offset - FLETCHER_REG_SCHEMA < shadow_.size())) {
+    shadow_[offset - FLETCHER_REG_SCHEMA] = -1;
+  }
+}
+
+Status Platform::WriteMMIO(uint64_t offset, uint32_t value) {
+  TraceSpan span("Platform::WriteMMIO", "mmio", 0, offset);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (IsShadowed(offset, value)) {
+    span.set_count(0);
+    mmio_stats_.writes_elided++;
+    return Status::OK();
+  }
+  Select();
+  auto status = Status(platformWriteMMIO(offset, value));
+  mmio_stats_.writes_issued++;
+  if (status.ok()) {
+    Shadow(offset, value);
+  } else {
+    // The register may or may not hold the new value.
+    shadow_.clear();
+  }
+  return status;
+}
+
+Status Platform::WriteMMIOBatch(const fmmio_t *writes, size_t count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Drop writes of values the registers already hold.
+  std::vector<fmmio_t> issued;
+  issued.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    if (IsShadowed(writes[i].offset, writes[i].value)) {
+      mmio_stats_.writes_elided++;
+    } else {
+      issued.push_back(writes[i]);
+    }
+  }
+  TraceSpan span("Platform::WriteMMIOBatch", "mmio", 0, count > 0 ? writes[0].offset : 0, issued.size());
+  if (issued.empty()) {
+    return Status::OK();
+  }
+  Select();
+  if (platformWriteMMIOBatch == nullptr) {
+    for (const auto &w : issued) {
+      auto status = Status(platformWriteMMIO(w.offset, w.value));
+      mmio_stats_.writes_issued++;
+      if (!status.ok()) {
+        shadow_.clear();
+        return status;
+      }
+      Shadow(w.offset, w.value);
+    }
+    return Status::OK();
+  }
+  auto status = Status(platformWriteMMIOBatch(issued.data(), issued.size()));
+  mmio_stats_.writes_issued += issued.size();
+  if (!status.ok()) {
+    shadow_.clear();
+    return status;
+  }
+  for (const auto &w : issued) {
+    Shadow(w.offset, w.value);
+  }
+  return Status::OK();
+}
+
+bool Platform::ReserveKernel(uint64_t mmio_base, uint64_t owner) {
+  std::unique_lock<std::mutex> lock(reservation_mutex_);
+  reservation_cv_.wait(lock, [this, mmio_base]() { return reserved_kernels_.count(mmio_base) == 0; });
+  reserved_kernels_.insert(mmio_base);
+  auto it = kernel_owners_.find(mmio_base);
+  bool same = (it == kernel_owners_.end()) || (it->second == owner);
+  kernel_owners_[mmio_base] = owner;
+  return same;
+}
+
+void Platform::ReleaseKernel(uint64_t mmio_base) {
+  {
+    std::lock_guard<std::mutex> lock(reservation_mutex_);
+    reserved_kernels_.erase(mmio_base);
+  }
+  reservation_cv_.notify_all();
+}
+
 Status Platform::ReadMMIO64(uint64_t offset, uint64_t *value) {
   freg_t hi, lo;
   Status stat;
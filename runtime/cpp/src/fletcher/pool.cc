@@ -0,0 +1,362 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/pool.h"
+
+#include <fletcher/common.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+#include <memory>
+
+namespace fletcher {
+
+DeviceMemoryPool::DeviceMemoryPool(std::shared_ptr<Platform> platform, size_t region_size, size_t min_block_size)
+    : platform_(std::move(platform)), min_block_size_(min_block_size) {
+  while (BlockSize(max_order_) < region_size) {
+    max_order_++;
+  }
+}
+
+DeviceMemoryPool::~DeviceMemoryPool() {
+  for (const auto &a : allocations_) {
+    if (a.second.region < 0) {
+      platform_->DeviceFree(a.first);
+    }
+  }
+  for (const auto &r : regions_) {
+    if (r.base != D_NULLPTR) {
+      platform_->DeviceFree(r.base);
+    }
+  }
+}
+
+Status DeviceMemoryPool::Make(std::shared_ptr<DeviceMemoryPool> *out,
+                              const std::shared_ptr<Platform> &platform,
+                              size_t region_size,
+                              size_t min_block_size) {
+  if ((min_block_size == 0) || ((min_block_size & (min_block_size - 1)) != 0)) {
+    return Status::ERROR("DeviceMemoryPool minimum block size must be a power of two.");
+  }
+  if (region_size < min_block_size) {
+    return Status::ERROR("DeviceMemoryPool region size must be at least the minimum block size.");
+  }
+  *out = std::make_shared<DeviceMemoryPool>(platform, region_size, min_block_size);
+  return Status::OK();
+}
+
+bool DeviceMemoryPool::TakeBlock(Region *region, size_t order, size_t *offset) {
+  // Find the smallest free block that is large enough.
+  size_t o = order;
+  while ((o <= max_order_) && region->free_lists[o].empty()) {
+    o++;
+  }
+  if (o > max_order_) {
+    return false;
+  }
+  *offset = *region->free_lists[o].begin();
+  region->free_lists[o].erase(region->free_lists[o].begin());
+  // Split it until it has the requested order, freeing the upper halves.
+  while (o > order) {
+    o--;
+    region->free_lists[o].insert(*offset + BlockSize(o));
+  }
+  region->blocks_in_use++;
+  return true;
+}
+
+Status DeviceMemoryPool::AddRegion(int64_t *index) {
+  da_t base = D_NULLPTR;
+  auto status = platform_->DeviceMalloc(&base, BlockSize(max_order_));
+  if (!status.ok()) {
+    return status;
+  }
+  if (base == D_NULLPTR) {
+    return Status::DEVICE_OUT_OF_MEMORY();
+  }
+  Region region;
+  region.base = base;
+  region.free_lists.resize(max_order_ + 1);
+  region.free_lists[max_order_].insert(0);
+  // Reuse the slot of a trimmed region, such that region indices of allocations remain valid.
+  auto vacant = std::find_if(regions_.begin(), regions_.end(), [](const Region &r) { return r.base == D_NULLPTR; });
+  if (vacant != regions_.end()) {
+    *vacant = std::move(region);
+    *index = vacant - regions_.begin();
+  } else {
+    regions_.push_back(std::move(region));
+    *index = static_cast<int64_t>(regions_.size()) - 1;
+  }
+  stats_.bytes_reserved += BlockSize(max_order_);
+  stats_.num_regions++;
+  FLETCHER_LOG(DEBUG, "DeviceMemoryPool obtained region of " << BlockSize(max_order_) << " bytes.");
+  return Status::OK();
+}
+
+Status DeviceMemoryPool::Allocate(da_t *device_address, int64_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto bytes = static_cast<size_t>(std::max<int64_t>(size, 1));
+
+  // Requests that do not fit in a region get a dedicated allocation.
+  if (bytes > BlockSize(max_order_)) {
+    auto status = platform_->DeviceMalloc(device_address, bytes);
+    if (!status.ok()) {
+      return status;
+    }
+    Allocation a;
+    a.order = bytes;
+    allocations_[*device_address] = a;
+    stats_.bytes_reserved += bytes;
+    stats_.num_regions++;
+    stats_.bytes_in_use += bytes;
+  } else {
+    size_t order = 0;
+    while (BlockSize(order) < bytes) {
+      order++;
+    }
+    size_t offset = 0;
+    int64_t r = 0;
+    for (; r < static_cast<int64_t>(regions_.size()); r++) {
+      if ((regions_[r].base != D_NULLPTR) && TakeBlock(&regions_[r], order, &offset)) {
+        break;
+      }
+    }
+    if (r == static_cast<int64_t>(regions_.size())) {
+      auto status = AddRegion(&r);
+      if (!status.ok()) {
+        return status;
+      }
+      TakeBlock(&regions_[r], order, &offset);
+    }
+    *device_address = regions_[r].base + offset;
+    Allocation a;
+    a.region = r;
+    a.order = order;
+    allocations_[*device_address] = a;
+    stats_.bytes_in_use += BlockSize(order);
+  }
+
+  stats_.num_allocations++;
+  stats_.total_allocations++;
+  stats_.peak_bytes_in_use = std::max(stats_.peak_bytes_in_use, stats_.bytes_in_use);
+  return Status::OK();
+}
+
+Status DeviceMemoryPool::Free(da_t device_address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = allocations_.find(device_address);
+  if (it == allocations_.end()) {
+    return Status::ERROR("Device address was not allocated by this DeviceMemoryPool.");
+  }
+  auto a = it->second;
+  allocations_.erase(it);
+  stats_.num_allocations--;
+
+  if (a.region < 0) {
+    stats_.bytes_reserved -= a.order;
+    stats_.num_regions--;
+    stats_.bytes_in_use -= a.order;
+    return platform_->DeviceFree(device_address);
+  }
+
+  auto &region = regions_[a.region];
+  size_t offset = device_address - region.base;
+  size_t order = a.order;
+  stats_.bytes_in_use -= BlockSize(order);
+  region.blocks_in_use--;
+  // Merge the block with its buddy for as long as the buddy is free.
+  while (order < max_order_) {
+    size_t buddy = offset ^ BlockSize(order);
+    auto b = region.free_lists[order].find(buddy);
+    if (b == region.free_lists[order].end()) {
+      break;
+    }
+    region.free_lists[order].erase(b);
+    offset = std::min(offset, buddy);
+    order++;
+  }
+  region.free_lists[order].insert(offset);
+  return Status::OK();
+}
+
+Status DeviceMemoryPool::Trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Status result = Status::OK();
+  for (auto &r : regions_) {
+    if ((r.base != D_NULLPTR) && (r.blocks_in_use == 0)) {
+      auto status = platform_->DeviceFree(r.base);
+      if (!status.ok()) {
+        result = status;
+      }
+      r.base = D_NULLPTR;
+      r.free_lists.clear();
+      stats_.bytes_reserved -= BlockSize(max_order_);
+      stats_.num_regions--;
+    }
+  }
+  return result;
+}
+
+PoolStats DeviceMemoryPool::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PoolStats result = stats_;
+  result.bytes_free = 0;
+  result.largest_free_block = 0;
+  for (const auto &r : regions_) {
+    for (size_t o = 0; o < r.free_lists.size(); o++) {
+      if (!r.free_lists[o].empty()) {
+        result.bytes_free += r.free_lists[o].size() * BlockSize(o);
+        result.largest_free_block = std::max(result.largest_free_block, BlockSize(o));
+      }
+    }
+  }
+  return result;
+}
+
+Status DeviceVisibleMemoryPool::Make(std::shared_ptr<DeviceVisibleMemoryPool> *out,
+                                     const std::shared_ptr<Platform> &platform) {
+  if (!platform->has_host_memory()) {
+    return Status::ERROR("Platform " + platform->name() + " does not support device-visible host memory.");
+  }
+  *out = std::make_shared<DeviceVisibleMemoryPool>(platform);
+  return Status::OK();
+}
+
+arrow::Status DeviceVisibleMemoryPool::Allocate(int64_t size, uint8_t **out) {
+  if (size < 0) {
+    return arrow::Status::Invalid("Negative allocation size requested.");
+  }
+  // Arrow expects a valid pointer for empty buffers as well.
+  auto status = platform_->HostMalloc(out, std::max<int64_t>(size, 1));
+  if (!status.ok()) {
+    return arrow::Status::OutOfMemory("Could not allocate ", size, " bytes of device-visible memory. ", status.message);
+  }
+  auto allocated = bytes_allocated_.fetch_add(size) + size;
+  auto max = max_memory_.load();
+  while ((allocated > max) && !max_memory_.compare_exchange_weak(max, allocated)) {}
+  return arrow::Status::OK();
+}
+
+arrow::Status DeviceVisibleMemoryPool::Reallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) {
+  uint8_t *new_ptr = nullptr;
+  ARROW_RETURN_NOT_OK(Allocate(new_size, &new_ptr));
+  std::memcpy(new_ptr, *ptr, static_cast<size_t>(std::min(old_size, new_size)));
+  Free(*ptr, old_size);
+  *ptr = new_ptr;
+  return arrow::Status::OK();
+}
+
+void DeviceVisibleMemoryPool::Free(uint8_t *buffer, int64_t size) {
+  auto status = platform_->HostFree(buffer);
+  if (!status.ok()) {
+    FLETCHER_LOG(WARNING, "Could not free device-visible memory. " << status.message);
+  }
+  bytes_allocated_ -= size;
+}
+
+arrow::Status NumaMemoryPool::Allocate(int64_t size, uint8_t **out) {
+  if (size < 0) {
+    return arrow::Status::Invalid("Negative allocation size requested.");
+  }
+  auto status = placement_->Allocate(out, static_cast<size_t>(size));
+  if (!status.ok()) {
+    return arrow::Status::OutOfMemory("Could not allocate ", size, " bytes on NUMA node ", placement_->node(), ". ",
+                                      status.message);
+  }
+  auto allocated = bytes_allocated_.fetch_add(size) + size;
+  auto max = max_memory_.load();
+  while ((allocated > max) && !max_memory_.compare_exchange_weak(max, allocated)) {}
+  return arrow::Status::OK();
+}
+
+arrow::Status NumaMemoryPool::Reallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) {
+  uint8_t *new_ptr = nullptr;
+  ARROW_RETURN_NOT_OK(Allocate(new_size, &new_ptr));
+  std::memcpy(new_ptr, *ptr, static_cast<size_t>(std::min(old_size, new_size)));
+  Free(*ptr, old_size);
+  *ptr = new_ptr;
+  return arrow::Status::OK();
+}
+
+void NumaMemoryPool::Free(uint8_t *buffer, int64_t size) {
+  placement_->Free(buffer, static_cast<size_t>(size));
+  bytes_allocated_ -= size;
+}
+
+Status StagingArena::Allocate(uint8_t **out, std::shared_ptr<uint8_t> *block, int64_t size, size_t alignment) {
+  // Restart the current block once no region refers to it anymore.
+  if ((current_.data != nullptr) && (current_.data.use_count() == 1)) {
+    used_ = 0;
+  }
+  auto request = static_cast<size_t>(std::max<int64_t>(size, 1));
+  auto base = reinterpret_cast<uintptr_t>(current_.data.get());
+  auto offset = (base + used_ + alignment - 1) / alignment * alignment - base;
+  if ((current_.data == nullptr) || (offset + request > current_.size)) {
+    if (current_.data != nullptr) {
+      previous_.emplace_back(current_.data, current_.size);
+    }
+    // Reserve enough to align the region, whatever the alignment of the allocation.
+    Block fresh;
+    fresh.size = std::max(block_size_, request + alignment);
+    uint8_t *data = nullptr;
+    if (platform_->has_host_memory()) {
+      auto status = platform_->HostMalloc(&data, static_cast<int64_t>(fresh.size));
+      if (!status.ok()) {
+        return status;
+      }
+      auto platform = platform_;
+      fresh.data = std::shared_ptr<uint8_t>(data, [platform](uint8_t *p) { platform->HostFree(p); });
+    } else if (numa_ != nullptr) {
+      auto status = numa_->Allocate(&data, fresh.size);
+      if (!status.ok()) {
+        return status;
+      }
+      auto numa = numa_;
+      auto size = fresh.size;
+      fresh.data = std::shared_ptr<uint8_t>(data, [numa, size](uint8_t *p) { numa->Free(p, size); });
+    } else {
+      data = new(std::nothrow) uint8_t[fresh.size];
+      if (data == nullptr) {
+        return Status::ERROR("Could not allocate " + std::to_string(fresh.size) + " bytes of staging memory.");
+      }
+      fresh.data = std::shared_ptr<uint8_t>(data, [](uint8_t *p) { delete[] p; });
+    }
+    current_ = fresh;
+    used_ = 0;
+    base = reinterpret_cast<uintptr_t>(data);
+    offset = (base + alignment - 1) / alignment * alignment - base;
+  }
+  *out = current_.data.get() + offset;
+  *block = current_.data;
+  used_ = offset + request;
+  // Forget blocks that were freed.
+  previous_.erase(std::remove_if(previous_.begin(), previous_.end(),
+                                 [](const std::pair<std::weak_ptr<uint8_t>, size_t> &b) { return b.first.expired(); }),
+                  previous_.end());
+  return Status::OK();
+}
+
+size_t StagingArena::bytes_reserved() const {
+  size_t result = current_.size;
+  for (const auto &b : previous_) {
+    if (!b.first.expired()) {
+      result += b.second;
+    }
+  }
+  return result;
+}
+
+}  // namespace fletcher
@@ -0,0 +1,175 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/profiler.h"
+
+#include <fletcher/common.h>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <memory>
+
+namespace fletcher {
+
+/// Offset of the Profile_clear register relative to the Profile_enable register.
+static constexpr uint64_t kProfileClear = 1;
+/// Offset of the counters of the first stream relative to the Profile_enable register.
+static constexpr uint64_t kProfileCounters = 2;
+/// The number of counters of every stream.
+static constexpr uint64_t kCountersPerStream = 6;
+
+/**
+ * @brief Return the number of streams Fletchgen generates for a field.
+ *
+ * This mirrors fletchgen::GetStreamType(): strings, binaries and lists of primitives consist of a length stream and a
+ * values stream; other lists and structs nest the streams of their children, and top-level fields are wrapped in a
+ * stream unless they are of the former kind.
+ */
+static size_t CountStreams(const arrow::Field &field, int level) {
+  size_t result = 0;
+  switch (field.type()->id()) {
+    case arrow::Type::BINARY:
+    case arrow::Type::STRING: return 2;
+    case arrow::Type::LIST: {
+      auto child = field.type()->field(0);
+      auto child_id = child->type()->id();
+      if ((child_id != arrow::Type::LIST) && (child_id != arrow::Type::BINARY) && (child_id != arrow::Type::STRING)
+          && (child_id != arrow::Type::STRUCT)) {
+        return 2;
+      }
+      result = 1 + CountStreams(*child, level + 1);
+      break;
+    }
+    case arrow::Type::STRUCT: {
+      for (const auto &child : field.type()->fields()) {
+        result += CountStreams(*child, level + 1);
+      }
+      break;
+    }
+    default: break;
+  }
+  return level == 0 ? result + 1 : result;
+}
+
+StreamProfiler::StreamProfiler(std::shared_ptr<Platform> platform, uint64_t base, std::vector<std::string> streams)
+    : platform_(std::move(platform)), base_(base), streams_(std::move(streams)) {}
+
+std::vector<std::string> StreamProfiler::ProfiledStreams(const arrow::Schema &schema) {
+  std::vector<std::string> result;
+  auto name = GetMeta(schema, meta::NAME);
+  for (const auto &field : schema.fields()) {
+    if (GetBoolMeta(*field, meta::IGNORE) || !GetBoolMeta(*field, meta::PROFILE)) {
+      continue;
+    }
+    auto num_streams = CountStreams(*field, 0);
+    for (size_t i = 0; i < num_streams; i++) {
+      result.push_back(name + "_" + field->name() + "_" + std::to_string(i));
+    }
+  }
+  return result;
+}
+
+Status StreamProfiler::Make(std::shared_ptr<StreamProfiler> *out,
+                            const Context &context,
+                            size_t custom_registers,
+                            uint64_t mmio_base) {
+  std::vector<std::string> streams;
+  for (size_t i = 0; i < context.num_recordbatches(); i++) {
+    auto batch_streams = ProfiledStreams(*context.recordbatch(i)->schema());
+    streams.insert(streams.end(), batch_streams.begin(), batch_streams.end());
+  }
+  if (streams.empty()) {
+    return Status::ERROR("No field of the context is profiled. Set fletcher_profile metadata to true on a field.");
+  }
+  // The profiling registers follow the range, address and custom registers.
+  auto base = mmio_base + FLETCHER_REG_SCHEMA + 2 * context.num_recordbatches() + 2 * context.num_buffers()
+      + custom_registers;
+  *out = std::make_shared<StreamProfiler>(context.platform(), base, streams);
+  return Status::OK();
+}
+
+Status StreamProfiler::Start() {
+  // Profile_clear is a strobe, it does not need to be deasserted.
+  std::vector<fmmio_t> writes = {{base_ + kProfileClear, 1}, {base_, 1}};
+  return platform_->WriteMMIOBatch(writes);
+}
+
+Status StreamProfiler::Stop() {
+  return platform_->WriteMMIO(base_, 0);
+}
+
+Status StreamProfiler::Read(std::vector<StreamProfile> *out) {
+  out->clear();
+  for (size_t s = 0; s < streams_.size(); s++) {
+    StreamProfile profile;
+    profile.name = streams_[s];
+    uint32_t *counters[kCountersPerStream] = {&profile.elements, &profile.valids, &profile.readies,
+                                              &profile.transfers, &profile.packets, &profile.cycles};
+    for (uint64_t c = 0; c < kCountersPerStream; c++) {
+      auto status = platform_->ReadMMIO(base_ + kProfileCounters + kCountersPerStream * s + c, counters[c]);
+      if (!status.ok()) return status;
+    }
+    out->push_back(profile);
+  }
+  return Status::OK();
+}
+
+Status StreamProfiler::Profile(Kernel *kernel, std::vector<StreamProfile> *out) {
+  auto status = Start();
+  if (!status.ok()) return status;
+  status = kernel->Run();
+  if (!status.ok()) {
+    Stop();
+    return status;
+  }
+  status = Stop();
+  if (!status.ok()) return status;
+  return Read(out);
+}
+
+std::string StreamProfiler::ToJSON(const std::vector<StreamProfile> &profiles) {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(6);
+  ss << "{\"streams\":[";
+  const StreamProfile *bottleneck = nullptr;
+  for (size_t i = 0; i < profiles.size(); i++) {
+    const auto &p = profiles[i];
+    if ((bottleneck == nullptr) || (p.utilization() > bottleneck->utilization())) {
+      bottleneck = &p;
+    }
+    ss << (i > 0 ? "," : "") << "\n{\"name\":\"" << p.name << "\""
+       << ",\"elements\":" << p.elements
+       << ",\"valids\":" << p.valids
+       << ",\"readies\":" << p.readies
+       << ",\"transfers\":" << p.transfers
+       << ",\"packets\":" << p.packets
+       << ",\"cycles\":" << p.cycles
+       << ",\"elements_per_cycle\":" << p.elements_per_cycle()
+       << ",\"utilization\":" << p.utilization()
+       << ",\"backpressure\":" << p.backpressure()
+       << ",\"starvation\":" << p.starvation() << "}";
+  }
+  ss << "\n],\"bottleneck\":";
+  if (bottleneck != nullptr) {
+    ss << "\"" << bottleneck->name << "\"";
+  } else {
+    ss << "null";
+  }
+  ss << "}\n";
+  return ss.str();
+}
+
+}  // namespace fletcher
@@ -0,0 +1,202 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/result.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <memory>
+
+namespace fletcher {
+
+/// An arrow::Buffer wrapping host memory that the device wrote to in place, keeping its owner alive.
+class InPlaceBuffer : public arrow::Buffer {
+ public:
+  InPlaceBuffer(const uint8_t *data, int64_t size, std::shared_ptr<arrow::RecordBatch> owner)
+      : arrow::Buffer(data, size), owner_(std::move(owner)) {}
+
+ private:
+  std::shared_ptr<arrow::RecordBatch> owner_;
+};
+
+ResultRecordBatch::ResultRecordBatch(const std::shared_ptr<const Context> &context,
+                                     std::shared_ptr<arrow::RecordBatch> batch,
+                                     RecordBatchDescription desc,
+                                     std::vector<DeviceBuffer> buffers,
+                                     int64_t num_rows,
+                                     arrow::MemoryPool *pool)
+    : context_(context),
+      generation_(context->generation()),
+      batch_(std::move(batch)),
+      desc_(std::move(desc)),
+      buffers_(std::move(buffers)),
+      num_rows_(num_rows),
+      pool_(pool) {
+  size_t first = 0;
+  for (const auto &f : desc_.fields) {
+    first_buffer_.push_back(first);
+    first += f.buffers.size();
+  }
+  columns_.resize(desc_.fields.size());
+}
+
+Status ResultRecordBatch::Fetch(size_t i, int64_t size, std::shared_ptr<arrow::Buffer> *out) {
+  if (i >= buffers_.size()) {
+    return Status::ERROR("RecordBatch has fewer device buffers than its schema requires.");
+  }
+  const auto &buf = buffers_[i];
+  if (size > buf.size) {
+    return Status::ERROR("Kernel produced " + std::to_string(size) + " bytes, exceeding the buffer size of "
+                             + std::to_string(buf.size) + " bytes.");
+  }
+  if (buf.zero_copy) {
+    *out = std::make_shared<InPlaceBuffer>(buf.host_address, size, batch_);
+    return Status::OK();
+  }
+  auto result = arrow::AllocateBuffer(size, pool_);
+  if (!result.ok()) {
+    return Status::ERROR("Could not allocate host buffer: " + result.status().ToString());
+  }
+  std::shared_ptr<arrow::Buffer> host = std::move(result).ValueOrDie();
+  if (size > 0) {
+    auto context = context_.lock();
+    if (context == nullptr) {
+      return Status::ERROR("Context was destructed since the results were obtained.");
+    }
+    auto status = context->platform()->CopyDeviceToHost(buf.device_address, host->mutable_data(), size);
+    if (!status.ok()) {
+      return status;
+    }
+    bytes_copied_ += size;
+  }
+  *out = host;
+  return Status::OK();
+}
+
+Status ResultRecordBatch::Materialize(const std::shared_ptr<arrow::Field> &field,
+                                      int64_t length,
+                                      int64_t offset,
+                                      size_t *buffer,
+                                      std::shared_ptr<arrow::ArrayData> *out) {
+  // The device buffers hold the elements from the start of the byte holding the validity bit of the first element.
+  auto end = offset + length;
+  auto type = field->type();
+  std::shared_ptr<arrow::Buffer> validity;
+  int64_t null_count = 0;
+  // The order in which buffers are consumed follows the RecordBatchAnalyzer.
+  if (field->nullable()) {
+    auto i = (*buffer)++;
+    if (i >= buffers_.size()) {
+      return Status::ERROR("RecordBatch has fewer device buffers than its schema requires.");
+    }
+    if (buffers_[i].host_address != nullptr) {
+      auto status = Fetch(i, (end + 7) / 8, &validity);
+      if (!status.ok()) return status;
+      null_count = arrow::kUnknownNullCount;
+    }
+  }
+
+  switch (type->id()) {
+    case arrow::Type::STRING:
+    case arrow::Type::BINARY:
+    case arrow::Type::LIST: {
+      // Read the offsets first, to find out how many values were produced.
+      std::shared_ptr<arrow::Buffer> offsets;
+      auto status = Fetch((*buffer)++, (end + 1) * static_cast<int64_t>(sizeof(int32_t)), &offsets);
+      if (!status.ok()) return status;
+      int32_t last = 0;
+      std::memcpy(&last, offsets->data() + end * sizeof(int32_t), sizeof(int32_t));
+      if (last < 0) {
+        return Status::ERROR("Kernel produced a negative offset for field " + field->name() + ".");
+      }
+      if (type->id() == arrow::Type::LIST) {
+        std::shared_ptr<arrow::ArrayData> child;
+        // Offsets are absolute, so the values start at the first element of their device buffers.
+        status = Materialize(type->field(0), last, 0, buffer, &child);
+        if (!status.ok()) return status;
+        *out = arrow::ArrayData::Make(type, length, {validity, offsets}, {child}, null_count, offset);
+      } else {
+        std::shared_ptr<arrow::Buffer> values;
+        status = Fetch((*buffer)++, last, &values);
+        if (!status.ok()) return status;
+        *out = arrow::ArrayData::Make(type, length, {validity, offsets, values}, null_count, offset);
+      }
+      return Status::OK();
+    }
+    case arrow::Type::STRUCT: {
+      std::vector<std::shared_ptr<arrow::ArrayData>> children;
+      for (int c = 0; c < type->num_fields(); c++) {
+        std::shared_ptr<arrow::ArrayData> child;
+        // Children are sliced by the offset of the struct itself.
+        auto status = Materialize(type->field(c), end, 0, buffer, &child);
+        if (!status.ok()) return status;
+        children.push_back(child);
+      }
+      *out = arrow::ArrayData::Make(type, length, {validity}, children, null_count, offset);
+      return Status::OK();
+    }
+    default: {
+      auto fixed_width = std::dynamic_pointer_cast<arrow::FixedWidthType>(type);
+      if ((fixed_width == nullptr) || (type->id() == arrow::Type::BOOL)) {
+        return Status::ERROR("Cannot materialize results of type " + type->ToString() + ".");
+      }
+      std::shared_ptr<arrow::Buffer> values;
+      auto status = Fetch((*buffer)++, (end * fixed_width->bit_width() + 7) / 8, &values);
+      if (!status.ok()) return status;
+      *out = arrow::ArrayData::Make(type, length, {validity, values}, null_count, offset);
+      return Status::OK();
+    }
+  }
+}
+
+Status ResultRecordBatch::GetColumn(int i, std::shared_ptr<arrow::Array> *out) {
+  if ((i < 0) || (i >= num_columns())) {
+    return Status::ERROR("Column index out of bounds.");
+  }
+  if (columns_[i] == nullptr) {
+    auto context = context_.lock();
+    if (context == nullptr) {
+      return Status::ERROR("Context was destructed since the results were obtained.");
+    }
+    if (context->generation() != generation_) {
+      return Status::ERROR("Context has changed since the results were obtained.");
+    }
+    auto buffer = first_buffer_[i];
+    std::shared_ptr<arrow::ArrayData> data;
+    auto status = Materialize(schema()->field(i), num_rows_, desc_.first_index, &buffer, &data);
+    if (!status.ok()) {
+      return status;
+    }
+    columns_[i] = arrow::MakeArray(data);
+  }
+  *out = columns_[i];
+  return Status::OK();
+}
+
+Status ResultRecordBatch::ToRecordBatch(std::shared_ptr<arrow::RecordBatch> *out) {
+  std::vector<std::shared_ptr<arrow::Array>> columns;
+  for (int i = 0; i < num_columns(); i++) {
+    std::shared_ptr<arrow::Array> column;
+    auto status = GetColumn(i, &column);
+    if (!status.ok()) {
+      return status;
+    }
+    columns.push_back(column);
+  }
+  *out = arrow::RecordBatch::Make(schema(), num_rows_, columns);
+  return Status::OK();
+}
+
+}  // namespace fletcher
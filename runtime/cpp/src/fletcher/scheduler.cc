@@ -0,0 +1,199 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/scheduler.h"
+
+#include <fletcher/common.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <memory>
+
+namespace fletcher {
+
+/// Maximum time to block on completion events at once, after which the status registers of all instances are polled.
+static constexpr uint64_t kSchedulerWaitUsec = 10000;
+
+KernelScheduler::KernelScheduler(const std::shared_ptr<Context> &context,
+                                 const std::vector<uint64_t> &mmio_bases,
+                                 int32_t chunk_rows)
+    : context_(context), chunk_rows_(chunk_rows) {
+  for (auto base : mmio_bases) {
+    auto kernel = std::make_shared<Kernel>(context_);
+    kernel->mmio_base = base;
+    instances_.push_back(kernel);
+  }
+}
+
+Status KernelScheduler::Make(std::shared_ptr<KernelScheduler> *out,
+                             const std::shared_ptr<Context> &context,
+                             const std::vector<uint64_t> &mmio_bases,
+                             int32_t chunk_rows) {
+  if (mmio_bases.empty()) {
+    return Status::ERROR("KernelScheduler requires at least one kernel instance.");
+  }
+  if (chunk_rows <= 0) {
+    return Status::ERROR("KernelScheduler chunk size must be positive.");
+  }
+  *out = std::make_shared<KernelScheduler>(context, mmio_bases, chunk_rows);
+  return Status::OK();
+}
+
+Status KernelScheduler::Run(size_t recordbatch_index, const ReduceFunction &reduce, uint64_t init, uint64_t *result) {
+  if (recordbatch_index >= context_->num_recordbatches()) {
+    return Status::ERROR("RecordBatch index out of bounds.");
+  }
+  int64_t num_rows = context_->recordbatch(recordbatch_index)->num_rows();
+  if (num_rows > INT32_MAX) {
+    return Status::ERROR("RecordBatch has too many rows to be addressed by the range registers.");
+  }
+
+  stats_ = SchedulerStats();
+  stats_.chunks_per_instance.resize(instances_.size(), 0);
+  Timer t;
+  t.start();
+  *result = init;
+
+  int64_t next_row = 0;
+  std::vector<bool> busy(instances_.size(), false);
+  std::vector<bool> programmed(instances_.size(), false);
+  size_t num_busy = 0;
+
+  // Hand out the next chunk to an idle instance.
+  auto dispatch = [&](size_t i) -> Status {
+    // Program the metadata of an instance when it receives its first chunk. Only the range changes for later chunks.
+    if (!programmed[i]) {
+      auto status = instances_[i]->WriteMetaData();
+      if (!status.ok()) return status;
+      programmed[i] = true;
+    }
+    auto first = next_row;
+    auto last = std::min(first + chunk_rows_, num_rows);
+    next_row = last;
+    auto status = instances_[i]->SetRange(recordbatch_index, static_cast<int32_t>(first), static_cast<int32_t>(last));
+    if (!status.ok()) return status;
+    status = instances_[i]->Start();
+    if (!status.ok()) return status;
+    busy[i] = true;
+    num_busy++;
+    return Status::OK();
+  };
+
+  auto status = Status::OK();
+  for (size_t i = 0; (i < instances_.size()) && (next_row < num_rows) && status.ok(); i++) {
+    status = dispatch(i);
+  }
+
+  // Completion events are not attributed to an instance. Every instance that is observed done accounts for one event,
+  // which may have been consumed while blocking already.
+  auto platform = context_->platform();
+  bool events = use_completion_events && platform->has_completion_events();
+  uint64_t consumed = 0;
+  uint64_t polls = 0;
+  double sleep_usec = poll_strategy.min_sleep_usec;
+  auto deadline = t.start_ + std::chrono::microseconds(poll_strategy.timeout_usec);
+
+  while (status.ok() && (num_busy > 0)) {
+    bool any_done = false;
+    for (size_t i = 0; (i < instances_.size()) && status.ok(); i++) {
+      if (!busy[i]) continue;
+      bool done = false;
+      status = instances_[i]->IsDone(&done);
+      if (!status.ok() || !done) continue;
+
+      any_done = true;
+      busy[i] = false;
+      num_busy--;
+      if (events) {
+        if (consumed > 0) {
+          consumed--;
+        } else {
+          platform->WaitForCompletion(0);
+        }
+      }
+      uint32_t ret0 = 0;
+      uint32_t ret1 = 0;
+      status = instances_[i]->GetReturn(&ret0, &ret1);
+      if (!status.ok()) continue;
+      *result = reduce(*result, (static_cast<uint64_t>(ret1) << 32u) | ret0);
+      stats_.chunks++;
+      stats_.chunks_per_instance[i]++;
+
+      // The instance that finished first steals the next chunk.
+      if (next_row < num_rows) {
+        status = dispatch(i);
+      }
+    }
+    if (!status.ok() || (num_busy == 0)) {
+      break;
+    }
+    if (any_done) {
+      polls = 0;
+      sleep_usec = poll_strategy.min_sleep_usec;
+      continue;
+    }
+    uint64_t wait_usec = kSchedulerWaitUsec;
+    if (poll_strategy.timeout_usec != 0) {
+      auto now = Timer::system_clock::now();
+      if (now >= deadline) {
+        status = Status::TIMEOUT();
+        break;
+      }
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+      wait_usec = std::min(wait_usec, static_cast<uint64_t>(remaining));
+    }
+    if (events) {
+      // Block until any instance signals completion.
+      auto wait_status = platform->WaitForCompletion(wait_usec);
+      if (wait_status.ok()) {
+        consumed++;
+      } else if (!(wait_status == Status::TIMEOUT())) {
+        status = wait_status;
+      }
+      continue;
+    }
+    // Back off according to the phase the poll strategy is in.
+    polls++;
+    if (polls <= poll_strategy.spin_polls) {
+      continue;
+    } else if (polls <= poll_strategy.spin_polls + poll_strategy.yield_polls) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(static_cast<uint64_t>(sleep_usec)));
+      sleep_usec = std::min(sleep_usec * poll_strategy.backoff, static_cast<double>(poll_strategy.max_sleep_usec));
+    }
+  }
+
+  // Stop instances that are still running after a failure, and never leave any instance reserved.
+  for (size_t i = 0; i < instances_.size(); i++) {
+    if (busy[i]) {
+      instances_[i]->Reset();
+    } else {
+      instances_[i]->Release();
+    }
+  }
+  if (!status.ok()) {
+    FLETCHER_LOG(WARNING, "KernelScheduler stopped after " << stats_.chunks << " chunk(s): " << status.message);
+  }
+
+  t.stop();
+  stats_.seconds = t.seconds();
+  FLETCHER_LOG(DEBUG, "KernelScheduler processed " << stats_.chunks << " chunk(s) over " << instances_.size()
+                                                   << " instance(s) in " << stats_.seconds << " s.");
+  return status;
+}
+
+}  // namespace fletcher
@@ -0,0 +1,98 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/sharding.h"
+
+#include <fletcher/common.h>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <memory>
+
+namespace fletcher {
+
+/// @brief Run a function for every shard on its own thread, returning the first failing status.
+static Status ForEachShard(size_t num_shards, const std::function<Status(size_t)> &func) {
+  std::vector<Status> statuses(num_shards, Status::OK());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_shards; i++) {
+    threads.emplace_back([&statuses, &func, i]() { statuses[i] = func(i); });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  for (auto &s : statuses) {
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return Status::OK();
+}
+
+ShardedContext::ShardedContext(const std::vector<std::shared_ptr<Platform>> &platforms) {
+  for (const auto &platform : platforms) {
+    auto context = std::make_shared<Context>(platform);
+    contexts_.push_back(context);
+    kernels_.push_back(std::make_shared<Kernel>(context));
+  }
+}
+
+Status ShardedContext::Make(std::shared_ptr<ShardedContext> *out,
+                            const std::vector<std::shared_ptr<Platform>> &platforms) {
+  if (platforms.empty()) {
+    return Status::ERROR("ShardedContext requires at least one platform.");
+  }
+  *out = std::make_shared<ShardedContext>(platforms);
+  return Status::OK();
+}
+
+Status ShardedContext::QueueRecordBatch(const std::shared_ptr<arrow::RecordBatch> &record_batch,
+                                        MemType mem_type,
+                                        size_t *shard) {
+  size_t target = 0;
+  for (size_t i = 1; i < contexts_.size(); i++) {
+    if (contexts_[i]->GetQueueSize() < contexts_[target]->GetQueueSize()) {
+      target = i;
+    }
+  }
+  if (shard != nullptr) {
+    *shard = target;
+  }
+  return contexts_[target]->QueueRecordBatch(record_batch, mem_type);
+}
+
+Status ShardedContext::Enable() {
+  return ForEachShard(contexts_.size(), [this](size_t i) { return contexts_[i]->Enable(); });
+}
+
+Status ShardedContext::Run(std::vector<uint64_t> *returns) {
+  returns->assign(contexts_.size(), 0);
+  return ForEachShard(contexts_.size(), [this, returns](size_t i) -> Status {
+    if (contexts_[i]->num_recordbatches() == 0) {
+      return Status::OK();
+    }
+    auto status = kernels_[i]->Start();
+    if (!status.ok()) return status;
+    status = kernels_[i]->PollUntilDone();
+    if (!status.ok()) return status;
+    uint32_t ret0 = 0;
+    uint32_t ret1 = 0;
+    status = kernels_[i]->GetReturn(&ret0, &ret1);
+    if (!status.ok()) return status;
+    (*returns)[i] = (static_cast<uint64_t>(ret1) << 32u) | ret0;
+    return Status::OK();
+  });
+}
+
+}  // namespace fletcher
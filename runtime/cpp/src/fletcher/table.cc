@@ -0,0 +1,167 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/table.h"
+
+#include <arrow/array/concatenate.h>
+#include <fletcher/common.h>
+#include <fletcher/timer.h>
+#include <algorithm>
+#include <climits>
+#include <vector>
+#include <memory>
+#include <utility>
+
+namespace fletcher {
+
+/// @brief Obtain the number of bytes the buffers of a RecordBatch occupy on the device.
+static Status DeviceBytes(const arrow::RecordBatch &batch, size_t *bytes) {
+  RecordBatchDescription rbd;
+  RecordBatchAnalyzer rba(&rbd);
+  if (!rba.Analyze(batch)) {
+    return Status::ERROR("RecordBatch could not be analyzed.");
+  }
+  *bytes = 0;
+  for (const auto &f : rbd.fields) {
+    for (const auto &b : f.buffers) {
+      *bytes += b.size_;
+    }
+  }
+  return Status::OK();
+}
+
+/// @brief Copy the variable-length columns of a slice, such that they no longer refer to values outside the slice.
+static Status Compact(const std::shared_ptr<arrow::RecordBatch> &slice, std::shared_ptr<arrow::RecordBatch> *out) {
+  std::vector<std::shared_ptr<arrow::Array>> columns;
+  for (int i = 0; i < slice->num_columns(); i++) {
+    auto column = slice->column(i);
+    if ((column->offset() != 0) && (std::dynamic_pointer_cast<arrow::FixedWidthType>(column->type()) == nullptr)) {
+      auto result = arrow::Concatenate({column});
+      if (!result.ok()) {
+        return Status::ERROR("Could not compact column " + slice->schema()->field(i)->name() + ": "
+                                 + result.status().ToString());
+      }
+      column = std::move(result).ValueOrDie();
+    }
+    columns.push_back(column);
+  }
+  *out = arrow::RecordBatch::Make(slice->schema(), slice->num_rows(), columns);
+  return Status::OK();
+}
+
+TableExecutor::TableExecutor(std::shared_ptr<Platform> platform,
+                             size_t memory_budget,
+                             size_t num_slots,
+                             MemType mem_type)
+    : executor_(std::make_shared<StreamExecutor>(std::move(platform), num_slots, mem_type)),
+      chunk_budget_(memory_budget / num_slots) {}
+
+Status TableExecutor::Make(std::shared_ptr<TableExecutor> *out,
+                           const std::shared_ptr<Platform> &platform,
+                           size_t memory_budget,
+                           size_t num_slots,
+                           MemType mem_type) {
+  if (num_slots == 0) {
+    return Status::ERROR("TableExecutor requires at least one slot.");
+  }
+  if (memory_budget / num_slots == 0) {
+    return Status::ERROR("TableExecutor memory budget too small for the number of slots.");
+  }
+  *out = std::make_shared<TableExecutor>(platform, memory_budget, num_slots, mem_type);
+  return Status::OK();
+}
+
+Status TableExecutor::NextChunk(const std::shared_ptr<arrow::RecordBatch> &batch,
+                                int64_t *position,
+                                int64_t *rows,
+                                std::shared_ptr<arrow::RecordBatch> *out) {
+  // The range registers are 32 bits wide.
+  auto n = std::min({*rows, batch->num_rows() - *position, static_cast<int64_t>(INT32_MAX - 8)});
+  while (true) {
+    auto status = Compact(batch->Slice(*position, n), out);
+    if (!status.ok()) return status;
+    size_t bytes = 0;
+    status = DeviceBytes(**out, &bytes);
+    if (!status.ok()) return status;
+    if (bytes <= chunk_budget_) {
+      stats_.max_chunk_bytes = std::max(stats_.max_chunk_bytes, bytes);
+      break;
+    }
+    if (n == 1) {
+      return Status::ERROR("A single row of " + std::to_string(bytes) + " bytes exceeds the chunk budget of "
+                               + std::to_string(chunk_budget_) + " bytes.");
+    }
+    // Rows may vary in size, so shrink the chunk until it fits.
+    n = n / 2;
+    *rows = n;
+  }
+  *position += n;
+  stats_.chunks++;
+  stats_.rows += n;
+  return Status::OK();
+}
+
+Status TableExecutor::Run(arrow::RecordBatchReader *reader,
+                          const ReduceFunction &reduce,
+                          uint64_t init,
+                          uint64_t *result) {
+  stats_ = TableStats();
+  Timer t;
+  t.start();
+  *result = init;
+  executor_->arguments = arguments;
+
+  std::shared_ptr<arrow::RecordBatch> input;
+  int64_t position = 0;
+  int64_t rows = 0;
+  auto source = [&](std::shared_ptr<arrow::RecordBatch> *out) -> Status {
+    // Move on to the next input RecordBatch once the current one is exhausted.
+    while ((input == nullptr) || (position >= input->num_rows())) {
+      auto status = reader->ReadNext(&input);
+      if (!status.ok()) {
+        return Status::ERROR("Could not read RecordBatch: " + status.ToString());
+      }
+      if (input == nullptr) {
+        *out = nullptr;
+        return Status::OK();
+      }
+      position = 0;
+      // Estimate the number of rows that fit the budget from the average row size.
+      size_t bytes = 0;
+      auto analyzed = DeviceBytes(*input, &bytes);
+      if (!analyzed.ok()) return analyzed;
+      rows = (bytes == 0) ? input->num_rows()
+                          : std::max<int64_t>(1, static_cast<int64_t>(chunk_budget_ * input->num_rows() / bytes));
+    }
+    return NextChunk(input, &position, &rows, out);
+  };
+  auto on_done = [&](size_t, uint32_t ret0, uint32_t ret1) -> Status {
+    *result = reduce(*result, (static_cast<uint64_t>(ret1) << 32u) | ret0);
+    return Status::OK();
+  };
+  auto status = executor_->Run(source, on_done);
+
+  t.stop();
+  stats_.seconds = t.seconds();
+  FLETCHER_LOG(DEBUG, "TableExecutor processed " << stats_.rows << " row(s) in " << stats_.chunks << " chunk(s) in "
+                                                 << stats_.seconds << " s.");
+  return status;
+}
+
+Status TableExecutor::Run(const arrow::Table &table, const ReduceFunction &reduce, uint64_t init, uint64_t *result) {
+  arrow::TableBatchReader reader(table);
+  return Run(&reader, reduce, init, result);
+}
+
+}  // namespace fletcher
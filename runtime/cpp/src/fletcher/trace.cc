@@ -0,0 +1,274 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fletcher/trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace fletcher {
+
+/// Name of the span recorded for every kernel launch, see Kernel::Start().
+static constexpr const char *kLaunchSpan = "Kernel::Start";
+/// Category of spans of MMIO register accesses.
+static constexpr const char *kMmioCategory = "mmio";
+/// Category of spans of copies between host and device.
+static constexpr const char *kCopyCategory = "copy";
+
+void Log2Histogram::Add(double value) {
+  size_t bucket = 0;
+  if (value >= 1.0) {
+    bucket = static_cast<size_t>(std::floor(std::log2(value))) + 1;
+  }
+  if (buckets.size() <= bucket) {
+    buckets.resize(bucket + 1, 0);
+  }
+  buckets[bucket]++;
+}
+
+uint64_t Log2Histogram::count() const {
+  uint64_t result = 0;
+  for (auto b : buckets) {
+    result += b;
+  }
+  return result;
+}
+
+double Log2Histogram::Percentile(double p) const {
+  auto total = count();
+  if (total == 0) {
+    return 0.0;
+  }
+  auto target = static_cast<uint64_t>(std::ceil(p * static_cast<double>(total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if ((seen >= target) && (seen > 0)) {
+      return std::ldexp(1.0, static_cast<int>(i));
+    }
+  }
+  return std::ldexp(1.0, static_cast<int>(buckets.size()));
+}
+
+void TraceSummary::Print(std::ostream &os) const {
+  os << std::setw(32) << std::left << "Span" << std::right
+     << std::setw(10) << "Count"
+     << std::setw(14) << "Seconds"
+     << std::setw(14) << "Bytes"
+     << std::setw(10) << "GB/s"
+     << std::setw(12) << "p50 (us)"
+     << std::setw(12) << "p99 (us)" << std::endl;
+  for (const auto &s : spans) {
+    os << std::setw(32) << std::left << s.first << std::right
+       << std::setw(10) << s.second.count
+       << std::setw(14) << std::fixed << std::setprecision(6) << s.second.seconds
+       << std::setw(14) << s.second.bytes
+       << std::setw(10) << std::setprecision(3) << s.second.gbps()
+       << std::setw(12) << std::setprecision(0) << s.second.latency_us.Percentile(0.5)
+       << std::setw(12) << s.second.latency_us.Percentile(0.99) << std::endl;
+  }
+  os << "MMIO operations per launch (p50/p99): " << mmio_ops_per_launch.Percentile(0.5) << " / "
+     << mmio_ops_per_launch.Percentile(0.99) << std::endl;
+  if (dropped > 0) {
+    os << "Dropped spans: " << dropped << std::endl;
+  }
+}
+
+Tracer::Tracer() : epoch_(clock::now()) {}
+
+Tracer &Tracer::Global() {
+  // Never destroyed, such that threads can still record while static objects are destructed.
+  static auto *tracer = new Tracer();
+  return *tracer;
+}
+
+void Tracer::Enable(size_t ring_capacity) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring_capacity_ = std::max<size_t>(ring_capacity, 1);
+  }
+  enabled_.store(true);
+}
+
+void Tracer::Disable() {
+  enabled_.store(false);
+}
+
+void Tracer::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &ring : rings_) {
+    ring->head.store(0);
+  }
+}
+
+Tracer::Ring *Tracer::ThreadRing() {
+  thread_local Ring *ring = nullptr;
+  if (ring == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rings_.emplace_back(new Ring(ring_capacity_, static_cast<uint32_t>(rings_.size())));
+    ring = rings_.back().get();
+  }
+  return ring;
+}
+
+void Tracer::Record(const char *name,
+                    const char *category,
+                    clock::time_point start,
+                    clock::time_point stop,
+                    uint64_t bytes,
+                    uint64_t offset,
+                    uint64_t count) {
+  auto ring = ThreadRing();
+  auto head = ring->head.load(std::memory_order_relaxed);
+  auto &event = ring->events[head % ring->events.size()];
+  event.name = name;
+  event.category = category;
+  event.thread = ring->thread;
+  event.start_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch_).count());
+  event.duration_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+  event.bytes = bytes;
+  event.offset = offset;
+  event.count = count;
+  // Publish the span to readers.
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<TraceEvent> Tracer::Collect() const {
+  std::vector<TraceEvent> result;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &ring : rings_) {
+    auto head = ring->head.load(std::memory_order_acquire);
+    auto capacity = ring->events.size();
+    auto first = head > capacity ? head - capacity : 0;
+    for (auto i = first; i < head; i++) {
+      result.push_back(ring->events[i % capacity]);
+    }
+  }
+  std::stable_sort(result.begin(), result.end(), [](const TraceEvent &a, const TraceEvent &b) {
+    return a.start_ns < b.start_ns;
+  });
+  return result;
+}
+
+/// @brief Write a string literal as a JSON string, escaping the characters that require it.
+static void WriteJsonString(std::ostream *os, const char *str) {
+  *os << '"';
+  for (const char *c = str; (c != nullptr) && (*c != '\0'); c++) {
+    if ((*c == '"') || (*c == '\\')) {
+      *os << '\\';
+    }
+    *os << *c;
+  }
+  *os << '"';
+}
+
+Status Tracer::ExportChromeTrace(std::ostream *os) const {
+  auto events = Collect();
+  *os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto &e = events[i];
+    if (i > 0) {
+      *os << ",";
+    }
+    // Complete events ("X") take timestamps and durations in microseconds.
+    *os << "\n{\"name\":";
+    WriteJsonString(os, e.name);
+    *os << ",\"cat\":";
+    WriteJsonString(os, e.category);
+    *os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+        << std::fixed << std::setprecision(3)
+        << ",\"ts\":" << static_cast<double>(e.start_ns) * 1E-3
+        << ",\"dur\":" << static_cast<double>(e.duration_ns) * 1E-3
+        << ",\"args\":{\"bytes\":" << e.bytes << ",\"offset\":" << e.offset << ",\"count\":" << e.count << "}}";
+  }
+  *os << "\n]}\n";
+  if (!os->good()) {
+    return Status::ERROR("Could not write trace.");
+  }
+  return Status::OK();
+}
+
+Status Tracer::ExportChromeTrace(const std::string &path) const {
+  std::ofstream ofs(path);
+  if (!ofs.is_open()) {
+    return Status::ERROR("Could not open " + path + " for writing.");
+  }
+  return ExportChromeTrace(&ofs);
+}
+
+TraceSummary Tracer::Summarize() const {
+  TraceSummary result;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &ring : rings_) {
+      auto head = ring->head.load(std::memory_order_acquire);
+      if (head > ring->events.size()) {
+        result.dropped += head - ring->events.size();
+      }
+    }
+  }
+
+  auto events = Collect();
+  for (const auto &e : events) {
+    auto &s = result.spans[e.name];
+    auto seconds = static_cast<double>(e.duration_ns) * 1E-9;
+    s.count++;
+    s.seconds += seconds;
+    s.bytes += e.bytes;
+    s.ops += e.count;
+    s.latency_us.Add(static_cast<double>(e.duration_ns) * 1E-3);
+    if ((std::strcmp(e.category, kCopyCategory) == 0) && (e.duration_ns > 0)) {
+      result.copy_mbps.Add(static_cast<double>(e.bytes) / seconds * 1E-6);
+    }
+  }
+
+  // Attribute the MMIO operations of every thread to launches. A launch consists of the operations that finished
+  // after the previous launch of the thread, up to and including its own start. Operations after the last launch of a
+  // thread, such as polling and reading the return registers, belong to that last launch.
+  std::map<uint32_t, std::vector<const TraceEvent *>> threads;
+  for (const auto &e : events) {
+    threads[e.thread].push_back(&e);
+  }
+  for (auto &t : threads) {
+    auto &list = t.second;
+    std::stable_sort(list.begin(), list.end(), [](const TraceEvent *a, const TraceEvent *b) {
+      return a->start_ns + a->duration_ns < b->start_ns + b->duration_ns;
+    });
+    std::vector<uint64_t> launches;
+    uint64_t ops = 0;
+    for (const auto *e : list) {
+      if (std::strcmp(e->category, kMmioCategory) == 0) {
+        ops += e->count;
+      } else if (std::strcmp(e->name, kLaunchSpan) == 0) {
+        launches.push_back(ops);
+        ops = 0;
+      }
+    }
+    if (!launches.empty()) {
+      launches.back() += ops;
+    }
+    for (auto l : launches) {
+      result.mmio_ops_per_launch.Add(static_cast<double>(l));
+    }
+  }
+  return result;
+}
+
+}  // namespace fletcher
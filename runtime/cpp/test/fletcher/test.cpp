@@ -19,12 +19,40 @@
 #include <fletcher_echo.h>
 #include <gtest/gtest.h>
 
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <memory>
 
 #include "fletcher/platform.h"
 #include "fletcher/context.h"
+#include "fletcher/future.h"
+#include "fletcher/kernel.h"
+#include "fletcher/executor.h"
+#include "fletcher/pool.h"
+#include "fletcher/cache.h"
+#include "fletcher/scheduler.h"
+#include "fletcher/sharding.h"
+#include "fletcher/result.h"
+#include "fletcher/table.h"
+#include "fletcher/trace.h"
+#include "fletcher/profiler.h"
+#include "fletcher/numa.h"
+
+/// @brief Create a RecordBatch with a single uint64 column holding the values first, first + 1, ..., first + rows - 1.
+static std::shared_ptr<arrow::RecordBatch> MakeNumberBatch(uint64_t first, int64_t rows) {
+  auto schema = arrow::schema({arrow::field("number", arrow::uint64(), false)});
+  arrow::UInt64Builder builder;
+  for (int64_t i = 0; i < rows; i++) {
+    EXPECT_TRUE(builder.Append(first + i).ok());
+  }
+  std::shared_ptr<arrow::Array> array;
+  EXPECT_TRUE(builder.Finish(&array).ok());
+  return arrow::RecordBatch::Make(schema, rows, {array});
+}
 
 TEST(Platform, NoPlatform) {
   std::shared_ptr<fletcher::Platform> platform;
@@ -56,6 +84,8 @@ TEST(Platform, EchoPlatform) {
   ASSERT_TRUE(platform->ReadMMIO(0, &val).ok());
   uint64_t val64;
   ASSERT_TRUE(platform->ReadMMIO64(0, &val64).ok());
+  ASSERT_TRUE(platform->WriteMMIOBatch({{FLETCHER_REG_SCHEMA, 1}, {FLETCHER_REG_SCHEMA + 1, 2}}).ok());
+  ASSERT_TRUE(platform->WriteMMIOBatch(std::vector<fmmio_t>()).ok());
 
   // Buffers:
   char buffer[128];
@@ -131,3 +161,1305 @@ TEST(Context, ContextFunctions) {
   ASSERT_TRUE(context->Enable().ok());
   ASSERT_TRUE(platform->Terminate().ok());
 }
+
+TEST(Kernel, FutureInvalid) {
+  std::vector<fletcher::KernelFuture> futures(2);
+  size_t index = 0;
+  ASSERT_FALSE(futures[0].valid());
+  ASSERT_FALSE(futures[0].ready());
+  ASSERT_FALSE(futures[0].Wait().ok());
+  ASSERT_FALSE(fletcher::WaitAny(futures, &index).ok());
+  ASSERT_FALSE(fletcher::WaitAll(futures).ok());
+}
+
+TEST(Kernel, WaitAnyMixedQueues) {
+  setenv(FLETCHER_ECHO_DEVICES_ENV, "2", 1);
+  std::vector<std::shared_ptr<fletcher::Platform>> platforms;
+  ASSERT_TRUE(fletcher::Platform::MakeAll("echo", &platforms, false).ok());
+  unsetenv(FLETCHER_ECHO_DEVICES_ENV);
+  ASSERT_EQ(platforms.size(), 2u);
+  std::vector<std::shared_ptr<fletcher::Context>> contexts(2);
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_TRUE(platforms[i]->Init().ok());
+    ASSERT_TRUE(fletcher::Context::Make(&contexts[i], platforms[i]).ok());
+  }
+  fletcher::Kernel idle(contexts[0]);
+  fletcher::Kernel started(contexts[1]);
+
+  // The first future is never resolved until its kernel is started, the second one is resolved by another queue.
+  fletcher::CompletionQueue first_queue;
+  fletcher::CompletionQueue second_queue;
+  std::vector<fletcher::KernelFuture> futures(2);
+  ASSERT_TRUE(first_queue.Submit(&idle, &futures[0]).ok());
+  ASSERT_TRUE(started.Start().ok());
+  ASSERT_TRUE(second_queue.Submit(&started, &futures[1]).ok());
+  size_t index = 0;
+  ASSERT_TRUE(fletcher::WaitAny(futures, &index).ok());
+  ASSERT_EQ(index, 1u);
+  ASSERT_FALSE(futures[0].ready());
+
+  ASSERT_TRUE(idle.Start().ok());
+  ASSERT_TRUE(futures[0].Wait().ok());
+  for (const auto &platform : platforms) {
+    ASSERT_TRUE(platform->Terminate().ok());
+  }
+}
+
+TEST(Kernel, CompletionEvents) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  ASSERT_TRUE(platform->has_completion_events());
+
+  // Nothing was started, so nothing completes.
+  ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  fletcher::Kernel kernel(context);
+  ASSERT_TRUE(kernel.Start().ok());
+  ASSERT_TRUE(kernel.PollUntilDone().ok());
+  ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+
+  // Without a start after a reset, waiting must expire at the deadline.
+  ASSERT_TRUE(kernel.Reset().ok());
+  ASSERT_EQ(kernel.PollUntilDone(fletcher::PollStrategy::Spin(1000)), fletcher::Status::TIMEOUT());
+  ASSERT_TRUE(kernel.poll_stats().timed_out);
+  ASSERT_GE(kernel.poll_stats().seconds, 0.001);
+
+  // A completion event does not resolve a kernel whose status register is not done, e.g. if it belongs to another
+  // instance. Here, the event is left behind by a kernel that was reset.
+  ASSERT_TRUE(kernel.Start().ok());
+  ASSERT_TRUE(kernel.Reset().ok());
+  ASSERT_EQ(kernel.PollUntilDone(fletcher::PollStrategy::Spin(1000)), fletcher::Status::TIMEOUT());
+  ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Kernel, CompletionQueueWaits) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  fletcher::Kernel kernel(context);
+  fletcher::CompletionQueue queue;
+
+  // Let every launch take about 16 ms, by copying 1 MiB to the device before starting the kernel.
+  EchoCostModel model;
+  ASSERT_EQ(echoGetCostModel("none", &model), FLETCHER_STATUS_OK);
+  model.kernel_bytes_per_cycle = 64.0;
+  model.kernel_mhz = 1.0;
+  model.delay = 1;
+  ASSERT_EQ(echoSetCostModel(&model), FLETCHER_STATUS_OK);
+  std::vector<uint8_t> host(1 << 20);
+  da_t device = D_NULLPTR;
+  ASSERT_TRUE(platform->DeviceMalloc(&device, host.size()).ok());
+
+  // The completion thread blocks on completion events, or backs off without them, rather than polling all the time.
+  for (bool events : {true, false}) {
+    kernel.use_completion_events = events;
+    ASSERT_TRUE(platform->CopyHostToDevice(host.data(), device, host.size()).ok());
+    ASSERT_EQ(echoResetStats(), FLETCHER_STATUS_OK);
+    fletcher::KernelFuture future;
+    ASSERT_TRUE(kernel.StartAsync(&future, &queue).ok());
+    ASSERT_TRUE(future.Wait().ok());
+    EchoStats stats;
+    ASSERT_EQ(echoGetStats(&stats), FLETCHER_STATUS_OK);
+    ASSERT_GE(stats.wall_ns, 16000000u);
+    ASSERT_LT(stats.mmio_reads, 100u);
+    if (events) {
+      ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+    }
+  }
+
+  ASSERT_EQ(echoSetCostModel(nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->DeviceFree(device).ok());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Kernel, Watchdog) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 16)).ok());
+  ASSERT_TRUE(context->Enable().ok());
+
+  fletcher::Kernel kernel(context);
+  kernel.watchdog.deadline_usec = 1000;
+  kernel.watchdog.max_retries = 2;
+  ASSERT_TRUE(kernel.SetRange(0, 0, 8).ok());
+  ASSERT_TRUE(kernel.SetArguments({42}).ok());
+
+  // The echo kernel never completes if it is not actually started.
+  auto ctrl_start = kernel.ctrl_start;
+  kernel.ctrl_start = 0;
+  ASSERT_EQ(kernel.Run(), fletcher::Status::TIMEOUT());
+  ASSERT_EQ(kernel.watchdog_stats().launches, 3);
+  ASSERT_EQ(kernel.watchdog_stats().timeouts, 3);
+  ASSERT_EQ(kernel.watchdog_stats().resets, 3);
+  ASSERT_EQ(kernel.watchdog_stats().retries, 2);
+  ASSERT_EQ(kernel.watchdog_stats().failures, 1);
+
+  kernel.ctrl_start = ctrl_start;
+  ASSERT_TRUE(kernel.Run().ok());
+  ASSERT_EQ(kernel.watchdog_stats().launches, 4);
+  ASSERT_EQ(kernel.watchdog_stats().failures, 1);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Trace, Tracer) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  auto &tracer = fletcher::Tracer::Global();
+  tracer.Clear();
+  tracer.Enable();
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 16), fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  fletcher::Kernel kernel(context);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(kernel.Start().ok());
+    ASSERT_TRUE(kernel.PollUntilDone().ok());
+  }
+  tracer.Disable();
+  // Nothing is recorded while tracing is disabled.
+  ASSERT_TRUE(kernel.WriteMetaData().ok());
+
+  auto summary = tracer.Summarize();
+  ASSERT_EQ(summary.spans["Context::Enable"].count, 1);
+  ASSERT_EQ(summary.spans["Kernel::Start"].count, 2);
+  ASSERT_EQ(summary.spans["Kernel::WriteMetaData"].count, 1);
+  ASSERT_EQ(summary.spans["Context::EnableBatch"].bytes, 16 * sizeof(uint64_t));
+  ASSERT_EQ(summary.copy_mbps.count(), 1);
+  ASSERT_EQ(summary.mmio_ops_per_launch.count(), 2);
+  ASSERT_EQ(summary.dropped, 0);
+
+  std::stringstream json;
+  ASSERT_TRUE(tracer.ExportChromeTrace(&json).ok());
+  ASSERT_NE(json.str().find("\"name\":\"Kernel::Start\""), std::string::npos);
+  ASSERT_NE(json.str().find("\"ph\":\"X\""), std::string::npos);
+  tracer.Clear();
+  ASSERT_TRUE(tracer.Collect().empty());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Profiler, StreamProfiler) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  // A profiled number field results in one stream, a profiled string field in a length and a character stream.
+  auto numbers = MakeNumberBatch(0, 16);
+  arrow::StringBuilder builder;
+  for (int i = 0; i < 16; i++) {
+    ASSERT_TRUE(builder.Append("fletcher").ok());
+  }
+  std::shared_ptr<arrow::Array> strings;
+  ASSERT_TRUE(builder.Finish(&strings).ok());
+  auto schema = arrow::schema({fletcher::WithMetaProfile(*numbers->schema()->field(0)),
+                               fletcher::WithMetaProfile(*arrow::field("str", arrow::utf8(), false)),
+                               arrow::field("other", arrow::uint64(), false)});
+  schema = fletcher::WithMetaRequired(*schema, "Batch", fletcher::Mode::READ);
+  auto batch = arrow::RecordBatch::Make(schema, 16, {numbers->column(0), strings, numbers->column(0)});
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  std::shared_ptr<fletcher::StreamProfiler> profiler;
+  ASSERT_FALSE(fletcher::StreamProfiler::Make(&profiler, *context).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(batch).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_TRUE(fletcher::StreamProfiler::Make(&profiler, *context, 2).ok());
+  ASSERT_EQ(profiler->streams(), std::vector<std::string>({"Batch_number_0", "Batch_str_0", "Batch_str_1"}));
+  ASSERT_EQ(profiler->base(), FLETCHER_REG_SCHEMA + 2 * 1 + 2 * 4 + 2);
+
+  // The echo platform reads zero counters.
+  fletcher::Kernel kernel(context);
+  std::vector<fletcher::StreamProfile> profiles;
+  ASSERT_TRUE(profiler->Profile(&kernel, &profiles).ok());
+  ASSERT_EQ(profiles.size(), 3);
+  ASSERT_EQ(profiles[0].utilization(), 0.0);
+
+  profiles[1].cycles = 100;
+  profiles[1].transfers = 80;
+  profiles[1].valids = 90;
+  profiles[1].readies = 85;
+  ASSERT_DOUBLE_EQ(profiles[1].backpressure(), 0.1);
+  ASSERT_DOUBLE_EQ(profiles[1].starvation(), 0.05);
+  auto json = fletcher::StreamProfiler::ToJSON(profiles);
+  ASSERT_NE(json.find("\"bottleneck\":\"Batch_str_0\""), std::string::npos);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+/// @brief A software kernel for the echo platform that sums the range of a single uint64 column.
+static fstatus_t SumKernel(uint32_t *registers, size_t num_registers, void *user_data) {
+  auto first = registers[FLETCHER_REG_SCHEMA];
+  auto last = registers[FLETCHER_REG_SCHEMA + 1];
+  dau_t address;
+  address.lo = registers[FLETCHER_REG_SCHEMA + 2];
+  address.hi = registers[FLETCHER_REG_SCHEMA + 3];
+  auto values = reinterpret_cast<const uint64_t *>(address.full);
+  uint64_t sum = 0;
+  for (auto i = first; i < last; i++) {
+    sum += values[i];
+  }
+  registers[FLETCHER_REG_RETURN0] = static_cast<uint32_t>(sum);
+  registers[FLETCHER_REG_RETURN1] = static_cast<uint32_t>(sum >> 32u);
+  (*static_cast<int *>(user_data))++;
+  return FLETCHER_STATUS_OK;
+}
+
+TEST(Kernel, EchoSoftwareKernel) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  int invocations = 0;
+  ASSERT_EQ(echoSetKernel(SumKernel, &invocations), FLETCHER_STATUS_OK);
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(1, 100)).ok());
+  ASSERT_TRUE(context->Enable().ok());
+
+  // Poll the status register of the register file.
+  fletcher::Kernel kernel(context);
+  kernel.use_completion_events = false;
+  uint32_t ret0 = 0;
+  uint32_t ret1 = 0;
+  ASSERT_TRUE(kernel.Start().ok());
+  ASSERT_TRUE(kernel.PollUntilDone().ok());
+  ASSERT_TRUE(kernel.GetReturn(&ret0, &ret1).ok());
+  ASSERT_EQ(ret0, 5050);
+  ASSERT_EQ(ret1, 0);
+
+  // Wait for the completion event of a sub-range.
+  kernel.use_completion_events = true;
+  ASSERT_TRUE(kernel.SetRange(0, 0, 10).ok());
+  ASSERT_TRUE(kernel.Run().ok());
+  ASSERT_TRUE(kernel.GetReturn(&ret0).ok());
+  ASSERT_EQ(ret0, 55);
+  ASSERT_EQ(invocations, 2);
+
+  // A reset clears the return registers.
+  ASSERT_TRUE(kernel.Reset().ok());
+  ASSERT_TRUE(kernel.GetReturn(&ret0).ok());
+  ASSERT_EQ(ret0, 0);
+  ASSERT_EQ(echoSetKernel(nullptr, nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Kernel, SequentialKernels) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  int invocations = 0;
+  ASSERT_EQ(echoSetKernel(SumKernel, &invocations), FLETCHER_STATUS_OK);
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(1, 100)).ok());
+  ASSERT_TRUE(context->Enable().ok());
+
+  // Two kernels of the same hardware run one after the other on a single thread, without reading their return values
+  // in between, which would block forever if a finished run kept its reservation.
+  for (bool events : {true, false}) {
+    fletcher::Kernel first(context);
+    fletcher::Kernel second(context);
+    first.use_completion_events = events;
+    second.use_completion_events = events;
+    ASSERT_TRUE(first.WriteMetaData().ok());
+    ASSERT_TRUE(first.SetRange(0, 0, 10).ok());
+    ASSERT_TRUE(first.Start().ok());
+    ASSERT_TRUE(first.PollUntilDone().ok());
+    ASSERT_TRUE(second.WriteMetaData().ok());
+    ASSERT_TRUE(second.SetRange(0, 10, 20).ok());
+    ASSERT_TRUE(second.Start().ok());
+    ASSERT_TRUE(second.PollUntilDone().ok());
+
+    // Both kernels return the values of their own run.
+    uint32_t ret0 = 0;
+    ASSERT_TRUE(first.GetReturn(&ret0).ok());
+    ASSERT_EQ(ret0, 55);
+    ASSERT_TRUE(second.GetReturn(&ret0).ok());
+    ASSERT_EQ(ret0, 155);
+
+    // Both kernels are programmed before either is started, so the first one restores its registers when started.
+    ASSERT_TRUE(first.WriteMetaData().ok());
+    ASSERT_TRUE(first.SetRange(0, 0, 10).ok());
+    ASSERT_TRUE(second.WriteMetaData().ok());
+    ASSERT_TRUE(second.SetRange(0, 10, 20).ok());
+    ASSERT_TRUE(first.Start().ok());
+    ASSERT_TRUE(first.PollUntilDone().ok());
+    ASSERT_TRUE(second.Start().ok());
+    ASSERT_TRUE(second.PollUntilDone().ok());
+    ASSERT_TRUE(first.GetReturn(&ret0).ok());
+    ASSERT_EQ(ret0, 55);
+    ASSERT_TRUE(second.GetReturn(&ret0).ok());
+    ASSERT_EQ(ret0, 155);
+  }
+  ASSERT_EQ(invocations, 8);
+  ASSERT_EQ(echoSetKernel(nullptr, nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Platform, EchoCostModel) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  EchoCostModel model;
+  ASSERT_EQ(echoGetCostModel("bogus", &model), FLETCHER_STATUS_ERROR);
+  ASSERT_EQ(echoGetCostModel("f1", &model), FLETCHER_STATUS_OK);
+  ASSERT_EQ(model.delay, 0);
+  ASSERT_EQ(echoSetCostModel(&model), FLETCHER_STATUS_OK);
+  ASSERT_EQ(echoResetStats(), FLETCHER_STATUS_OK);
+
+  // A copy pays the set-up cost and its size at the DMA bandwidth.
+  std::vector<uint8_t> host(1 << 20);
+  da_t device = D_NULLPTR;
+  ASSERT_TRUE(platform->DeviceMalloc(&device, host.size()).ok());
+  ASSERT_TRUE(platform->CopyHostToDevice(host.data(), device, host.size()).ok());
+  std::vector<fmmio_t> writes = {{FLETCHER_REG_RETURN0, 1}, {FLETCHER_REG_RETURN1, 2}};
+  ASSERT_TRUE(platform->WriteMMIOBatch(writes).ok());
+  uint32_t value = 0;
+  ASSERT_TRUE(platform->ReadMMIO(FLETCHER_REG_RETURN1, &value).ok());
+  ASSERT_EQ(value, 2);
+
+  EchoStats stats;
+  ASSERT_EQ(echoGetStats(&stats), FLETCHER_STATUS_OK);
+  ASSERT_EQ(stats.dma_transfers, 1);
+  ASSERT_EQ(stats.dma_bytes, host.size());
+  ASSERT_EQ(stats.dma_ns, model.dma_setup_ns + static_cast<uint64_t>(host.size() / model.dma_gbps));
+  ASSERT_EQ(stats.mmio_writes, 2);
+  ASSERT_EQ(stats.mmio_reads, 1);
+  // A batch of writes pays the write latency once.
+  ASSERT_EQ(stats.mmio_ns, model.mmio_write_ns + model.mmio_read_ns);
+
+  // With delays, the kernel completes after processing all bytes copied since it was last started.
+  ASSERT_EQ(echoGetCostModel("f1:delay", &model), FLETCHER_STATUS_OK);
+  ASSERT_EQ(model.delay, 1);
+  model.kernel_mhz = 1.0;
+  ASSERT_EQ(echoSetCostModel(&model), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->CopyHostToDevice(host.data(), device, host.size()).ok());
+  ASSERT_TRUE(platform->WriteMMIO(FLETCHER_REG_CONTROL, 1u << FLETCHER_REG_CONTROL_START).ok());
+  ASSERT_TRUE(platform->ReadMMIO(FLETCHER_REG_STATUS, &value).ok());
+  ASSERT_EQ(value, 1u << FLETCHER_REG_STATUS_BUSY);
+  ASSERT_TRUE(platform->WaitForCompletion(1000000).ok());
+  ASSERT_TRUE(platform->ReadMMIO(FLETCHER_REG_STATUS, &value).ok());
+  ASSERT_EQ(value, 1u << FLETCHER_REG_STATUS_DONE);
+  ASSERT_EQ(echoGetStats(&stats), FLETCHER_STATUS_OK);
+  ASSERT_EQ(stats.kernel_launches, 1);
+  ASSERT_EQ(stats.kernel_ns, static_cast<uint64_t>(2 * host.size() / model.kernel_bytes_per_cycle * 1000));
+  ASSERT_GE(stats.wall_ns, stats.kernel_ns);
+
+  ASSERT_EQ(echoSetCostModel(nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->DeviceFree(device).ok());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Executor, StreamExecutor) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+  for (int i = 0; i < 5; i++) {
+    batches.push_back(MakeNumberBatch(i * 16, 16));
+  }
+
+  std::shared_ptr<fletcher::StreamExecutor> executor;
+  ASSERT_TRUE(fletcher::StreamExecutor::Make(&executor, platform, 2, fletcher::MemType::CACHE).ok());
+  std::vector<size_t> order;
+  ASSERT_TRUE(executor->Run(batches, [&order](size_t i, uint32_t, uint32_t) -> fletcher::Status {
+    order.push_back(i);
+    return fletcher::Status::OK();
+  }).ok());
+  ASSERT_EQ(order, std::vector<size_t>({0, 1, 2, 3, 4}));
+  ASSERT_EQ(executor->stats().batches, 5);
+  ASSERT_EQ(executor->stats().bytes, 5 * 16 * sizeof(uint64_t));
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Executor, TableExecutor) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  // A table of three RecordBatches of 100 rows of 8 bytes each.
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+  for (int i = 0; i < 3; i++) {
+    batches.push_back(MakeNumberBatch(i * 100, 100));
+  }
+  std::shared_ptr<arrow::Table> table;
+  ASSERT_TRUE(arrow::Table::FromRecordBatches(batches).Value(&table).ok());
+
+  // Allow 32 rows per chunk.
+  std::shared_ptr<fletcher::TableExecutor> executor;
+  ASSERT_FALSE(fletcher::TableExecutor::Make(&executor, platform, 1, 2).ok());
+  ASSERT_TRUE(fletcher::TableExecutor::Make(&executor, platform, 2 * 32 * sizeof(uint64_t)).ok());
+
+  // Count the chunks through the reduction, the echo kernel returns zero.
+  uint64_t result = 0;
+  ASSERT_TRUE(executor->Run(*table, [](uint64_t acc, uint64_t value) { return acc + value + 1; }, 0, &result).ok());
+  ASSERT_EQ(result, 12);
+  ASSERT_EQ(executor->stats().chunks, 12);
+  ASSERT_EQ(executor->stats().rows, 300);
+  ASSERT_LE(executor->stats().max_chunk_bytes, 32 * sizeof(uint64_t));
+
+  // Chunks of variable-length columns only hold their own values.
+  arrow::StringBuilder builder;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(builder.Append(std::string(i % 10, 'x')).ok());
+  }
+  std::shared_ptr<arrow::Array> strings;
+  ASSERT_TRUE(builder.Finish(&strings).ok());
+  auto string_schema = arrow::schema({arrow::field("str", arrow::utf8(), false)});
+  auto string_batch = arrow::RecordBatch::Make(string_schema, 100, {strings});
+  ASSERT_TRUE(arrow::Table::FromRecordBatches({string_batch}).Value(&table).ok());
+  ASSERT_TRUE(fletcher::TableExecutor::Make(&executor, platform, 2 * 256).ok());
+  ASSERT_TRUE(executor->Run(*table, [](uint64_t acc, uint64_t) { return acc; }, 0, &result).ok());
+  ASSERT_GT(executor->stats().chunks, 1);
+  ASSERT_EQ(executor->stats().rows, 100);
+  ASSERT_LE(executor->stats().max_chunk_bytes, 256);
+
+  // A budget below the size of a single row cannot be met.
+  ASSERT_TRUE(fletcher::TableExecutor::Make(&executor, platform, 8).ok());
+  ASSERT_FALSE(executor->Run(*table, [](uint64_t acc, uint64_t) { return acc; }, 0, &result).ok());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, ClearRetainsAllocations) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 16), fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  auto address = context->device_buffer(0).device_address;
+
+  // A smaller batch fits in the retained allocation.
+  context->Clear();
+  auto batch = MakeNumberBatch(42, 8);
+  ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->device_buffer(0).device_address, address);
+  ASSERT_EQ(reinterpret_cast<uint64_t *>(address)[0], 42);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, PackedUpload) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  auto schema = arrow::schema({arrow::field("number", arrow::uint64(), true),
+                               arrow::field("text", arrow::utf8(), false)});
+  arrow::UInt64Builder numbers;
+  arrow::StringBuilder strings;
+  ASSERT_TRUE(numbers.AppendValues({1, 2, 3}, {true, false, true}).ok());
+  ASSERT_TRUE(strings.AppendValues({"packed", "upload", "test"}).ok());
+  std::shared_ptr<arrow::Array> a;
+  std::shared_ptr<arrow::Array> b;
+  ASSERT_TRUE(numbers.Finish(&a).ok());
+  ASSERT_TRUE(strings.Finish(&b).ok());
+  auto batch = arrow::RecordBatch::Make(schema, 3, {a, b});
+
+  // Count the allocations through a pool.
+  std::shared_ptr<fletcher::DeviceMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceMemoryPool::Make(&pool, platform).ok());
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  context->set_memory_pool(pool);
+  context->set_upload_mode(fletcher::UploadMode::PACKED, 64);
+  ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(pool->stats().total_allocations, 1);
+
+  ASSERT_EQ(context->num_buffers(), 4);
+  for (size_t i = 0; i < context->num_buffers(); i++) {
+    auto buf = context->device_buffer(i);
+    ASSERT_EQ(buf.device_address % 64, 0);
+    ASSERT_EQ(buf.was_alloced, i == 0);
+    ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+  }
+
+  // Buffers that exceed the maximum transfer size are split over multiple copies.
+  fcaps_t caps;
+  ASSERT_TRUE(platform->GetCapabilities(&caps).ok());
+  caps.max_transfer_size = 16;
+  ASSERT_EQ(echoSetCapabilities(&caps), FLETCHER_STATUS_OK);
+  context->Clear();
+  ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  for (size_t i = 0; i < context->num_buffers(); i++) {
+    auto buf = context->device_buffer(i);
+    ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+  }
+
+  // Split copies start at an aligned address, also if the maximum transfer size is not a multiple of the alignment.
+  caps.max_transfer_size = 1000;
+  caps.dma_alignment = 64;
+  ASSERT_EQ(echoSetCapabilities(&caps), FLETCHER_STATUS_OK);
+  context->Clear();
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 300), fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  auto buf = context->device_buffer(0);
+  ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+  ASSERT_EQ(echoSetCapabilities(nullptr), FLETCHER_STATUS_OK);
+  context.reset();
+  ASSERT_EQ(pool->stats().num_allocations, 0);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, AutoUpload) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  ASSERT_TRUE(platform->has_capabilities());
+  fcaps_t caps;
+  ASSERT_TRUE(platform->GetCapabilities(&caps).ok());
+  ASSERT_EQ(caps.size, sizeof(fcaps_t));
+  ASSERT_EQ(caps.max_transfer_size, 0);
+
+  // Without transfer limits, a cached RecordBatch is packed into a single transfer.
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  context->set_upload_mode(fletcher::UploadMode::AUTO);
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 1000), fletcher::MemType::CACHE).ok());
+  EchoStats stats;
+  ASSERT_EQ(echoResetStats(), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(echoGetStats(&stats), FLETCHER_STATUS_OK);
+  ASSERT_EQ(stats.dma_transfers, 1);
+
+  // A RecordBatch exceeding the maximum transfer size is copied in chunks.
+  caps.max_transfer_size = 1000;
+  caps.dma_alignment = 64;
+  ASSERT_EQ(echoSetCapabilities(&caps), FLETCHER_STATUS_OK);
+  context->Clear();
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 1000), fletcher::MemType::CACHE).ok());
+  ASSERT_EQ(echoResetStats(), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->chunk_size(), 960);
+  ASSERT_EQ(echoGetStats(&stats), FLETCHER_STATUS_OK);
+  ASSERT_EQ(stats.dma_transfers, 9);
+  auto buf = context->device_buffer(0);
+  ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+
+  ASSERT_EQ(echoSetCapabilities(nullptr), FLETCHER_STATUS_OK);
+  context.reset();
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, FailedUpload) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  fcaps_t caps;
+  ASSERT_TRUE(platform->GetCapabilities(&caps).ok());
+  caps.max_transfer_size = 16;
+  ASSERT_EQ(echoSetCapabilities(&caps), FLETCHER_STATUS_OK);
+
+  // The platform copies whole buffers when preparing or caching them, which exceeds the maximum transfer size. The
+  // allocations made before the copy failed are freed.
+  for (auto type : {fletcher::MemType::ANY, fletcher::MemType::CACHE}) {
+    std::shared_ptr<fletcher::Context> context;
+    ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+    context->set_upload_mode(fletcher::UploadMode::PER_BUFFER);
+    ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 8), type).ok());
+    ASSERT_FALSE(context->Enable().ok());
+    ASSERT_EQ(context->num_buffers(), 1);
+    ASSERT_FALSE(context->enabled());
+  }
+  ASSERT_EQ(echoSetCapabilities(nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, IncrementalEnable) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::shared_ptr<fletcher::DeviceMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceMemoryPool::Make(&pool, platform).ok());
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  context->set_memory_pool(pool);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(i * 16, 16), fletcher::MemType::CACHE).ok());
+  }
+  ASSERT_TRUE(context->Enable().ok());
+  auto first = context->device_buffer(0).device_address;
+  auto last = context->device_buffer(2).device_address;
+  ASSERT_EQ(pool->stats().total_allocations, 3);
+
+  // A replacement must have the buffer layout the registers of the kernel were written for.
+  auto renamed = arrow::RecordBatch::Make(arrow::schema({arrow::field("other", arrow::uint64(), false)}),
+                                          16,
+                                          MakeNumberBatch(0, 16)->columns());
+  ASSERT_FALSE(context->ReplaceRecordBatch(1, renamed, fletcher::MemType::CACHE).ok());
+  ASSERT_EQ(pool->stats().num_allocations, 3);
+
+  // Replacing a RecordBatch frees its buffer immediately, and re-enabling only prepares the new one.
+  ASSERT_TRUE(context->ReplaceRecordBatch(1, MakeNumberBatch(100, 32), fletcher::MemType::CACHE).ok());
+  ASSERT_EQ(pool->stats().num_allocations, 2);
+  ASSERT_FALSE(context->enabled());
+  {
+    // A kernel cannot be programmed before the replacement has device buffers.
+    fletcher::Kernel kernel(context);
+    ASSERT_FALSE(kernel.WriteMetaData().ok());
+    ASSERT_FALSE(kernel.Start().ok());
+  }
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_TRUE(context->enabled());
+  ASSERT_EQ(pool->stats().total_allocations, 4);
+  ASSERT_EQ(context->device_buffer(0).device_address, first);
+  ASSERT_EQ(context->device_buffer(2).device_address, last);
+  auto replaced = context->device_buffer(1);
+  ASSERT_EQ(replaced.size, 32 * sizeof(uint64_t));
+  ASSERT_EQ(reinterpret_cast<const uint64_t *>(replaced.device_address)[0], 100);
+  {
+    fletcher::Kernel kernel(context);
+    ASSERT_TRUE(kernel.Start().ok());
+    ASSERT_TRUE(kernel.PollUntilDone().ok());
+  }
+
+  // Removing a RecordBatch shifts the subsequent ones.
+  ASSERT_TRUE(context->Remove(0).ok());
+  ASSERT_EQ(pool->stats().num_allocations, 2);
+  ASSERT_EQ(context->num_recordbatches(), 2);
+  ASSERT_EQ(context->device_buffer(0).device_address, replaced.device_address);
+  ASSERT_EQ(context->device_buffer(1).device_address, last);
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(pool->stats().total_allocations, 4);
+  ASSERT_FALSE(context->Remove(2).ok());
+  context.reset();
+  ASSERT_EQ(pool->stats().num_allocations, 0);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Kernel, ShadowRegisters) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  platform->set_shadow_registers(true);
+
+  // Writing the same value twice only issues one write, the control register is never shadowed.
+  ASSERT_TRUE(platform->WriteMMIO(FLETCHER_REG_SCHEMA, 42).ok());
+  ASSERT_TRUE(platform->WriteMMIO(FLETCHER_REG_SCHEMA, 42).ok());
+  ASSERT_TRUE(platform->WriteMMIO(FLETCHER_REG_CONTROL, 0).ok());
+  ASSERT_TRUE(platform->WriteMMIO(FLETCHER_REG_CONTROL, 0).ok());
+  ASSERT_EQ(platform->mmio_stats().writes_issued, 3);
+  ASSERT_EQ(platform->mmio_stats().writes_elided, 1);
+
+  // Two contexts with batches of the same length only differ in their buffer addresses.
+  std::shared_ptr<fletcher::Context> a;
+  std::shared_ptr<fletcher::Context> b;
+  ASSERT_TRUE(fletcher::Context::Make(&a, platform).ok());
+  ASSERT_TRUE(fletcher::Context::Make(&b, platform).ok());
+  ASSERT_TRUE(a->QueueRecordBatch(MakeNumberBatch(0, 16), fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(b->QueueRecordBatch(MakeNumberBatch(16, 16), fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(a->Enable().ok());
+  ASSERT_TRUE(b->Enable().ok());
+
+  fletcher::Kernel kernel(a);
+  ASSERT_TRUE(kernel.WriteMetaData().ok());
+  auto before = platform->mmio_stats();
+  ASSERT_TRUE(kernel.Rebind(b).ok());
+  auto after = platform->mmio_stats();
+  ASSERT_GE(after.writes_elided - before.writes_elided, 2);
+  ASSERT_LE(after.writes_issued - before.writes_issued, 2);
+
+  // Starting the kernel does not rewrite metadata of an unchanged context.
+  ASSERT_TRUE(kernel.Start().ok());
+  ASSERT_EQ(platform->mmio_stats().writes_elided, after.writes_elided);
+  ASSERT_TRUE(kernel.WaitForCompletionEvent().ok());
+
+  // Neither is the control register of a kernel instance at another MMIO base.
+  fletcher::Kernel instance(a);
+  instance.mmio_base = 64;
+  ASSERT_TRUE(instance.Start().ok());
+  auto issued = platform->mmio_stats().writes_issued;
+  ASSERT_TRUE(platform->WriteMMIO(instance.mmio_base + FLETCHER_REG_CONTROL, 0).ok());
+  ASSERT_EQ(platform->mmio_stats().writes_issued, issued + 1);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Scheduler, KernelScheduler) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 100)).ok());
+  ASSERT_TRUE(context->Enable().ok());
+
+  std::shared_ptr<fletcher::KernelScheduler> scheduler;
+  ASSERT_FALSE(fletcher::KernelScheduler::Make(&scheduler, context, {}).ok());
+  ASSERT_TRUE(fletcher::KernelScheduler::Make(&scheduler, context, {0}, 16).ok());
+
+  // Count the chunks through the reduction, the echo kernel returns zero.
+  uint64_t result = 0;
+  ASSERT_TRUE(scheduler->Run(0, [](uint64_t acc, uint64_t value) { return acc + value + 1; }, 0, &result).ok());
+  ASSERT_EQ(result, 7);
+  ASSERT_EQ(scheduler->stats().chunks, 7);
+  ASSERT_EQ(scheduler->stats().chunks_per_instance[0], 7);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+/// @brief A SumKernel that completes after the number of microseconds in its first argument register.
+static fstatus_t SlowSumKernel(uint32_t *registers, size_t num_registers, void *user_data) {
+  // One RecordBatch with one buffer precede the arguments.
+  echoSetKernelDuration(static_cast<uint64_t>(registers[FLETCHER_REG_SCHEMA + 4]) * 1000);
+  return SumKernel(registers, num_registers, user_data);
+}
+
+TEST(Scheduler, ReplicatedInstances) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  int invocations = 0;
+  ASSERT_EQ(echoSetKernel(SlowSumKernel, &invocations), FLETCHER_STATUS_OK);
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 100)).ok());
+  ASSERT_TRUE(context->Enable().ok());
+
+  const uint64_t window = FLETCHER_ECHO_INSTANCE_REGISTERS;
+  for (bool events : {true, false}) {
+    invocations = 0;
+    std::shared_ptr<fletcher::KernelScheduler> scheduler;
+    ASSERT_TRUE(fletcher::KernelScheduler::Make(&scheduler, context, {0, window}, 8).ok());
+    scheduler->use_completion_events = events;
+    // The second instance is slow, so the first one steals the remaining chunks.
+    ASSERT_TRUE(scheduler->instances()[0]->SetArguments({0}).ok());
+    ASSERT_TRUE(scheduler->instances()[1]->SetArguments({5000}).ok());
+    uint64_t result = 0;
+    ASSERT_TRUE(scheduler->Run(0, [](uint64_t acc, uint64_t value) { return acc + value; }, 0, &result).ok());
+    ASSERT_EQ(result, 4950);
+    ASSERT_EQ(invocations, 13);
+    ASSERT_EQ(scheduler->stats().chunks, 13);
+    auto per_instance = scheduler->stats().chunks_per_instance;
+    ASSERT_EQ(per_instance[0] + per_instance[1], 13);
+    ASSERT_GE(per_instance[1], 1);
+    ASSERT_GT(per_instance[0], per_instance[1]);
+  }
+
+  // A run that misses its deadline resets the running instance and releases all instances.
+  for (bool events : {true, false}) {
+    std::shared_ptr<fletcher::KernelScheduler> scheduler;
+    ASSERT_TRUE(fletcher::KernelScheduler::Make(&scheduler, context, {0, window}, 8).ok());
+    scheduler->use_completion_events = events;
+    scheduler->poll_strategy.timeout_usec = 2000;
+    ASSERT_TRUE(scheduler->instances()[0]->SetArguments({0}).ok());
+    ASSERT_TRUE(scheduler->instances()[1]->SetArguments({1000000}).ok());
+    uint64_t result = 0;
+    ASSERT_EQ(scheduler->Run(0, [](uint64_t acc, uint64_t value) { return acc + value; }, 0, &result),
+              fletcher::Status::TIMEOUT());
+    uint32_t status = 0;
+    ASSERT_TRUE(platform->ReadMMIO(window + FLETCHER_REG_STATUS, &status).ok());
+    ASSERT_EQ(status, 1u << FLETCHER_REG_STATUS_IDLE);
+
+    // Another kernel of the same hardware is not blocked by the scheduler.
+    fletcher::Kernel kernel(context);
+    kernel.mmio_base = window;
+    ASSERT_TRUE(kernel.SetArguments({0}).ok());
+    ASSERT_TRUE(kernel.SetRange(0, 0, 100).ok());
+    ASSERT_TRUE(kernel.Start().ok());
+    ASSERT_TRUE(kernel.PollUntilDone().ok());
+    uint32_t ret0 = 0;
+    ASSERT_TRUE(kernel.GetReturn(&ret0).ok());
+    ASSERT_EQ(ret0, 4950);
+  }
+
+  // With fewer chunks than instances, the spare instance is not left reserved.
+  std::shared_ptr<fletcher::Context> small;
+  ASSERT_TRUE(fletcher::Context::Make(&small, platform).ok());
+  ASSERT_TRUE(small->QueueRecordBatch(MakeNumberBatch(0, 8)).ok());
+  ASSERT_TRUE(small->Enable().ok());
+  std::shared_ptr<fletcher::KernelScheduler> scheduler;
+  ASSERT_TRUE(fletcher::KernelScheduler::Make(&scheduler, small, {0, window}, 16).ok());
+  uint64_t result = 0;
+  ASSERT_TRUE(scheduler->Run(0, [](uint64_t acc, uint64_t value) { return acc + value; }, 0, &result).ok());
+  ASSERT_EQ(result, 28);
+  ASSERT_EQ(scheduler->stats().chunks_per_instance, std::vector<size_t>({1, 0}));
+  fletcher::Kernel spare(small);
+  spare.mmio_base = window;
+  ASSERT_TRUE(spare.SetArguments({0}).ok());
+  ASSERT_TRUE(spare.Start().ok());
+  ASSERT_TRUE(spare.PollUntilDone().ok());
+  uint32_t ret0 = 0;
+  ASSERT_TRUE(spare.GetReturn(&ret0).ok());
+  ASSERT_EQ(ret0, 28);
+  ASSERT_EQ(echoSetKernel(nullptr, nullptr), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Sharding, ShardedContext) {
+  // Let the echo platform expose three devices.
+  setenv(FLETCHER_ECHO_DEVICES_ENV, "3", 1);
+  std::vector<std::shared_ptr<fletcher::Platform>> platforms;
+  ASSERT_TRUE(fletcher::Platform::MakeAll("echo", &platforms, false).ok());
+  unsetenv(FLETCHER_ECHO_DEVICES_ENV);
+  ASSERT_EQ(platforms.size(), 3);
+  for (size_t i = 0; i < platforms.size(); i++) {
+    ASSERT_EQ(platforms[i]->device(), i);
+    ASSERT_TRUE(platforms[i]->Init().ok());
+  }
+
+  std::shared_ptr<fletcher::ShardedContext> sharded;
+  ASSERT_TRUE(fletcher::ShardedContext::Make(&sharded, platforms).ok());
+  ASSERT_EQ(sharded->num_shards(), 3);
+  // Equally sized batches are spread evenly.
+  for (int i = 0; i < 6; i++) {
+    size_t shard;
+    ASSERT_TRUE(sharded->QueueRecordBatch(MakeNumberBatch(16 * i, 16), fletcher::MemType::ANY, &shard).ok());
+    ASSERT_EQ(shard, i % 3);
+  }
+  ASSERT_TRUE(sharded->Enable().ok());
+  std::vector<uint64_t> returns;
+  ASSERT_TRUE(sharded->Run(&returns).ok());
+  ASSERT_EQ(returns.size(), 3);
+
+  // Every device signalled its own completion, so none is left pending.
+  for (const auto &platform : platforms) {
+    ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+    ASSERT_TRUE(platform->Terminate().ok());
+  }
+}
+
+TEST(Threading, ConcurrentSessions) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  InitOptions opts = {1};
+  platform->init_data = &opts;
+  ASSERT_TRUE(platform->Init().ok());
+  std::shared_ptr<fletcher::DeviceMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceMemoryPool::Make(&pool, platform, 1024 * 1024).ok());
+
+  // Every thread runs its own sessions with its own Context and Kernel against the same Platform.
+  const int num_threads = 8;
+  const int num_sessions = 16;
+  std::vector<int> failures(num_threads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int s = 0; s < num_sessions; s++) {
+        auto context = std::make_shared<fletcher::Context>(platform);
+        context->set_memory_pool(pool);
+        fletcher::Kernel kernel(context);
+        auto batch = MakeNumberBatch(t * 1000 + s, 32);
+        bool ok = context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok() && context->Enable().ok();
+        ok = ok && (reinterpret_cast<uint64_t *>(context->device_buffer(0).device_address)[0] == static_cast<uint64_t>(t * 1000 + s));
+        fletcher::KernelFuture future;
+        uint32_t ret0 = 0;
+        // Alternate between synchronous and asynchronous launches.
+        if (s % 2 == 0) {
+          ok = ok && kernel.Start().ok() && kernel.PollUntilDone().ok() && kernel.GetReturn(&ret0).ok();
+        } else {
+          ok = ok && kernel.StartAsync(&future).ok() && future.Get(&ret0).ok();
+        }
+        if (!ok) failures[t]++;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(failures, std::vector<int>(num_threads, 0));
+  ASSERT_EQ(pool->stats().num_allocations, 0);
+  ASSERT_EQ(platform->WaitForCompletion(0), fletcher::Status::TIMEOUT());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Pool, DeviceMemoryPool) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  std::shared_ptr<fletcher::DeviceMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceMemoryPool::Make(&pool, platform, 4096, 64).ok());
+
+  da_t a, b, c, d;
+  ASSERT_TRUE(pool->Allocate(&a, 1).ok());
+  ASSERT_TRUE(pool->Allocate(&b, 100).ok());
+  ASSERT_TRUE(pool->Allocate(&c, 1000).ok());
+  ASSERT_EQ(a % 64, 0);
+  ASSERT_EQ(b % 64, 0);
+  ASSERT_EQ(c % 64, 0);
+  ASSERT_EQ(pool->stats().num_regions, 1);
+  ASSERT_EQ(pool->stats().bytes_in_use, 64 + 128 + 1024);
+
+  // Larger than a region gets a dedicated allocation.
+  ASSERT_TRUE(pool->Allocate(&d, 8192).ok());
+  ASSERT_EQ(pool->stats().num_regions, 2);
+  ASSERT_TRUE(pool->Free(d).ok());
+
+  // Freeing everything merges all buddies back into a single region-sized block.
+  ASSERT_TRUE(pool->Free(a).ok());
+  ASSERT_TRUE(pool->Free(b).ok());
+  ASSERT_TRUE(pool->Free(c).ok());
+  ASSERT_FALSE(pool->Free(c).ok());
+  auto stats = pool->stats();
+  ASSERT_EQ(stats.bytes_in_use, 0);
+  ASSERT_EQ(stats.peak_bytes_in_use, 64 + 128 + 1024 + 8192);
+  ASSERT_EQ(stats.largest_free_block, 4096);
+  ASSERT_EQ(stats.fragmentation(), 0.0);
+  ASSERT_TRUE(pool->Trim().ok());
+  ASSERT_EQ(pool->stats().bytes_reserved, 0);
+
+  // Contexts sharing the pool recycle the same blocks.
+  da_t address;
+  for (int i = 0; i < 2; i++) {
+    std::shared_ptr<fletcher::Context> context;
+    ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+    context->set_memory_pool(pool);
+    ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 16), fletcher::MemType::CACHE).ok());
+    ASSERT_TRUE(context->Enable().ok());
+    if (i == 0) {
+      address = context->device_buffer(0).device_address;
+    } else {
+      ASSERT_EQ(context->device_buffer(0).device_address, address);
+    }
+  }
+  ASSERT_EQ(pool->stats().num_allocations, 0);
+  ASSERT_EQ(pool->stats().total_allocations, 6);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Pool, DeviceVisibleMemoryPool) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  ASSERT_TRUE(platform->has_host_memory());
+
+  std::shared_ptr<fletcher::DeviceVisibleMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceVisibleMemoryPool::Make(&pool, platform).ok());
+  {
+    // Build a RecordBatch directly in device-visible memory.
+    auto schema = arrow::schema({arrow::field("number", arrow::uint64(), false)});
+    arrow::UInt64Builder builder(pool.get());
+    for (uint64_t i = 0; i < 1000; i++) {
+      ASSERT_TRUE(builder.Append(i).ok());
+    }
+    std::shared_ptr<arrow::Array> array;
+    ASSERT_TRUE(builder.Finish(&array).ok());
+    ASSERT_GT(pool->bytes_allocated(), 0);
+    auto batch = arrow::RecordBatch::Make(schema, 1000, {array});
+
+    std::shared_ptr<fletcher::Context> context;
+    ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+    ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::ANY).ok());
+    ASSERT_TRUE(context->QueueRecordBatch(MakeNumberBatch(0, 16), fletcher::MemType::ANY).ok());
+    ASSERT_TRUE(context->Enable().ok());
+
+    // Buffers from the pool are used in place, others are still copied.
+    auto in_place = context->device_buffer(0);
+    ASSERT_TRUE(in_place.zero_copy);
+    ASSERT_FALSE(in_place.was_alloced);
+    ASSERT_EQ(in_place.device_address, reinterpret_cast<da_t>(in_place.host_address));
+    auto copied = context->device_buffer(1);
+    ASSERT_FALSE(copied.zero_copy);
+    ASSERT_TRUE(copied.was_alloced);
+  }
+  ASSERT_EQ(pool->bytes_allocated(), 0);
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Pool, NumaPlacement) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  // The node is unknown unless the platform or the environment reports it.
+  std::shared_ptr<fletcher::NumaPlacement> numa;
+  if (std::getenv(FLETCHER_NUMA_NODE_ENV) == nullptr) {
+    ASSERT_TRUE(fletcher::NumaPlacement::Make(&numa, platform).ok());
+    ASSERT_EQ(numa->node(), fletcher::NumaPlacement::kUnknownNode);
+    ASSERT_FALSE(numa->pin_threads());
+  }
+  fcaps_t caps = {};
+  caps.numa_node_mask = 1;
+  ASSERT_EQ(echoSetCapabilities(&caps), FLETCHER_STATUS_OK);
+  ASSERT_TRUE(fletcher::NumaPlacement::Make(&numa, platform, fletcher::NumaPlacement::kUnknownNode, true, true).ok());
+  if (std::getenv(FLETCHER_NUMA_NODE_ENV) == nullptr) {
+    ASSERT_EQ(numa->node(), 0);
+  }
+  {
+    fletcher::NumaPinScope pin(numa.get());
+    ASSERT_EQ(pin.pinned(), numa->pin_threads());
+  }
+
+  // Allocations are touched on the node of the device.
+  uint8_t *address = nullptr;
+  ASSERT_TRUE(numa->Allocate(&address, 1024 * 1024).ok());
+  std::memset(address, 0xAB, 1024 * 1024);
+  auto node = fletcher::NumaPlacement::NodeOf(address);
+  ASSERT_TRUE((node == numa->node()) || (node == fletcher::NumaPlacement::kUnknownNode));
+  numa->Free(address, 1024 * 1024);
+
+  // Arrow buffers can be built on the node of the device.
+  fletcher::NumaMemoryPool pool(numa);
+  arrow::UInt64Builder builder(&pool);
+  for (uint64_t i = 0; i < 1000; i++) {
+    ASSERT_TRUE(builder.Append(i).ok());
+  }
+  std::shared_ptr<arrow::Array> array;
+  ASSERT_TRUE(builder.Finish(&array).ok());
+  ASSERT_GT(pool.bytes_allocated(), 0);
+
+  // Copies to the device are accounted by node, for every upload mode.
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  context->set_numa(numa);
+  auto batch = arrow::RecordBatch::Make(MakeNumberBatch(0, 0)->schema(), 1000, {array});
+  uint64_t bytes = 0;
+  for (auto mode : {fletcher::UploadMode::PER_BUFFER, fletcher::UploadMode::PACKED}) {
+    context->Clear();
+    context->set_upload_mode(mode);
+    ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok());
+    ASSERT_TRUE(context->Enable().ok());
+    auto buf = context->device_buffer(0);
+    ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+    bytes += buf.size;
+  }
+  uint64_t copied = 0;
+  for (const auto &stats : numa->copy_stats()) {
+    copied += stats.second.bytes;
+  }
+  ASSERT_EQ(copied, bytes);
+
+  ASSERT_EQ(echoSetCapabilities(nullptr), FLETCHER_STATUS_OK);
+  context.reset();
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, RealignBuffers) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+  std::shared_ptr<fletcher::DeviceVisibleMemoryPool> pool;
+  ASSERT_TRUE(fletcher::DeviceVisibleMemoryPool::Make(&pool, platform).ok());
+
+  auto schema = arrow::schema({arrow::field("number", arrow::uint32(), false)});
+  arrow::UInt32Builder builder(pool.get());
+  for (uint32_t i = 0; i < 100; i++) {
+    ASSERT_TRUE(builder.Append(i).ok());
+  }
+  std::shared_ptr<arrow::Array> array;
+  ASSERT_TRUE(builder.Finish(&array).ok());
+  // The values of the slice start 32 bytes into the buffer.
+  auto slice = arrow::RecordBatch::Make(schema, 100, {array})->Slice(8, 50);
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(slice, fletcher::MemType::ANY).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  auto buf = context->device_buffer(0);
+  ASSERT_TRUE(buf.zero_copy);
+  ASSERT_EQ(buf.device_address % 64, 0);
+  ASSERT_NE(buf.device_address, reinterpret_cast<da_t>(buf.host_address));
+  ASSERT_EQ(std::memcmp(reinterpret_cast<void *>(buf.device_address), buf.host_address, buf.size), 0);
+  ASSERT_EQ(context->realign_stats().buffers, 1);
+  ASSERT_EQ(context->realign_stats().bytes, 200);
+  auto staging_bytes = context->realign_stats().staging_bytes;
+  ASSERT_GT(staging_bytes, 0);
+
+  // The staging arena is reused for subsequent RecordBatches.
+  context->Clear();
+  ASSERT_TRUE(context->QueueRecordBatch(slice, fletcher::MemType::ANY).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->realign_stats().buffers, 2);
+  ASSERT_EQ(context->realign_stats().staging_bytes, staging_bytes);
+
+  // With 32-byte bursts, the slice is aligned already.
+  context->Clear();
+  auto narrow = arrow::RecordBatch::Make(fletcher::WithMetaBusSpec(*schema, 64, 256), 50, slice->columns());
+  ASSERT_TRUE(context->QueueRecordBatch(narrow, fletcher::MemType::ANY).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->realign_stats().buffers, 2);
+  ASSERT_EQ(context->device_buffer(0).device_address, reinterpret_cast<da_t>(context->device_buffer(0).host_address));
+
+  context.reset();
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Context, ResultRecordBatch) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  // Prepare worst-case output buffers for 8 strings of at most 16 characters, and 8 numbers.
+  auto schema = fletcher::WithMetaRequired(*arrow::schema({arrow::field("text", arrow::utf8(), false),
+                                                           arrow::field("number", arrow::uint32(), false)}),
+                                           "Results",
+                                           fletcher::Mode::WRITE);
+  std::shared_ptr<arrow::Buffer> offsets = std::move(arrow::AllocateBuffer(9 * sizeof(int32_t))).ValueOrDie();
+  std::shared_ptr<arrow::Buffer> values = std::move(arrow::AllocateBuffer(8 * 16)).ValueOrDie();
+  std::shared_ptr<arrow::Buffer> numbers = std::move(arrow::AllocateBuffer(8 * sizeof(uint32_t))).ValueOrDie();
+  std::memset(offsets->mutable_data(), 0, offsets->size());
+  auto text = std::make_shared<arrow::StringArray>(8, offsets, values);
+  auto number = std::make_shared<arrow::UInt32Array>(8, numbers);
+  auto batch = arrow::RecordBatch::Make(schema, 8, {text, number});
+
+  std::shared_ptr<fletcher::Context> context;
+  ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+  ASSERT_TRUE(context->QueueRecordBatch(batch, fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->device_buffer(0).mode, fletcher::Mode::WRITE);
+
+  // Mimic a kernel that produces three rows.
+  int32_t produced_offsets[] = {0, 5, 5, 11};
+  const char *produced_values = "hellofletch";
+  uint32_t produced_numbers[] = {1, 2, 3};
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(produced_offsets),
+                                         context->device_buffer(0).device_address,
+                                         sizeof(produced_offsets)).ok());
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(const_cast<char *>(produced_values)),
+                                         context->device_buffer(1).device_address,
+                                         11).ok());
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(produced_numbers),
+                                         context->device_buffer(2).device_address,
+                                         sizeof(produced_numbers)).ok());
+
+  std::shared_ptr<fletcher::ResultRecordBatch> result;
+  ASSERT_FALSE(context->GetResultRecordBatch(1, &result).ok());
+  ASSERT_TRUE(context->GetResultRecordBatch(0, &result, 3).ok());
+  ASSERT_EQ(result->bytes_copied(), 0);
+
+  // Only the produced bytes of the accessed column are copied.
+  std::shared_ptr<arrow::Array> column;
+  ASSERT_TRUE(result->GetColumn(1, &column).ok());
+  ASSERT_EQ(result->bytes_copied(), sizeof(produced_numbers));
+  ASSERT_EQ(std::static_pointer_cast<arrow::UInt32Array>(column)->Value(2), 3);
+
+  std::shared_ptr<arrow::RecordBatch> out;
+  ASSERT_TRUE(result->ToRecordBatch(&out).ok());
+  ASSERT_EQ(result->bytes_copied(), sizeof(produced_numbers) + sizeof(produced_offsets) + 11);
+  ASSERT_TRUE(out->ValidateFull().ok());
+  auto strings = std::static_pointer_cast<arrow::StringArray>(out->column(0));
+  ASSERT_EQ(strings->GetString(0), "hello");
+  ASSERT_EQ(strings->GetString(1), "");
+  ASSERT_EQ(strings->GetString(2), "fletch");
+
+  // Results are no longer available once the context changes.
+  ASSERT_TRUE(context->GetResultRecordBatch(0, &result).ok());
+  context->Clear();
+  ASSERT_FALSE(result->GetColumn(0, &column).ok());
+  ASSERT_FALSE(context->GetResultRecordBatch(0, &result).ok());
+
+  // The rows of a sliced RecordBatch start at its first index in the device buffers.
+  auto sliced = arrow::RecordBatch::Make(schema, 16, {std::make_shared<arrow::StringArray>(16, offsets, values),
+                                                      std::make_shared<arrow::UInt32Array>(16, numbers)})->Slice(3, 8);
+  ASSERT_TRUE(context->QueueRecordBatch(sliced, fletcher::MemType::CACHE).ok());
+  ASSERT_TRUE(context->Enable().ok());
+  ASSERT_EQ(context->first_index(0), 3);
+  int32_t sliced_offsets[] = {4, 6, 9};
+  const char *sliced_values = "....abxyz";
+  uint32_t sliced_numbers[] = {7, 8};
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(sliced_offsets),
+                                         context->device_buffer(0).device_address + 3 * sizeof(int32_t),
+                                         sizeof(sliced_offsets)).ok());
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(const_cast<char *>(sliced_values)),
+                                         context->device_buffer(1).device_address,
+                                         9).ok());
+  ASSERT_TRUE(platform->CopyHostToDevice(reinterpret_cast<uint8_t *>(sliced_numbers),
+                                         context->device_buffer(2).device_address + 3 * sizeof(uint32_t),
+                                         sizeof(sliced_numbers)).ok());
+  ASSERT_TRUE(context->GetResultRecordBatch(0, &result, 2).ok());
+  ASSERT_TRUE(result->ToRecordBatch(&out).ok());
+  ASSERT_TRUE(out->ValidateFull().ok());
+  strings = std::static_pointer_cast<arrow::StringArray>(out->column(0));
+  ASSERT_EQ(strings->GetString(0), "ab");
+  ASSERT_EQ(strings->GetString(1), "xyz");
+  ASSERT_EQ(std::static_pointer_cast<arrow::UInt32Array>(out->column(1))->Value(0), 7);
+  ASSERT_EQ(std::static_pointer_cast<arrow::UInt32Array>(out->column(1))->Value(1), 8);
+
+  // Results are no longer available once the context is destructed.
+  ASSERT_TRUE(context->GetResultRecordBatch(0, &result).ok());
+  context.reset();
+  ASSERT_FALSE(result->GetColumn(0, &column).ok());
+  ASSERT_TRUE(platform->Terminate().ok());
+}
+
+TEST(Cache, DeviceBufferCache) {
+  std::shared_ptr<fletcher::Platform> platform;
+  ASSERT_TRUE(fletcher::Platform::Make("echo", &platform, false).ok());
+  ASSERT_TRUE(platform->Init().ok());
+
+  // Room for two buffers of 128 bytes.
+  std::shared_ptr<fletcher::DeviceBufferCache> cache;
+  ASSERT_TRUE(fletcher::DeviceBufferCache::Make(&cache, platform, 256).ok());
+  auto dimension = MakeNumberBatch(0, 16);
+
+  // Two contexts using the same dimension table share its device copy.
+  da_t address;
+  for (int i = 0; i < 2; i++) {
+    std::shared_ptr<fletcher::Context> context;
+    ASSERT_TRUE(fletcher::Context::Make(&context, platform).ok());
+    context->set_buffer_cache(cache);
+    ASSERT_TRUE(context->QueueRecordBatch(dimension, fletcher::MemType::CACHE).ok());
+    ASSERT_TRUE(context->Enable().ok());
+    if (i == 0) {
+      address = context->device_buffer(0).device_address;
+    } else {
+      ASSERT_EQ(context->device_buffer(0).device_address, address);
+    }
+  }
+  ASSERT_EQ(cache->stats().hits, 1);
+  ASSERT_EQ(cache->stats().misses, 1);
+
+  // Changing the data requires invalidation.
+  auto values = dimension->column_data(0)->buffers[1];
+  da_t a, b, c;
+  cache->Invalidate(values->data());
+  ASSERT_EQ(cache->stats().entries, 0);
+  ASSERT_TRUE(cache->Acquire(values->data(), values->size(), &a).ok());
+  ASSERT_EQ(cache->stats().misses, 2);
+
+  // Exceeding the capacity evicts unreferenced copies in LRU order.
+  auto other = MakeNumberBatch(16, 16)->column_data(0)->buffers[1];
+  auto third = MakeNumberBatch(32, 16)->column_data(0)->buffers[1];
+  ASSERT_TRUE(cache->Acquire(other->data(), other->size(), &b).ok());
+  ASSERT_EQ(cache->Acquire(third->data(), third->size(), &c), fletcher::Status::DEVICE_OUT_OF_MEMORY());
+  ASSERT_TRUE(cache->Release(a).ok());
+  ASSERT_TRUE(cache->Acquire(third->data(), third->size(), &c).ok());
+  ASSERT_EQ(cache->stats().evictions, 1);
+  ASSERT_TRUE(cache->Release(b).ok());
+  ASSERT_TRUE(cache->Release(c).ok());
+
+  // Content hashing finds equal data at another address.
+  std::shared_ptr<fletcher::DeviceBufferCache> hashing;
+  ASSERT_TRUE(fletcher::DeviceBufferCache::Make(&hashing, platform, 0, true).ok());
+  auto copy = MakeNumberBatch(16, 16)->column_data(0)->buffers[1];
+  ASSERT_TRUE(hashing->Acquire(other->data(), other->size(), &a).ok());
+  ASSERT_TRUE(hashing->Acquire(copy->data(), copy->size(), &b).ok());
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(hashing->stats().hits, 1);
+  ASSERT_TRUE(hashing->Release(a).ok());
+  ASSERT_TRUE(hashing->Release(b).ok());
+
+  // Different contents with the same hash get their own device copy.
+  uint64_t zeros[] = {0, 0};
+  uint64_t colliding[] = {1, 0xDA99014159CFC058ull};
+  ASSERT_TRUE(hashing->Acquire(reinterpret_cast<uint8_t *>(zeros), sizeof(zeros), &a).ok());
+  ASSERT_TRUE(hashing->Acquire(reinterpret_cast<uint8_t *>(colliding), sizeof(colliding), &b).ok());
+  ASSERT_NE(a, b);
+  ASSERT_EQ(hashing->stats().hits, 1);
+  ASSERT_EQ(reinterpret_cast<uint64_t *>(b)[1], colliding[1]);
+  ASSERT_TRUE(hashing->Acquire(reinterpret_cast<uint8_t *>(colliding), sizeof(colliding), &c).ok());
+  ASSERT_EQ(c, b);
+  ASSERT_TRUE(hashing->Release(a).ok());
+  ASSERT_TRUE(hashing->Release(b).ok());
+  ASSERT_TRUE(hashing->Release(c).ok());
+  ASSERT_TRUE(platform->Terminate().ok());
+}